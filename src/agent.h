@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <string>
 #include <vector>
 
 #include "minesweeper.h"
@@ -14,4 +15,17 @@ class Agent {
   virtual Action step(const std::vector<Update>& updates, bool paused = false) {
     return {PASS, {0, 0}, 0};
   }
+  // Appends up to `max` actions that can all be applied before the next step, and returns how
+  // many. Appends nothing rather than a PASS. The default steps once.
+  virtual int step_many(const std::vector<Update>& updates, std::vector<Action>& actions, int max,
+                        bool paused = false) {
+    Action a = step(updates, paused);
+    if (a.action == PASS) {
+      return 0;
+    }
+    actions.push_back(a);
+    return 1;
+  }
+  // Anything worth printing after a benchmark, or empty.
+  virtual std::string stats() const { return ""; }
 };
@@ -6,16 +6,24 @@
 
 #include <absl/random/distributions.h>
 
+#include "bucket_grid.h"
+#include "bucket_kdtree.h"
+#include "flat_kdtree.h"
+#include "hilbert_queue.h"
+#include "kdtree.h"
 #include "minesweeper.h"
 #include "point.h"
 
 
-AgentLast::AgentLast(const Array2D<Cell>& state, int user)
-    : user_(user), state_(state) {
+template<class Tree>
+AgentLastT<Tree>::AgentLastT(
+    const Array2D<Cell>& state, int user, const Frontier* frontier, uint64_t seed)
+    : user_(user), state_(state), frontier_(frontier), bitgen_(seed) {
   reset();
 }
 
-void AgentLast::reset() {
+template<class Tree>
+void AgentLastT<Tree>::reset() {
   actions_.clear();
   rolling_action_ = {
       // Encourage it to start heading in a random direction. Forces agents to diverge.
@@ -24,7 +32,36 @@ void AgentLast::reset() {
   };
 }
 
-Action AgentLast::step(const std::vector<Update>& updates, bool paused) {
+template<class Tree>
+Action AgentLastT<Tree>::step(const std::vector<Update>& updates, bool paused) {
+  update(updates);
+  Action a;
+  if (!paused && next(a)) {
+    return a;
+  }
+  return Action{PASS, {0, 0}, user_};
+}
+
+template<class Tree>
+int AgentLastT<Tree>::step_many(
+    const std::vector<Update>& updates, std::vector<Action>& actions, int max, bool paused) {
+  // All from the same `rolling_action_`, so they spread out from there. They're all still hidden,
+  // so all valid, though opening one may cascade into opening the others first.
+  update(updates);
+  int n = 0;
+  Action a;
+  for (; !paused && n < max && next(a); n++) {
+    actions.push_back(a);
+  }
+  return n;
+}
+
+template<class Tree>
+void AgentLastT<Tree>::update(const std::vector<Update>& updates) {
+  // Removes go first, which only differs from going in order if an update leaves a cell hidden,
+  // eg unmarking, and it's still worth doing then.
+  removes_.clear();
+  inserts_.clear();
   for (auto u : updates) {
     if (u.state >= SCORE_ZERO) {
       continue;  // All neighbors are cleared, so nothing left to do.
@@ -35,7 +72,10 @@ Action AgentLast::step(const std::vector<Update>& updates, bool paused) {
       rolling_action_.x = rolling_action_.x * (1. - decay) + u.point.x * decay;
       rolling_action_.y = rolling_action_.y * (1. - decay) + u.point.y * decay;
     }
-    actions_.remove(u.point);
+    removes_.push_back(u.point);
+    if (frontier_) {
+      continue;
+    }
 
     for (Pointi n : Neighbors(u.point, state_.dims(), true)) {
       Cell nc = state_[n];
@@ -53,32 +93,56 @@ Action AgentLast::step(const std::vector<Update>& updates, bool paused) {
 
         for (Pointi nn : Neighbors(n, state_.dims(), false)) {
           if (state_[nn].state() == HIDDEN) {
-            actions_.insert({int(act), nn});
+            inserts_.push_back({int(act), nn});
           }
         }
       }
     }
   }
-
-  if (!paused) {
-    // if (!actions_.empty() && absl::Uniform(bitgen_, 0, 1000) == 0) {
-    //   actions_.validate();
-    //   std::cout << actions_.balance_str() << actions_;
-    // }
-
-    while (!actions_.empty()) {
-      KDTree::Value a = actions_.pop_closest(
-      // KDTree::Value a = actions_.find_closest(
-          // Rounding fixes a systematic bias towards the top left from truncating.
-          {int(std::round(rolling_action_.x)),
-           int(std::round(rolling_action_.y))});
-      if (state_[a.p].state() == HIDDEN) {
-        return {ActionType(a.value), a.p, user_};
-      } else {
-        actions_.remove(a.p);
+  if (frontier_) {
+    for (Action a : frontier_->fresh()) {
+      if (state_[a.point].state() == HIDDEN) {  // It may have been acted on since.
+        inserts_.push_back({int(a.action), a.point});
       }
     }
   }
+  actions_.remove_many(removes_);
+  actions_.insert_many(inserts_);
+}
 
-  return Action{PASS, {0, 0}, user_};
+template<class Tree>
+bool AgentLastT<Tree>::next(Action& action) {
+  // if (!actions_.empty() && absl::Uniform(bitgen_, 0, 1000) == 0) {
+  //   actions_.validate();
+  //   std::cout << actions_.balance_str() << actions_;
+  // }
+
+  while (!actions_.empty()) {
+    typename Tree::Value a = actions_.pop_closest(
+    // typename Tree::Value a = actions_.find_closest(
+        // Rounding fixes a systematic bias towards the top left from truncating.
+        {int(std::round(rolling_action_.x)),
+         int(std::round(rolling_action_.y))});
+    if (state_[a.p].state() == HIDDEN) {
+      action = {ActionType(a.value), a.p, user_};
+      return true;
+    } else {
+      actions_.remove(a.p);
+    }
+  }
+  return false;
 }
+
+template<class Tree>
+std::string AgentLastT<Tree>::stats() const {
+  if constexpr (kKDTreeStats && requires { actions_.stats(); }) {
+    return "kdtree: " + actions_.stats().str();
+  }
+  return "";
+}
+
+template class AgentLastT<KDTree>;
+template class AgentLastT<FlatKDTree>;
+template class AgentLastT<BucketKDTree>;
+template class AgentLastT<BucketGrid>;
+template class AgentLastT<HilbertQueue>;
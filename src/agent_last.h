@@ -1,27 +1,53 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
-#include "absl/random/random.h"
-
 #include "agent.h"
+#include "bucket_grid.h"
+#include "bucket_kdtree.h"
+#include "flat_kdtree.h"
+#include "frontier.h"
+#include "hilbert_queue.h"
 #include "kdtree.h"
 #include "minesweeper.h"
 #include "point.h"
+#include "random.h"
 
 
-class AgentLast : public Agent {
+// `Tree` holds the pending actions, and is `KDTree` or anything with the same interface, eg
+// `FlatKDTree`, `BucketKDTree`, `BucketGrid` or `HilbertQueue`. Instantiated for those in
+// agent_last.cc.
+//
+// With a `frontier` kept up to date by the environment, it takes the new actions from there
+// instead of working them out from the updates itself. Its `fresh` must be from the same steps as
+// the updates. A `seed` of 0 picks a random one, as for `Env`.
+template<class Tree>
+class AgentLastT final : public Agent {
  public:
-  AgentLast(const Array2D<Cell>& state, int user);
-  ~AgentLast() = default;
+  AgentLastT(const Array2D<Cell>& state, int user, const Frontier* frontier = nullptr,
+             uint64_t seed = 0);
+  ~AgentLastT() = default;
   void reset();
   Action step(const std::vector<Update>& updates, bool paused = false);
+  int step_many(const std::vector<Update>& updates, std::vector<Action>& actions, int max,
+                bool paused = false);
+  std::string stats() const;
 
  private:
+  void update(const std::vector<Update>& updates);  // Adds and removes pending actions.
+  bool next(Action& action);  // Pops the closest pending action that's still valid.
+
   int user_;
   const Array2D<Cell>& state_;
-  KDTree actions_;
+  const Frontier* frontier_;
+  Tree actions_;
+  // The changes to `actions_` from one step's updates, applied together.
+  std::vector<Pointi> removes_;
+  std::vector<typename Tree::Value> inserts_;
   Pointf rolling_action_;
-  absl::BitGen bitgen_;
+  Xoshiro256pp bitgen_;
 };
+
+typedef AgentLastT<KDTree> AgentLast;
@@ -5,8 +5,8 @@
 #include "point.h"
 
 
-AgentRandom::AgentRandom(const Array2D<Cell>& state, int user)
-    : user_(user), state_(state) {
+AgentRandom::AgentRandom(const Array2D<Cell>& state, int user, const Frontier* frontier)
+    : user_(user), state_(state), frontier_(frontier) {
   reset();
 }
 
@@ -15,6 +15,36 @@ void AgentRandom::reset() {
 }
 
 Action AgentRandom::step(const std::vector<Update>& updates, bool paused) {
+  update(updates);
+  Action a;
+  if (!paused && next(a)) {
+    return a;
+  }
+  return Action{PASS, {0, 0}, user_};
+}
+
+int AgentRandom::step_many(
+    const std::vector<Update>& updates, std::vector<Action>& actions, int max, bool paused) {
+  // The queue can have the same cell more than once, but `Env` ignores repeats.
+  update(updates);
+  int n = 0;
+  Action a;
+  for (; !paused && n < max && next(a); n++) {
+    actions.push_back(a);
+  }
+  return n;
+}
+
+void AgentRandom::update(const std::vector<Update>& updates) {
+  if (frontier_) {
+    for (Action a : frontier_->fresh()) {
+      if (state_[a.point].state() == HIDDEN) {  // It may have been acted on since.
+        actions_.push_back({a.action, a.point, user_});
+      }
+    }
+    return;
+  }
+
   // Compute the resulting valid actions.
   for (auto u : updates) {
     if (u.state >= SCORE_ZERO) {
@@ -43,19 +73,18 @@ Action AgentRandom::step(const std::vector<Update>& updates, bool paused) {
       }
     }
   }
+}
 
-  if (!paused) {
-    // Return an arbitrary valid action from the action queue.
-    while (!actions_.empty()) {
-      std::swap(actions_[actions_.size() - 1],
-                actions_[absl::Uniform(bitgen_, 0u, actions_.size())]);
-      Action a = actions_.back();
-      actions_.pop_back();
-      if (state_[a.point].state() == HIDDEN) {
-        return a;
-      }
+bool AgentRandom::next(Action& action) {
+  // Return an arbitrary valid action from the action queue.
+  while (!actions_.empty()) {
+    std::swap(actions_[actions_.size() - 1],
+              actions_[absl::Uniform(bitgen_, 0u, actions_.size())]);
+    action = actions_.back();
+    actions_.pop_back();
+    if (state_[action.point].state() == HIDDEN) {
+      return true;
     }
   }
-
-  return Action{PASS, {0, 0}, user_};
+  return false;
 }
@@ -6,20 +6,29 @@
 #include "absl/random/random.h"
 
 #include "agent.h"
+#include "frontier.h"
 #include "minesweeper.h"
 #include "point.h"
 
 
+// Takes a random valid action. With a `frontier`, it takes the valid actions from there, as
+// `AgentLast` does.
 class AgentRandom : public Agent {
  public:
-  AgentRandom(const Array2D<Cell>& state, int user);
+  AgentRandom(const Array2D<Cell>& state, int user, const Frontier* frontier = nullptr);
   ~AgentRandom() = default;
   void reset();
   Action step(const std::vector<Update>& updates, bool paused = false);
+  int step_many(const std::vector<Update>& updates, std::vector<Action>& actions, int max,
+                bool paused = false);
 
  private:
+  void update(const std::vector<Update>& updates);  // Adds the valid actions.
+  bool next(Action& action);  // Pops a random valid action.
+
   int user_;
   const Array2D<Cell>& state_;
+  const Frontier* frontier_;
   std::vector<Action> actions_;
   Pointf rolling_action_;
   absl::BitGen bitgen_;
@@ -0,0 +1,63 @@
+#include "agent_round.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "agent.h"
+#include "env.h"
+#include "frontier.h"
+#include "minesweeper.h"
+
+
+Action AgentRound::play(Env& env, const std::vector<std::unique_ptr<Agent>>& agents,
+                        const std::function<const std::vector<Update>&(int)>& agent_updates,
+                        std::vector<Update>& updates, bool paused) {
+  auto step_start = std::chrono::steady_clock::now();
+  int n = agents.size();
+  actions_.resize(n);
+  batches_.resize(n);
+  auto step_agent = [&](int a) {
+    if (step_many_ > 0) {
+      batches_[a].clear();
+      [[maybe_unused]] int taken =
+          agents[a]->step_many(agent_updates(a), batches_[a], step_many_, paused);
+      assert(taken == int(batches_[a].size()) && taken <= step_many_);
+    } else {
+      actions_[a] = agents[a]->step(agent_updates(a), paused);
+    }
+  };
+  for (int a = 0; a < std::min(serial_, n); a++) {
+    step_agent(a);
+  }
+  pool_.parallel_for(n - serial_, [&](int a) { step_agent(a + serial_); });
+  if (step_many_ > 0) {
+    actions_.clear();
+    for (const std::vector<Action>& batch : batches_) {
+      actions_.insert(actions_.end(), batch.begin(), batch.end());
+    }
+  }
+  step_time_ += std::chrono::steady_clock::now() - step_start;
+
+  // Only after every agent is done with them.
+  updates.clear();
+  if (Frontier* frontier = env.frontier()) {
+    frontier->next_round();
+  }
+  // Every action is applied, even after a control action. The agents have already given them up,
+  // and the frontier only reports each cell once, so a dropped one would never be taken again.
+  applied_.clear();
+  Action control = {PASS, {0, 0}, 0};
+  for (Action a : actions_) {
+    if (a.action == OPEN || a.action == MARK || a.action == UNMARK) {
+      applied_.push_back(a);
+      env.step(a, updates);
+    } else if (a.action != PASS && control.action == PASS) {
+      control = a;
+    }
+  }
+  return control;
+}
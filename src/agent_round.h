@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "agent.h"
+#include "env.h"
+#include "minesweeper.h"
+#include "thread.h"
+#include "update_router.h"
+
+
+// One round of play with several agents: each steps on its updates, then their actions are applied.
+//
+// The agents only read the board while stepping, so they step in parallel, and their actions are
+// applied afterwards in agent order. That plays the same game as stepping them one after another,
+// however many threads the pool has. The first `serial` agents always step on the calling thread,
+// eg the SFML agent, which owns the window.
+class AgentRound {
+ public:
+  // With `step_many`, each agent takes up to that many actions per round instead of one.
+  AgentRound(ThreadPool& pool, int serial = 0, int step_many = 0) :
+      pool_(pool), serial_(serial), step_many_(step_many) {}
+
+  // Steps each agent `a` on `agent_updates(a)`, then applies all their OPEN, MARK and UNMARK
+  // actions to `env` in agent order, replacing `updates` with what they changed. Returns the first
+  // RESET, PAUSE or QUIT for the caller to handle once they're applied, or otherwise PASS.
+  Action play(Env& env, const std::vector<std::unique_ptr<Agent>>& agents,
+              const std::function<const std::vector<Update>&(int)>& agent_updates,
+              std::vector<Update>& updates, bool paused = false);
+
+  // The actions applied by the last `play`, in order.
+  const std::vector<Action>& applied() const { return applied_; }
+  // Time spent stepping the agents, over all rounds.
+  std::chrono::steady_clock::duration step_time() const { return step_time_; }
+
+  // Plays a board to the end in rounds, with the agents `make_agents` makes for its `Env`, and
+  // returns the final state of each cell, row by row. The board is the same for every call with
+  // the same test seed. With a `router`, agent `a` only gets the updates for subscriber `a`. The
+  // actions applied are appended to `applied`, if given. Implemented in agent_round_test.cc for
+  // the tests, not allowed elsewhere.
+  static std::vector<CellState> play_to_end(
+      Pointi dims,
+      const std::function<std::vector<std::unique_ptr<Agent>>(Env& env)>& make_agents,
+      int step_many = 0, UpdateRouter* router = nullptr, int threads = 1,
+      std::vector<Action>* applied = nullptr);
+
+ private:
+  ThreadPool& pool_;
+  int serial_;
+  int step_many_;
+  std::vector<Action> actions_;  // One per agent, without `step_many`.
+  std::vector<std::vector<Action>> batches_;  // One per agent, with `step_many`.
+  std::vector<Action> applied_;
+  std::chrono::steady_clock::duration step_time_{0};
+};
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "catch2/catch_amalgamated.h"
+#include "agent.h"
+#include "agent_last.h"
+#include "agent_round.h"
+#include "env.h"
+#include "minesweeper.h"
+#include "point.h"
+#include "thread.h"
+#include "update_router.h"
+
+
+namespace {
+// Asks for a PAUSE on step `round`, and passes otherwise.
+class AgentPause : public Agent {
+ public:
+  AgentPause(int round) : round_(round), steps_(0) {}
+  Action step(const std::vector<Update>& updates, bool paused = false) {
+    return {steps_++ == round_ ? PAUSE : PASS, {0, 0}, 0};
+  }
+
+ private:
+  int round_;
+  int steps_;
+};
+}
+
+std::vector<CellState> AgentRound::play_to_end(
+    Pointi dims,
+    const std::function<std::vector<std::unique_ptr<Agent>>(Env& env)>& make_agents,
+    int step_many, UpdateRouter* router, int threads, std::vector<Action>* applied) {
+  Env env(dims, 0.1, Catch::getSeed() + 1);  // The same board each time, even for seed 0.
+  std::vector<std::unique_ptr<Agent>> agents = make_agents(env);
+  ThreadPool pool(threads);
+  AgentRound round(pool, 0, step_many);
+  std::vector<Update> updates = env.reset();
+  auto agent_updates = [router, &updates](int a) -> const std::vector<Update>& {
+    return router ? router->updates(a) : updates;
+  };
+  do {
+    if (router) {
+      router->route(updates);
+    }
+    REQUIRE(round.play(env, agents, agent_updates, updates).action == PASS);
+    REQUIRE(round.applied().size() <= agents.size() * std::max(1, step_many));
+    for (Action a : round.applied()) {
+      REQUIRE((a.action == OPEN || a.action == MARK));
+    }
+    if (applied) {
+      applied->insert(applied->end(), round.applied().begin(), round.applied().end());
+    }
+  } while (!round.applied().empty());
+
+  env.validate();
+  std::vector<CellState> out;
+  for (int y = 0; y < dims.y; y++) {
+    for (int x = 0; x < dims.x; x++) {
+      REQUIRE(env.state()(x, y).state() != BOMB);  // They only make safe moves.
+      out.push_back(env.state()(x, y).state());
+    }
+  }
+  return out;
+}
+
+
+TEST_CASE("AgentRound", "[agent_round]") {
+  // Stepping the agents in parallel plays the same game as stepping them one at a time.
+  Pointi dims(120, 60);
+  auto make_agents = [](Env& env) {
+    std::vector<std::unique_ptr<Agent>> agents;
+    for (int a = 0; a < 8; a++) {
+      agents.push_back(
+          std::make_unique<AgentLast>(env.state(), a + 1, nullptr, Catch::getSeed() + a + 1));
+    }
+    return agents;
+  };
+
+  for (int step_many : {0, 10}) {
+    CAPTURE(step_many);
+    std::vector<Action> serial, parallel;
+    std::vector<CellState> end = AgentRound::play_to_end(
+        dims, make_agents, step_many, nullptr, 1, &serial);
+    REQUIRE(serial.size() > 1000);
+    REQUIRE(AgentRound::play_to_end(dims, make_agents, step_many, nullptr, 4, &parallel) == end);
+    REQUIRE(parallel == serial);
+  }
+}
+
+TEST_CASE("AgentRound pause", "[agent_round]") {
+  // A PAUSE from one agent still applies the actions of the agents after it. They took them from
+  // the frontier, which doesn't report them again, so a dropped one would stay hidden for good.
+  Pointi dims(120, 60);
+  auto make_agents = [](Env& env, bool pause) {
+    env.enable_frontier();
+    std::vector<std::unique_ptr<Agent>> agents;
+    for (int a = 0; a < 4; a++) {
+      if (pause && a == 2) {
+        agents.push_back(std::make_unique<AgentPause>(5));
+      }
+      agents.push_back(std::make_unique<AgentLast>(
+          env.state(), a + 1, env.frontier(), Catch::getSeed() + a + 1));
+    }
+    return agents;
+  };
+
+  std::vector<Action> expected;
+  std::vector<CellState> end = AgentRound::play_to_end(
+      dims, [&](Env& env) { return make_agents(env, false); }, 0, nullptr, 1, &expected);
+
+  Env env(dims, 0.1, Catch::getSeed() + 1);  // The same board as `play_to_end`.
+  std::vector<std::unique_ptr<Agent>> agents = make_agents(env, true);
+  ThreadPool pool(1);
+  AgentRound round(pool);
+  std::vector<Update> updates = env.reset();
+  std::vector<Action> applied;
+  int pauses = 0;
+  do {
+    Action control = round.play(
+        env, agents, [&updates](int a) -> const std::vector<Update>& { return updates; }, updates);
+    pauses += (control.action == PAUSE);
+    applied.insert(applied.end(), round.applied().begin(), round.applied().end());
+  } while (!round.applied().empty());
+
+  REQUIRE(pauses == 1);
+  REQUIRE(applied == expected);
+  for (int y = 0; y < dims.y; y++) {
+    for (int x = 0; x < dims.x; x++) {
+      REQUIRE(env.state()(x, y).state() == end[y * dims.x + x]);
+    }
+  }
+}
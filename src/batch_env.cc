@@ -0,0 +1,120 @@
+#include "batch_env.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "env.h"
+#include "minesweeper.h"
+#include "no_guess.h"
+#include "point.h"
+#include "random.h"
+
+
+namespace {
+constexpr int kBlockSize = 64;  // Boards per parallel task.
+}
+
+BatchEnv::BatchEnv(int boards, Pointi dims, float bomb_percentage, uint64_t seed,
+                   bool no_guess, int threads) :
+    dims_(dims), bomb_percentage_(bomb_percentage), no_guess_(no_guess),
+    cells_(boards * Array2D<Cell>::storage_size(dims)), pool_(threads), steps_(0), games_{} {
+  assert(bomb_percentage > 0. && bomb_percentage < 1.);
+  Splitmix64 seeds(seed);
+  int stride = Array2D<Cell>::storage_size(dims);
+  boards_.reserve(boards);
+  for (int i = 0; i < boards; i++) {
+    boards_.push_back(Board{
+      .state = Array2D<Cell>(dims, cells_.data() + i * stride),
+      .bitgen = Xoshiro256pp(seeds()),
+      .updates = {},
+      .queue = {},
+      .remaining = 0,
+      .outcome = PLAYING,
+      .no_guess_failures = 0,
+    });
+  }
+}
+
+void BatchEnv::reset() {
+  int blocks = (size() + kBlockSize - 1) / kBlockSize;
+  pool_.parallel_for(blocks, [this](int block) {
+    int end = std::min(size(), (block + 1) * kBlockSize);
+    for (int i = block * kBlockSize; i < end; i++) {
+      reset(boards_[i]);
+    }
+  });
+}
+
+void BatchEnv::step(const std::vector<Action>& actions) {
+  assert(int(actions.size()) == size());
+  int blocks = (size() + kBlockSize - 1) / kBlockSize;
+  pool_.parallel_for(blocks, [this, &actions](int block) {
+    int end = std::min(size(), (block + 1) * kBlockSize);
+    for (int i = block * kBlockSize; i < end; i++) {
+      step(boards_[i], actions[i]);
+    }
+  });
+
+  for (const Board& b : boards_) {
+    if (b.outcome != PLAYING) {
+      games_[b.outcome] += 1;
+    }
+  }
+  for (const Action& a : actions) {
+    steps_ += (a.action == OPEN || a.action == MARK || a.action == UNMARK);
+  }
+}
+
+int64_t BatchEnv::no_guess_failures() const {
+  int64_t failures = 0;
+  for (const Board& b : boards_) {
+    failures += b.no_guess_failures;
+  }
+  return failures;
+}
+
+void BatchEnv::reset(Board& b) {
+  // A single thread each, as the boards are already spread across the threads.
+  bool failed = false;
+  Pointi start = Env::generate(b.state, bomb_percentage_, no_guess_, b.bitgen, 1,
+                               NoGuessSolver::kDefaultPasses, &failed);
+  b.no_guess_failures += failed;
+
+  b.remaining = 0;
+  for (int x = 0; x < dims_.x; x++) {
+    for (int y = 0; y < dims_.y; y++) {
+      b.remaining += !b.state(x, y).bomb_;
+    }
+  }
+
+  b.updates.clear();
+  Env::apply(b.state, {OPEN, start, 0}, b.queue, b.updates);
+  for (const Update& u : b.updates) {
+    b.remaining -= (u.state <= EIGHT);
+  }
+}
+
+void BatchEnv::step(Board& b, Action action) {
+  b.outcome = PLAYING;
+  b.updates.clear();
+  if (action.action == OPEN || action.action == MARK || action.action == UNMARK) {
+    Env::apply(b.state, action, b.queue, b.updates);
+    for (const Update& u : b.updates) {
+      if (u.state <= EIGHT) {
+        b.remaining -= 1;
+      } else if (u.state == BOMB) {
+        b.outcome = LOST;
+      }
+    }
+    if (b.outcome == PLAYING && b.remaining == 0) {
+      b.outcome = WON;
+    }
+  } else if (action.action == RESET || action.action == QUIT) {
+    b.outcome = ABANDONED;
+  }
+
+  if (b.outcome != PLAYING) {
+    reset(b);
+  }
+}
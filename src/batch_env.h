@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+#include "random.h"
+#include "thread.h"
+
+
+// Many same-sized boards in one allocation, stepped together in parallel. Meant for running
+// thousands of small games, eg to evaluate agents, where an `Env` per game would be mostly
+// overhead. Each board gets its own random generator, so results don't depend on the threads.
+class BatchEnv {
+ public:
+  enum Outcome : int8_t {
+    PLAYING = 0,
+    WON = 1,  // All non-bombs were opened.
+    LOST = 2,  // A bomb was opened.
+    ABANDONED = 3,  // It was reset by a RESET action.
+  };
+
+  BatchEnv(int boards, Pointi dims, float bomb_percentage, uint64_t seed = 0,
+           bool no_guess = false, int threads = 0);
+
+  // Resets all boards. `updates(i)` then returns the updates from opening board `i`.
+  void reset();
+  // Applies one action per board. Boards that finish are reset right away, so their `updates(i)`
+  // are the ones from the new board, and `outcome(i)` says how the previous one ended. PASS and
+  // PAUSE are ignored, and QUIT is treated as RESET.
+  void step(const std::vector<Action>& actions);
+
+  int size() const { return boards_.size(); }
+  Pointi dims() const { return dims_; }
+  // A view into the shared allocation, which is valid for the lifetime of the BatchEnv.
+  const Array2D<Cell>& state(int i) const { return boards_[i].state; }
+  const std::vector<Update>& updates(int i) const { return boards_[i].updates; }
+  Outcome outcome(int i) const { return boards_[i].outcome; }
+
+  // Totals since construction.
+  int64_t steps() const { return steps_; }
+  int64_t games(Outcome o) const { return games_[o]; }
+  // Boards that may need a guess, as in `Env::no_guess_failures`.
+  int64_t no_guess_failures() const;
+
+ private:
+  struct Board {
+    Array2D<Cell> state;
+    Xoshiro256pp bitgen;
+    std::vector<Update> updates;
+    std::vector<Action> queue;  // Scratch space for `Env::apply`.
+    int remaining;  // Non-bomb cells that are still hidden.
+    Outcome outcome;
+    int no_guess_failures;  // Per board, as boards are reset in parallel.
+  };
+
+  void reset(Board& b);
+  void step(Board& b, Action action);
+
+  Pointi dims_;
+  float bomb_percentage_;
+  bool no_guess_;
+  std::vector<Cell> cells_;
+  std::vector<Board> boards_;
+  ThreadPool pool_;
+  int64_t steps_;
+  int64_t games_[4];
+};
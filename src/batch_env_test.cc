@@ -0,0 +1,97 @@
+#include <memory>
+#include <vector>
+
+#include "absl/strings/str_format.h"
+
+#include "catch2/catch_amalgamated.h"
+#include "agent_last.h"
+#include "batch_env.h"
+#include "env.h"
+#include "minesweeper.h"
+#include "point.h"
+
+
+namespace {
+
+// A deterministic stand-in for an agent that loses often, to exercise the resets.
+std::vector<Action> scattered_actions(const BatchEnv& env, int step) {
+  std::vector<Action> actions;
+  for (int i = 0; i < env.size(); i++) {
+    Pointi p((step * 7 + i) % env.dims().x, (step * 13 + i * 3) % env.dims().y);
+    actions.push_back({(step % 5 == 0 ? MARK : OPEN), p, 1});
+  }
+  return actions;
+}
+
+}  // namespace
+
+TEST_CASE("batch env", "[batch_env]") {
+  Pointi dims(10, 8);
+
+  SECTION("Independent of the thread count") {
+    BatchEnv a(100, dims, 0.15, 42, false, 1);
+    BatchEnv b(100, dims, 0.15, 42, false, 4);
+    a.reset();
+    b.reset();
+    for (int step = 0; step < 200; step++) {
+      std::vector<Action> actions = scattered_actions(a, step);
+      a.step(actions);
+      b.step(actions);
+    }
+    REQUIRE(a.games(BatchEnv::LOST) > 0);
+    REQUIRE(a.games(BatchEnv::LOST) == b.games(BatchEnv::LOST));
+    REQUIRE(a.games(BatchEnv::WON) == b.games(BatchEnv::WON));
+    REQUIRE(a.steps() == b.steps());
+    for (int i = 0; i < a.size(); i++) {
+      for (int x = 0; x < dims.x; x++) {
+        for (int y = 0; y < dims.y; y++) {
+          CAPTURE(i, x, y);
+          REQUIRE(a.state(i)(x, y).state() == b.state(i)(x, y).state());
+        }
+      }
+    }
+  }
+
+  SECTION("Updates match the state") {
+    BatchEnv env(20, dims, 0.15, Catch::getSeed(), false, 2);
+    std::vector<FakeEnv> fakes(env.size(), FakeEnv(dims));
+    std::vector<std::unique_ptr<AgentLast>> agents;
+    for (int i = 0; i < env.size(); i++) {
+      agents.push_back(std::make_unique<AgentLast>(env.state(i), 1));
+    }
+
+    env.reset();
+    std::vector<Action> actions(env.size());
+    for (int step = 0; step < 500; step++) {
+      for (int i = 0; i < env.size(); i++) {
+        if (env.outcome(i) != BatchEnv::PLAYING) {
+          fakes[i].reset();
+          agents[i]->reset();
+        }
+        fakes[i].step(env.updates(i));
+        for (int x = 0; x < dims.x; x++) {
+          for (int y = 0; y < dims.y; y++) {
+            CAPTURE(step, i, x, y);
+            REQUIRE(env.state(i)(x, y).state() == fakes[i].state()(x, y).state());
+          }
+        }
+
+        actions[i] = agents[i]->step(env.updates(i));
+        if (actions[i].action == PASS) {
+          actions[i].action = RESET;  // Stuck, so give up on this one.
+        }
+      }
+      env.step(actions);
+    }
+    REQUIRE(env.games(BatchEnv::WON) + env.games(BatchEnv::ABANDONED) > 0);
+  }
+}
+
+TEST_CASE("batch env benchmark", "[batch_env]") {
+  BatchEnv env(10000, {16, 9}, 0.15, 42);
+  env.reset();
+  int step = 0;
+  BENCHMARK(absl::StrFormat("step %d boards", env.size())) {
+    env.step(scattered_actions(env, step++));
+  };
+}
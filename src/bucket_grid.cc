@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "bucket_grid.h"
+
+
+BucketGrid::BucketGrid() : width_(0), height_(0), count_(0) {}
+
+BucketGrid::BucketGrid(const std::vector<Value>& values) : BucketGrid() {
+  insert_many(values);
+}
+
+void BucketGrid::clear() {
+  // Keeps the grid and the pool's capacity.
+  std::fill(grid_.begin(), grid_.end(), NONE);
+  buckets_.clear();
+  free_buckets_.clear();
+  count_ = 0;
+}
+
+BucketGrid::Iterator BucketGrid::begin() const {
+  return Iterator(this, 0);
+}
+BucketGrid::Iterator BucketGrid::end() const {
+  return Iterator(this, grid_.size());
+}
+
+BucketGrid::Iterator::Iterator(const BucketGrid* grid, int cell)
+    : grid_(grid), cell_(cell), i_(0) {
+  settle();
+}
+
+BucketGrid::Iterator& BucketGrid::Iterator::operator++() {
+  i_++;
+  settle();
+  return *this;
+}
+BucketGrid::Iterator BucketGrid::Iterator::operator++(int) {
+  auto tmp = *this;
+  ++*this;
+  return tmp;
+}
+
+void BucketGrid::Iterator::settle() {
+  int cells = grid_->grid_.size();
+  for (; cell_ < cells; cell_++, i_ = 0) {
+    Id b = grid_->grid_[cell_];
+    if (b == NONE) {
+      continue;
+    }
+    const Bucket& bucket = grid_->buckets_[b];
+    for (; i_ < kBucketSize * kBucketSize; i_ = (i_ / kBucketSize + 1) * kBucketSize) {
+      if (uint32_t row = bucket.rows[i_ / kBucketSize] >> (i_ % kBucketSize)) {
+        i_ += std::countr_zero(row);
+        value_ = Value(bucket.value[i_], grid_->point_at(cell_, i_));
+        return;
+      }
+    }
+  }
+}
+
+
+int BucketGrid::cell_at(Pointi p) const {
+  if (p.x < 0 || p.y < 0 || p.x >= width_ * kBucketSize || p.y >= height_ * kBucketSize) {
+    return -1;
+  }
+  return p.y / kBucketSize * width_ + p.x / kBucketSize;
+}
+
+Pointi BucketGrid::point_at(int cell, int i) const {
+  return Pointi(cell % width_ * kBucketSize + i % kBucketSize,
+                cell / width_ * kBucketSize + i / kBucketSize);
+}
+
+void BucketGrid::grow(Pointi p) {
+  // Doubling, so points coming in from the far corner don't each copy the grid.
+  int width = std::max(width_, 1), height = std::max(height_, 1);
+  while (width * kBucketSize <= p.x) {
+    width *= 2;
+  }
+  while (height * kBucketSize <= p.y) {
+    height *= 2;
+  }
+  if (width == width_ && height == height_) {
+    return;
+  }
+  std::vector<Id> grid(width * height, NONE);
+  for (int y = 0; y < height_; y++) {
+    std::copy_n(grid_.begin() + y * width_, width_, grid.begin() + y * width);
+  }
+  grid_ = std::move(grid);
+  width_ = width;
+  height_ = height;
+}
+
+BucketGrid::Id BucketGrid::new_bucket() {
+  Id b;
+  if (!free_buckets_.empty()) {
+    b = free_buckets_.back();
+    free_buckets_.pop_back();
+  } else {
+    b = buckets_.size();
+    buckets_.emplace_back();
+  }
+  Bucket& bucket = buckets_[b];
+  std::fill_n(bucket.rows, kBucketSize, 0);
+  bucket.count = 0;
+  return b;
+}
+
+void BucketGrid::remove_at(int cell, int i) {
+  Bucket& b = buckets_[grid_[cell]];
+  assert(b.rows[i / kBucketSize] & (1u << (i % kBucketSize)));
+  b.rows[i / kBucketSize] &= ~(1u << (i % kBucketSize));
+  b.count -= 1;
+  count_ -= 1;
+  if (b.count == 0) {
+    free_buckets_.push_back(grid_[cell]);
+    grid_[cell] = NONE;
+  }
+}
+
+bool BucketGrid::insert(Value v) {
+  assert(v.p.x >= 0 && v.p.y >= 0);
+  grow(v.p);
+  int cell = cell_at(v.p);
+  if (grid_[cell] == NONE) {
+    grid_[cell] = new_bucket();
+  }
+  Bucket& b = buckets_[grid_[cell]];
+  int x = v.p.x % kBucketSize, y = v.p.y % kBucketSize;
+  if (b.rows[y] & (1u << x)) {
+    return false;  // Value already exists
+  }
+  b.rows[y] |= 1u << x;
+  b.value[y * kBucketSize + x] = v.value;
+  b.count += 1;
+  count_ += 1;
+  return true;
+}
+
+bool BucketGrid::remove(Pointi p) {
+  int cell = cell_at(p);
+  if (cell < 0 || grid_[cell] == NONE) {
+    return false;
+  }
+  int x = p.x % kBucketSize, y = p.y % kBucketSize;
+  if (!(buckets_[grid_[cell]].rows[y] & (1u << x))) {
+    return false;
+  }
+  remove_at(cell, y * kBucketSize + x);
+  return true;
+}
+
+int BucketGrid::insert_many(std::span<const Value> values) {
+  int inserted = 0;
+  for (const Value& v : values) {
+    inserted += insert(v);
+  }
+  return inserted;
+}
+
+int BucketGrid::remove_many(std::span<const Pointi> points) {
+  int removed = 0;
+  for (Pointi p : points) {
+    removed += remove(p);
+  }
+  return removed;
+}
+
+bool BucketGrid::exists(Pointi p) const {
+  return bool(find(p));
+}
+
+std::optional<BucketGrid::Value> BucketGrid::find(Pointi p) const {
+  int cell = cell_at(p);
+  if (cell < 0 || grid_[cell] == NONE) {
+    return std::nullopt;
+  }
+  const Bucket& b = buckets_[grid_[cell]];
+  int x = p.x % kBucketSize, y = p.y % kBucketSize;
+  if (!(b.rows[y] & (1u << x))) {
+    return std::nullopt;
+  }
+  return Value(b.value[y * kBucketSize + x], p);
+}
+
+BucketGrid::Value BucketGrid::find_closest(Pointi p) {
+  int cell, i;
+  find_closest(p, cell, i);
+  return Value(buckets_[grid_[cell]].value[i], point_at(cell, i));
+}
+
+BucketGrid::Value BucketGrid::pop_closest(Pointi p) {
+  int cell, i;
+  find_closest(p, cell, i);
+  Value out(buckets_[grid_[cell]].value[i], point_at(cell, i));
+  remove_at(cell, i);
+  return out;
+}
+
+void BucketGrid::find_closest(Pointi p, int& cell, int& i) const {
+  assert(count_ > 0);
+  int best_dist = std::numeric_limits<int>::max();
+  auto visit = [this, p, &best_dist, &cell, &i](int x, int y) {
+    int c = y * width_ + x;
+    if (grid_[c] == NONE) {
+      return;
+    }
+    // The distance to the bucket's cells is a lower bound for any point in it.
+    int left = x * kBucketSize, top = y * kBucketSize;
+    int dx = std::max({0, left - p.x, p.x - (left + kBucketSize - 1)});
+    int dy = std::max({0, top - p.y, p.y - (top + kBucketSize - 1)});
+    if (dx + dy < best_dist) {
+      closest_in_bucket(c, p, best_dist, cell, i);
+    }
+  };
+
+  // Rings of buckets around the one `p` is in, or nearest to. Every bucket in ring `r` is at
+  // least `(r - 1) * kBucketSize + 1` away along some axis.
+  int cx = std::clamp(p.x, 0, width_ * kBucketSize - 1) / kBucketSize;
+  int cy = std::clamp(p.y, 0, height_ * kBucketSize - 1) / kBucketSize;
+  for (int r = 0; r == 0 || (r - 1) * kBucketSize + 1 < best_dist; r++) {
+    if (cx - r < 0 && cy - r < 0 && cx + r >= width_ && cy + r >= height_) {
+      break;  // Past the whole grid.
+    }
+    for (int x = std::max(cx - r, 0); x <= std::min(cx + r, width_ - 1); x++) {
+      if (cy - r >= 0) {
+        visit(x, cy - r);
+      }
+      if (r > 0 && cy + r < height_) {
+        visit(x, cy + r);
+      }
+    }
+    for (int y = std::max(cy - r + 1, 0); y <= std::min(cy + r - 1, height_ - 1); y++) {
+      if (cx - r >= 0) {
+        visit(cx - r, y);
+      }
+      if (cx + r < width_) {
+        visit(cx + r, y);
+      }
+    }
+  }
+  assert(best_dist < std::numeric_limits<int>::max());
+}
+
+void BucketGrid::closest_in_bucket(
+    int cell, Pointi p, int& best_dist, int& best_cell, int& best_i) const {
+  const Bucket& b = buckets_[grid_[cell]];
+  int left = cell % width_ * kBucketSize, top = cell / width_ * kBucketSize;
+  int c = p.x - left;  // The column of `p`, which may be outside the bucket.
+  for (int y = 0; y < kBucketSize; y++) {
+    uint32_t row = b.rows[y];
+    int dy = std::abs(p.y - (top + y));
+    if (row == 0 || dy >= best_dist) {
+      continue;
+    }
+    // The nearest set bit at or after column `c`, and before it.
+    int x;
+    if (c < 0) {
+      x = std::countr_zero(row);
+    } else if (c >= kBucketSize) {
+      x = kBucketSize - 1 - std::countl_zero(row);
+    } else {
+      uint32_t after = row >> c;
+      uint32_t before = row & ((1u << c) - 1);
+      int to_right = after ? std::countr_zero(after) : kBucketSize;
+      int to_left = before ? c - (kBucketSize - 1 - std::countl_zero(before)) : kBucketSize;
+      x = to_right <= to_left ? c + to_right : c - to_left;
+    }
+    int dist = dy + std::abs(c - x);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best_cell = cell;
+      best_i = y * kBucketSize + x;
+    }
+  }
+}
+
+
+void BucketGrid::print_tree(std::ostream& stream) const {
+  // One line per bucket, as the values come in bucket order.
+  int last = -1;
+  for (const Value& v : *this) {
+    int cell = cell_at(v.p);
+    if (cell != last) {
+      stream << (last >= 0 ? "]\n" : "") << Pointi(cell % width_, cell / width_) << ": [" << v;
+      last = cell;
+    } else {
+      stream << ", " << v;
+    }
+  }
+  if (last >= 0) {
+    stream << "]" << std::endl;
+  }
+}
+
+std::ostream& operator<<(std::ostream& stream, const BucketGrid& t) {
+  t.print_tree(stream);
+  return stream;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include "kdtree.h"
+#include "point.h"
+
+
+// A uniform grid of `kBucketSize` x `kBucketSize` buckets, for points on a bounded lattice like
+// the board, where a general KDTree is more than needed. Each bucket keeps a bitmap of which of
+// its cells are set, one word per row, so finding the closest set cell in a row is a couple of
+// bit scans, and `find_closest` checks the buckets in rings around the query until the next ring
+// can't be closer. It has the same interface as `KDTree`, so they can be swapped, eg in
+// `AgentLastT`.
+//
+// Points must not be negative. The grid grows to fit the points inserted, but bucket storage is
+// only allocated for buckets with points in them, and reused once they empty.
+class BucketGrid {
+ public:
+  typedef KDTree::Value Value;
+  static constexpr int kBucketSize = 32;
+
+ private:
+  typedef uint32_t Id;
+  static constexpr Id NONE = UINT32_MAX;
+
+  struct alignas(64) Bucket {
+    uint32_t rows[kBucketSize];  // Bit `x` of `rows[y]` is set if the cell at (x, y) is.
+    int value[kBucketSize * kBucketSize];  // At `y * kBucketSize + x`.
+    int count;
+  };
+
+ public:
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Value;
+    using pointer = Value*;
+    using reference = Value&;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() : grid_(nullptr), cell_(0), i_(0) {}
+    Iterator(const BucketGrid* grid, int cell);
+
+    const Value& operator*() const { return value_; }
+    const Value* operator->() const { return &value_; }
+    Iterator& operator++();
+    Iterator operator++(int);
+    bool operator==(const Iterator& o) const { return cell_ == o.cell_ && i_ == o.i_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+   private:
+    void settle();  // Moves to the next set cell, if the current one isn't.
+
+    const BucketGrid* grid_;
+    int cell_;  // Index into `grid_`.
+    int i_;  // Cell in the bucket, as `y * kBucketSize + x`.
+    Value value_;
+  };
+  typedef const Iterator const_iterator;
+
+  BucketGrid();
+  BucketGrid(const std::vector<Value>& values);
+
+  bool empty() const { return count_ == 0; }
+  int size() const { return count_; }
+  void clear();
+
+  Iterator begin() const;
+  Iterator end() const;
+
+  bool insert(Value v);
+  bool remove(Pointi p);
+  // One at a time, as each only touches one bucket.
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Pointi> points);
+  bool exists(Pointi p) const;
+  std::optional<Value> find(Pointi p) const;
+  Value find_closest(Pointi p);
+  Value pop_closest(Pointi p);
+
+  void print_tree(std::ostream& stream = std::cout) const;
+  void validate() const;  // Implemented and used in bucket_grid_test.cc, not allowed elsewhere.
+
+ private:
+  // The grid cell holding `p`, or -1 if it's outside the grid.
+  int cell_at(Pointi p) const;
+  // The point of cell `i`, as `y * kBucketSize + x`, of the bucket at grid cell `cell`.
+  Pointi point_at(int cell, int i) const;
+  void grow(Pointi p);  // Until `p` is inside the grid.
+  Id new_bucket();
+  // Clears cell `i` of the bucket at grid cell `cell`, which must be set.
+  void remove_at(int cell, int i);
+  // The closest set cell to `p` in the bucket at grid cell `cell`, if closer than `best_dist`.
+  void closest_in_bucket(int cell, Pointi p, int& best_dist, int& best_cell, int& best_i) const;
+  // The grid cell and index in its bucket of the value closest to `p`.
+  void find_closest(Pointi p, int& cell, int& i) const;
+
+  std::vector<Id> grid_;  // Buckets in row-major order, `width_` by `height_`.
+  int width_;
+  int height_;
+  std::vector<Bucket> buckets_;
+  std::vector<Id> free_buckets_;
+  int count_;
+};
+
+std::ostream& operator<<(std::ostream& stream, const BucketGrid& t);
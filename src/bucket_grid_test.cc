@@ -0,0 +1,42 @@
+#include <bit>
+
+#include "bucket_grid.h"
+#include "catch2/catch_amalgamated.h"
+#include "point.h"
+
+
+void BucketGrid::validate() const {
+  REQUIRE(int(grid_.size()) == width_ * height_);
+  int count = 0, used = 0;
+  for (Id b : grid_) {
+    if (b == NONE) {
+      continue;
+    }
+    int bits = 0;
+    for (uint32_t row : buckets_[b].rows) {
+      bits += std::popcount(row);
+    }
+    REQUIRE(bits > 0);  // Empty buckets are freed.
+    REQUIRE(buckets_[b].count == bits);
+    count += bits;
+    used += 1;
+  }
+  REQUIRE(count == count_);
+  REQUIRE(buckets_.size() == used + free_buckets_.size());
+}
+
+
+TEST_CASE("BucketGrid far apart", "[kdtree]") {
+  // The rings have to go a long way out, past empty buckets and off the grid.
+  BucketGrid grid;
+  REQUIRE(grid.begin() == grid.end());
+  REQUIRE(grid.insert({1, {1000, 5}}));
+  REQUIRE(grid.insert({2, {3, 700}}));
+  grid.validate();
+  REQUIRE(grid.find_closest({0, 0}).value == 2);
+  REQUIRE(grid.find_closest({900, 900}).value == 1);
+  REQUIRE(grid.pop_closest({-100, 800}).value == 2);
+  REQUIRE(grid.pop_closest({0, 0}).value == 1);
+  REQUIRE(grid.empty());
+  grid.validate();
+}
@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "bucket_kdtree.h"
+
+
+static_assert(BucketKDTree::kBucketSize <= 32, "find_slot uses a 32 bit mask.");
+
+namespace {
+// `1 << i` for each slot. SSE2 has no shift by a different amount per lane, so the mask loops only
+// vectorize by ANDing the comparisons with these.
+constexpr std::array<uint32_t, BucketKDTree::kBucketSize> kSlotBits = [] {
+  std::array<uint32_t, BucketKDTree::kBucketSize> bits;
+  for (int i = 0; i < BucketKDTree::kBucketSize; i++) {
+    bits[i] = 1u << i;
+  }
+  return bits;
+}();
+}
+
+BucketKDTree::BucketKDTree() : root_(NONE), count_(0), leaves_(0) {}
+
+BucketKDTree::BucketKDTree(const std::vector<Value>& values) : BucketKDTree() {
+  for (const auto& v : values) {
+    insert(v);
+  }
+}
+
+void BucketKDTree::clear() {
+  // Keeps the pools' capacity.
+  nodes_.clear();
+  buckets_.clear();
+  free_nodes_.clear();
+  free_buckets_.clear();
+  root_ = NONE;
+  count_ = 0;
+  leaves_ = 0;
+}
+
+BucketKDTree::Iterator BucketKDTree::begin() const {
+  return Iterator(this, 0);
+}
+BucketKDTree::Iterator BucketKDTree::end() const {
+  return Iterator(this, buckets_.size());
+}
+
+BucketKDTree::Iterator::Iterator(const BucketKDTree* tree, int bucket) :
+    tree_(tree), bucket_(bucket), slot_(0) {
+  settle();
+}
+
+BucketKDTree::Iterator& BucketKDTree::Iterator::operator++() {
+  slot_++;
+  settle();
+  return *this;
+}
+BucketKDTree::Iterator BucketKDTree::Iterator::operator++(int){
+  auto tmp = *this;
+  ++*this;
+  return tmp;
+}
+
+void BucketKDTree::Iterator::settle() {
+  // Free buckets have a count of 0, so are skipped too.
+  int buckets = tree_->buckets_.size();
+  while (bucket_ < buckets && slot_ >= tree_->buckets_[bucket_].count) {
+    bucket_++;
+    slot_ = 0;
+  }
+  if (bucket_ < buckets) {
+    const Bucket& b = tree_->buckets_[bucket_];
+    value_ = Value(b.value[slot_], {b.x[slot_], b.y[slot_]});
+  }
+}
+
+
+BucketKDTree::Id BucketKDTree::new_node() {
+  if (!free_nodes_.empty()) {
+    Id n = free_nodes_.back();
+    free_nodes_.pop_back();
+    return n;
+  }
+  assert(nodes_.size() < NONE);
+  nodes_.push_back(Node{});
+  return nodes_.size() - 1;
+}
+
+BucketKDTree::Id BucketKDTree::new_leaf() {
+  Id b;
+  if (!free_buckets_.empty()) {
+    b = free_buckets_.back();
+    free_buckets_.pop_back();
+  } else {
+    b = buckets_.size();
+    buckets_.push_back(Bucket{});
+  }
+  Bucket& bucket = buckets_[b];
+  std::fill_n(bucket.x, kBucketSize, kFar);
+  std::fill_n(bucket.y, kBucketSize, kFar);
+  bucket.count = 0;
+
+  Id n = new_node();
+  nodes_[n] = Node{0, 0, {NONE, NONE}, b};
+  leaves_ += 1;
+  return n;
+}
+
+void BucketKDTree::free_node(Id n) {
+  if (Id b = nodes_[n].bucket; b != NONE) {
+    buckets_[b].count = 0;
+    free_buckets_.push_back(b);
+    leaves_ -= 1;
+  }
+  free_nodes_.push_back(n);
+}
+
+bool BucketKDTree::insert(Value v) {
+  if (root_ == NONE) {
+    root_ = new_leaf();
+  }
+  Id leaf = find_leaf(v.p, true);
+  Bucket& b = buckets_[nodes_[leaf].bucket];
+  if (find_slot(b, v.p) >= 0) {
+    return false; // Value already exists
+  }
+  b.x[b.count] = v.p.x;
+  b.y[b.count] = v.p.y;
+  b.value[b.count] = v.value;
+  b.count += 1;
+  count_ += 1;
+
+  if (b.count == kBucketSize) {
+    split(leaf);
+    // A balanced tree has a depth of about `bit_width(leaves)`.
+    if (int(path_.size()) + 1 > 2 * int(std::bit_width(unsigned(leaves_))) + 2) {
+      rebalance();
+    }
+  }
+  return true;
+}
+
+bool BucketKDTree::remove(Pointi p) {
+  if (root_ == NONE) {
+    return false;
+  }
+  Id leaf = find_leaf(p, true);
+  Bucket& b = buckets_[nodes_[leaf].bucket];
+  int slot = find_slot(b, p);
+  if (slot < 0) {
+    return false;
+  }
+  remove_slot(b, slot);
+  count_ -= 1;
+  if (count_ == 0) {
+    clear();
+  } else if (b.count <= kBucketSize / 4 && !path_.empty()) {
+    merge(path_.back());
+  }
+  return true;
+}
+
+int BucketKDTree::insert_many(std::span<const Value> values) {
+  int inserted = 0;
+  for (const Value& v : values) {
+    inserted += insert(v);
+  }
+  return inserted;
+}
+
+int BucketKDTree::remove_many(std::span<const Pointi> points) {
+  int removed = 0;
+  for (Pointi p : points) {
+    removed += remove(p);
+  }
+  return removed;
+}
+
+bool BucketKDTree::exists(Pointi p) const {
+  return bool(find(p));
+}
+
+std::optional<BucketKDTree::Value> BucketKDTree::find(Pointi p) const {
+  if (root_ == NONE) {
+    return {};
+  }
+  const Bucket& b = buckets_[nodes_[find_leaf(p)].bucket];
+  int slot = find_slot(b, p);
+  if (slot < 0) {
+    return {};
+  }
+  return Value(b.value[slot], p);
+}
+
+BucketKDTree::Value BucketKDTree::find_closest(Pointi p) {
+  assert(root_ != NONE);
+  int best_dist = std::numeric_limits<int>::max();
+  Id best_bucket = NONE;
+  int best_slot = -1;
+  find_closest(root_, p, best_dist, best_bucket, best_slot);
+  assert(best_bucket != NONE);
+  const Bucket& b = buckets_[best_bucket];
+  return Value(b.value[best_slot], {b.x[best_slot], b.y[best_slot]});
+}
+
+BucketKDTree::Value BucketKDTree::pop_closest(Pointi p) {
+  Value out = find_closest(p);
+  remove(out.p);
+  return out;
+}
+
+BucketKDTree::Id BucketKDTree::find_leaf(Pointi p, bool record_path) {
+  path_.clear();
+  Id n = root_;
+  while (nodes_[n].bucket == NONE) {
+    if (record_path) {
+      path_.push_back(n);
+    }
+    const Node& node = nodes_[n];
+    n = node.children[p.coords[node.axis] >= node.split];
+  }
+  return n;
+}
+
+BucketKDTree::Id BucketKDTree::find_leaf(Pointi p) const {
+  Id n = root_;
+  while (nodes_[n].bucket == NONE) {
+    const Node& node = nodes_[n];
+    n = node.children[p.coords[node.axis] >= node.split];
+  }
+  return n;
+}
+
+int BucketKDTree::find_slot(const Bucket& b, Pointi p) {
+  // Compares every slot, without branches. Empty slots are at `kFar` so never match.
+  uint32_t mask = 0;
+  for (int i = 0; i < kBucketSize; i++) {
+    mask |= kSlotBits[i] & -uint32_t((b.x[i] == p.x) & (b.y[i] == p.y));
+  }
+  return mask ? std::countr_zero(mask) : -1;
+}
+
+int BucketKDTree::closest_slot(const Bucket& b, Pointi p, int& dist) {
+  // Fixed size loops over the whole bucket, so they vectorize fully. Empty slots are at `kFar`,
+  // so never the closest in a non-empty bucket.
+  int d[kBucketSize];
+  for (int i = 0; i < kBucketSize; i++) {
+    d[i] = std::abs(b.x[i] - p.x) + std::abs(b.y[i] - p.y);  // manhattan distance
+  }
+  int best = d[0];
+  for (int i = 1; i < kBucketSize; i++) {
+    best = std::min(best, d[i]);
+  }
+  uint32_t mask = 0;
+  for (int i = 0; i < kBucketSize; i++) {
+    mask |= kSlotBits[i] & -uint32_t(d[i] == best);
+  }
+  dist = best;
+  return std::countr_zero(mask);
+}
+
+void BucketKDTree::find_closest(
+    Id node, Pointi p, int& best_dist, Id& best_bucket, int& best_slot) const {
+  const Node& n = nodes_[node];
+  if (n.bucket != NONE) {
+    const Bucket& b = buckets_[n.bucket];
+    if (b.count > 0) {
+      int dist;
+      int slot = closest_slot(b, p, dist);
+      if (dist < best_dist) {
+        best_dist = dist;
+        best_bucket = n.bucket;
+        best_slot = slot;
+      }
+    }
+    return;
+  }
+
+  int diff = p.coords[n.axis] - n.split;
+  int search_first = (diff >= 0 ? 1 : 0);
+  find_closest(n.children[search_first], p, best_dist, best_bucket, best_slot);
+  // How far the other side is along this axis at least.
+  int bound = (search_first ? diff + 1 : -diff);
+  if (bound < best_dist) {
+    find_closest(n.children[!search_first], p, best_dist, best_bucket, best_slot);
+  }
+}
+
+void BucketKDTree::remove_slot(Bucket& b, int slot) {
+  int last = b.count - 1;
+  b.x[slot] = b.x[last];
+  b.y[slot] = b.y[last];
+  b.value[slot] = b.value[last];
+  b.x[last] = kFar;
+  b.y[last] = kFar;
+  b.count -= 1;
+}
+
+void BucketKDTree::split(Id leaf) {
+  Id old_bucket = nodes_[leaf].bucket;
+  values_.clear();
+  for (int i = 0; i < buckets_[old_bucket].count; i++) {
+    const Bucket& b = buckets_[old_bucket];
+    values_.push_back(Value(b.value[i], {b.x[i], b.y[i]}));
+  }
+  int axis, split;
+  auto mid = partition(values_.begin(), values_.end(), axis, split);
+
+  // Allocating may move the pools, so no references are held across these.
+  Id children[2] = {new_leaf(), new_leaf()};
+  auto ranges = {std::pair(values_.begin(), mid), std::pair(mid, values_.end())};
+  int c = 0;
+  for (auto [start, end] : ranges) {
+    Bucket& b = buckets_[nodes_[children[c++]].bucket];
+    for (auto it = start; it != end; ++it) {
+      b.x[b.count] = it->p.x;
+      b.y[b.count] = it->p.y;
+      b.value[b.count] = it->value;
+      b.count += 1;
+    }
+  }
+
+  buckets_[old_bucket].count = 0;
+  free_buckets_.push_back(old_bucket);
+  leaves_ -= 1;
+  nodes_[leaf] = Node{split, axis, {children[0], children[1]}, NONE};
+}
+
+void BucketKDTree::merge(Id parent) {
+  Node& n = nodes_[parent];
+  Id left = n.children[0];
+  Id right = n.children[1];
+  if (nodes_[left].bucket == NONE || nodes_[right].bucket == NONE) {
+    return;
+  }
+  Bucket& a = buckets_[nodes_[left].bucket];
+  const Bucket& b = buckets_[nodes_[right].bucket];
+  if (a.count + b.count > kBucketSize / 2) {
+    return;
+  }
+  for (int i = 0; i < b.count; i++) {
+    a.x[a.count] = b.x[i];
+    a.y[a.count] = b.y[i];
+    a.value[a.count] = b.value[i];
+    a.count += 1;
+  }
+  // The parent becomes a leaf with the left bucket.
+  n = Node{0, 0, {NONE, NONE}, nodes_[left].bucket};
+  free_nodes_.push_back(left);
+  free_node(right);
+}
+
+std::vector<BucketKDTree::Value>::iterator BucketKDTree::partition(
+    std::vector<Value>::iterator start, std::vector<Value>::iterator end, int& axis, int& split) {
+  assert(end - start >= 2);
+  Pointi lo = start->p, hi = start->p;
+  for (auto it = start; it != end; ++it) {
+    lo = Pointi(std::min(lo.x, it->p.x), std::min(lo.y, it->p.y));
+    hi = Pointi(std::max(hi.x, it->p.x), std::max(hi.y, it->p.y));
+  }
+  // The points are unique, so the wider axis has some spread.
+  axis = (hi.x - lo.x >= hi.y - lo.y ? 0 : 1);
+  auto mid = start + (end - start) / 2;
+  std::nth_element(start, mid, end, [axis](const Value& a, const Value& b) {
+      return a.p.coords[axis] < b.p.coords[axis]; });
+  split = mid->p.coords[axis];
+  if (split == lo.coords[axis]) {
+    split += 1;  // Otherwise the left side would be empty.
+  }
+  int s = split;
+  return std::partition(start, end, [axis, s](const Value& v) { return v.p.coords[axis] < s; });
+}
+
+void BucketKDTree::rebalance() {
+  values_.clear();
+  values_.reserve(count_);
+  for (Value v : *this) {
+    values_.push_back(v);
+  }
+  clear();
+  root_ = build(values_.begin(), values_.end());
+  count_ = values_.size();
+}
+
+BucketKDTree::Id BucketKDTree::build(
+    std::vector<Value>::iterator start, std::vector<Value>::iterator end) {
+  if (start == end) {
+    return NONE;
+  }
+  if (end - start <= kBucketSize / 2) {
+    // Leave room for inserts before it needs splitting.
+    Id n = new_leaf();
+    Bucket& b = buckets_[nodes_[n].bucket];
+    for (auto it = start; it != end; ++it) {
+      b.x[b.count] = it->p.x;
+      b.y[b.count] = it->p.y;
+      b.value[b.count] = it->value;
+      b.count += 1;
+    }
+    return n;
+  }
+  int axis, split;
+  auto mid = partition(start, end, axis, split);
+  Id n = new_node();
+  Id left = build(start, mid);
+  Id right = build(mid, end);
+  nodes_[n] = Node{split, axis, {left, right}, NONE};
+  return n;
+}
+
+int BucketKDTree::depth_max() const {
+  return root_ == NONE ? 0 : depth_max(root_);
+}
+int BucketKDTree::depth_max(Id node) const {
+  const Node& n = nodes_[node];
+  if (n.bucket != NONE) {
+    return 0;
+  }
+  return 1 + std::max(depth_max(n.children[0]), depth_max(n.children[1]));
+}
+
+void BucketKDTree::print_tree(std::ostream& stream) const {
+  if (root_ != NONE) {
+    print_tree(stream, root_, "");
+  }
+}
+
+std::ostream& operator<<(std::ostream& stream, const BucketKDTree& t) {
+  t.print_tree(stream);
+  return stream;
+}
+
+void BucketKDTree::print_tree(std::ostream& stream, Id node, std::string prefix) const {
+  const Node& n = nodes_[node];
+  if (n.bucket != NONE) {
+    const Bucket& b = buckets_[n.bucket];
+    stream << prefix << "[";
+    for (int i = 0; i < b.count; i++) {
+      stream << (i ? ", " : "") << Value(b.value[i], {b.x[i], b.y[i]});
+    }
+    stream << "]" << std::endl;
+    return;
+  }
+  stream << prefix << (n.axis ? "y < " : "x < ") << n.split << std::endl;
+  print_tree(stream, n.children[0], prefix + "│ ");
+  print_tree(stream, n.children[1], prefix + "  ");
+}
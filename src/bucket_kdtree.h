@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include "kdtree.h"
+#include "point.h"
+
+
+// A KDTree whose leaves hold buckets of up to `kBucketSize` points, instead of one point per node.
+// Near the leaves the recursion in `KDTree::find_closest` is mostly overhead, whereas a bucket is
+// scanned in one go: its coordinates are kept in separate x and y arrays of a fixed size, so the
+// loops over a bucket have no branches or remainder, and GCC vectorizes them with plain SSE2 (see
+// `-fopt-info-vec-optimized`). It has the same interface as `KDTree`, so they can be swapped, eg
+// in `AgentLastT`.
+//
+// A full bucket is split at the median along its wider axis, and a bucket that gets nearly empty
+// is merged with its sibling. Splits only ever deepen the tree locally, so it's rebuilt if a leaf
+// gets much deeper than a balanced tree would be.
+class BucketKDTree {
+ public:
+  typedef KDTree::Value Value;
+  static constexpr int kBucketSize = 32;
+
+ private:
+  typedef uint32_t Id;
+  static constexpr Id NONE = UINT32_MAX;
+
+  struct Node {
+    int split;  // Points with `coords[axis] < split` are on the left.
+    int axis;
+    Id children[2];
+    Id bucket;  // Only set for leaves.
+  };
+
+  struct alignas(64) Bucket {
+    int32_t x[kBucketSize];
+    int32_t y[kBucketSize];
+    int value[kBucketSize];
+    int count;
+  };
+
+ public:
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Value;
+    using pointer = Value*;
+    using reference = Value&;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() : tree_(nullptr), bucket_(0), slot_(0) {}
+    Iterator(const BucketKDTree* tree, int bucket);
+
+    const Value& operator*() const { return value_; }
+    const Value* operator->() const { return &value_; }
+    Iterator& operator++();
+    Iterator operator++(int);
+    bool operator==(const Iterator& o) const { return bucket_ == o.bucket_ && slot_ == o.slot_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+   private:
+    void settle();  // Moves to the next filled slot, if the current one isn't.
+
+    const BucketKDTree* tree_;
+    int bucket_;
+    int slot_;
+    Value value_;  // The values are stored split up, so assemble the current one.
+  };
+  typedef const Iterator const_iterator;
+
+  BucketKDTree();
+  BucketKDTree(const std::vector<Value>& values);
+
+  bool empty() const { return count_ == 0; }
+  int size() const { return count_; }
+  void clear();
+
+  Iterator begin() const;
+  Iterator end() const;
+
+  bool insert(Value v);
+  bool remove(Pointi p);
+  // One at a time, as each only touches a leaf bucket.
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Pointi> points);
+  bool exists(Pointi p) const;
+  std::optional<Value> find(Pointi p) const;
+  Value find_closest(Pointi p);
+  Value pop_closest(Pointi p);
+
+  void rebalance();
+  int depth_max() const;
+
+  void print_tree(std::ostream& stream = std::cout) const;
+  void validate() const;  // Implemented and used in bucket_kdtree_test.cc, not allowed elsewhere.
+
+ private:
+  static constexpr int kFar = 1 << 29;  // Coordinates of empty slots, far from any query.
+
+  Id new_node();
+  Id new_leaf();
+  void free_node(Id n);
+
+  // Descends to the leaf for `p`, recording the nodes on the way in `path_`.
+  Id find_leaf(Pointi p, bool record_path);
+  Id find_leaf(Pointi p) const;
+  static int find_slot(const Bucket& b, Pointi p);  // -1 if missing.
+  static int closest_slot(const Bucket& b, Pointi p, int& dist);
+  void find_closest(Id node, Pointi p, int& best_dist, Id& best_bucket, int& best_slot) const;
+  void remove_slot(Bucket& b, int slot);
+
+  void split(Id leaf);
+  void merge(Id parent);
+  // Splits the values at the median along their wider axis, and returns the start of the right
+  // side. There must be at least two values.
+  static std::vector<Value>::iterator partition(
+      std::vector<Value>::iterator start, std::vector<Value>::iterator end, int& axis, int& split);
+  Id build(std::vector<Value>::iterator start, std::vector<Value>::iterator end);
+
+  int depth_max(Id node) const;
+  void print_tree(std::ostream& stream, Id node, std::string prefix) const;
+  void validate(Id node, Pointi min, Pointi max, int& count) const;
+
+  std::vector<Node> nodes_;
+  std::vector<Bucket> buckets_;
+  std::vector<Id> free_nodes_;
+  std::vector<Id> free_buckets_;
+  std::vector<Id> path_;  // Scratch space for `find_leaf`.
+  std::vector<Value> values_;  // Scratch space for `split` and `rebalance`.
+  Id root_;
+  int count_;
+  int leaves_;
+};
+
+std::ostream& operator<<(std::ostream& stream, const BucketKDTree& t);
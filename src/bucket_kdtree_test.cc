@@ -0,0 +1,61 @@
+#include <bit>
+#include <limits>
+
+#include "bucket_kdtree.h"
+#include "catch2/catch_amalgamated.h"
+#include "point.h"
+
+
+void BucketKDTree::validate() const {
+  int min = std::numeric_limits<int>::min();
+  int max = std::numeric_limits<int>::max();
+  int count = 0;
+  if (root_ != NONE) {
+    validate(root_, Pointi(min, min), Pointi(max, max), count);
+  }
+  REQUIRE(count == count_);
+  REQUIRE(nodes_.size() == free_nodes_.size() + 2 * leaves_ - (root_ == NONE ? 0 : 1));
+  REQUIRE(buckets_.size() == free_buckets_.size() + leaves_);
+}
+
+void BucketKDTree::validate(Id node, Pointi min, Pointi max, int& count) const {
+  const Node& n = nodes_[node];
+  if (n.bucket != NONE) {
+    const Bucket& b = buckets_[n.bucket];
+    REQUIRE(b.count >= 0);
+    REQUIRE(b.count < kBucketSize);
+    for (int i = 0; i < kBucketSize; i++) {
+      if (i < b.count) {
+        REQUIRE(b.x[i] >= min.x);
+        REQUIRE(b.y[i] >= min.y);
+        REQUIRE(b.x[i] < max.x);
+        REQUIRE(b.y[i] < max.y);
+      } else {
+        REQUIRE(b.x[i] == kFar);
+        REQUIRE(b.y[i] == kFar);
+      }
+    }
+    count += b.count;
+    return;
+  }
+  REQUIRE(n.split > min.coords[n.axis]);
+  REQUIRE(n.split < max.coords[n.axis]);
+  Pointi left_max = max, right_min = min;
+  left_max.coords[n.axis] = n.split;
+  right_min.coords[n.axis] = n.split;
+  validate(n.children[0], min, left_max, count);
+  validate(n.children[1], right_min, max, count);
+}
+
+
+TEST_CASE("BucketKDTree sorted inserts stay balanced", "[kdtree]") {
+  BucketKDTree bucket;
+  for (int x = 0; x < 100; x++) {
+    for (int y = 0; y < 100; y++) {
+      bucket.insert({x, {x, y}});
+    }
+  }
+  bucket.validate();
+  // Buckets are at least a quarter full after splits and rebuilds.
+  REQUIRE(bucket.depth_max() <= 2 * int(std::bit_width(10000u / 8)) + 2);
+}
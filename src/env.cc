@@ -1,67 +1,142 @@
 
 #include "env.h"
 
+#include <algorithm>
 #include <cassert>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
 #include "absl/random/random.h"
 #include "absl/strings/str_format.h"
 
 #include "ansi-colors.h"
+#include "frontier.h"
 #include "minesweeper.h"
+#include "no_guess.h"
 #include "point.h"
 
-Env::Env(Pointi dims, float bomb_percentage, uint64_t seed) :
-    dims_(dims), bomb_percentage_(bomb_percentage), state_(dims), bitgen_(seed) {
+Env::Env(Pointi dims, float bomb_percentage, uint64_t seed, bool no_guess) :
+    dims_(dims), bomb_percentage_(bomb_percentage), no_guess_(no_guess),
+    no_guess_passes_(NoGuessSolver::kDefaultPasses), no_guess_failures_(0), state_(dims),
+    bitgen_(seed), dirty_({0, 0}) {
   assert(bomb_percentage > 0. && bomb_percentage < 1.);
 }
 
 std::vector<Update> Env::reset() {
-  // Generate random bombs
-  for (int x = 0; x < dims_.x; x++) {
-    for (int y = 0; y < dims_.y; y++) {
-      state_(x, y) = Cell(Neighbors({x, y}, dims_, false).size(),
-                          absl::Uniform(bitgen_, 0.0, 1.0) < bomb_percentage_);
-    }
+  bool failed = false;
+  Pointi start = generate(state_, bomb_percentage_, no_guess_, bitgen_, 0, no_guess_passes_,
+                          &failed);
+  no_guess_failures_ += failed;
+  dirty_.fill(true);
+  if (frontier_) {
+    frontier_->reset();
   }
+  return step(Action{OPEN, start, 0});
+}
+
+Pointi Env::generate(
+    Array2D<Cell>& state, float bomb_percentage, bool no_guess, Xoshiro256pp& bitgen,
+    int threads, int no_guess_passes, bool* no_guess_failed) {
+  Pointi dims = state.dims();
+
+  Array2D<uint8_t> bombs(dims);
+  Pointi start;
+  for (int attempt = 1; true; attempt++) {
+    bool found = false;
+    while (!found) {
+      // Generate random bombs
+      for (int x = 0; x < dims.x; x++) {
+        for (int y = 0; y < dims.y; y++) {
+          bombs(x, y) = absl::Uniform(bitgen, 0.0, 1.0) < bomb_percentage;
+        }
+      }
 
-  // Find an empty place to start.
-  while (true) {
-    Pointi p(
-        absl::Uniform(bitgen_, 0, dims_.x),
-        absl::Uniform(bitgen_, 0, dims_.y));
+      // Find an empty place to start. A small board may not have one, so give up eventually and
+      // try another board.
+      for (int tries = 0; tries < 1000 && !found; tries++) {
+        Pointi p(
+            absl::Uniform(bitgen, 0, dims.x),
+            absl::Uniform(bitgen, 0, dims.y));
 
-    int b = 0;
-    for (Pointi n : Neighbors(p, dims_, true)) {
-      b += state_[n].bomb_;
+        int b = 0;
+        for (Pointi n : Neighbors(p, dims, true)) {
+          b += bombs[n];
+        }
+        if (b == 0) {
+          start = p;
+          found = true;
+        }
+      }
+    }
+
+    if (!no_guess) {
+      break;
+    }
+    // The solver can give up, so try again from new bombs a few times before keeping a board that
+    // may need a guess.
+    NoGuessSolver solver(bombs, start, bomb_percentage, bitgen(), threads);
+    if (solver.run(no_guess_passes)) {
+      break;
+    } else if (attempt == kNoGuessAttempts) {
+      if (no_guess_failed) {
+        *no_guess_failed = true;
+      }
+      break;
     }
-    if (b == 0) {
-      return step(Action{OPEN, p, 0});
+  }
+
+  for (int x = 0; x < dims.x; x++) {
+    for (int y = 0; y < dims.y; y++) {
+      state(x, y) = Cell(Neighbors({x, y}, dims, false).size(), bombs(x, y));
     }
   }
+  return start;
 }
 
 std::vector<Update> Env::step(Action action) {
   std::vector<Update> updates;
+  step(action, updates);
+  return updates;
+}
 
-  std::vector<Action> q;
+void Env::step(Action action, std::vector<Update>& updates) {
+  size_t first = updates.size();
+  apply(state_, action, queue_, updates);
+
+  if (pool_) {
+    for (size_t i = first; i < updates.size(); i++) {
+      mark_dirty(updates[i].point);
+    }
+  }
+  if (frontier_) {
+    frontier_->update(state_, std::span(updates).subspan(first));
+  }
+}
+
+void Env::apply(
+    Array2D<Cell>& state, Action action, std::vector<Action>& q, std::vector<Update>& updates) {
+  Pointi dims = state.dims();
   q.push_back(action);
   while (!q.empty()) {
     Action a = q.back();
     q.pop_back();
-    Cell& cell = state_[a.point];
+    Cell& cell = state[a.point];
     if (a.action == MARK) {
       if (cell.state_ == HIDDEN) {
         // Mark it.
         cell.state_ = MARKED;
         cell.user_ = a.user;
-        for (Pointi n : Neighbors(a.point, dims_, false)) {
-          state_[n].marked_ += 1;
+        for (Pointi n : Neighbors(a.point, dims, false)) {
+          state[n].marked_ += 1;
         }
         updates.push_back({MARKED, a.point, a.user});
       } else if (cell.complete()) {
         // All non-bombs are opened, so mark all remaining hidden.
-        for (Pointi n : Neighbors(a.point, dims_, false)) {
-          if (state_[n].state_ == HIDDEN) {
+        for (Pointi n : Neighbors(a.point, dims, false)) {
+          if (state[n].state_ == HIDDEN) {
             q.push_back({MARK, n, a.user});
           }
         }
@@ -70,26 +145,26 @@ std::vector<Update> Env::step(Action action) {
       if (cell.state_ == MARKED) {
         cell.state_ = HIDDEN;
         cell.user_ = a.user;
-        for (Pointi n : Neighbors(a.point, dims_, false)) {
-          state_[n].marked_ -= 1;
+        for (Pointi n : Neighbors(a.point, dims, false)) {
+          state[n].marked_ -= 1;
         }
         updates.push_back({HIDDEN, a.point, a.user});
       }
     } else if (a.action == OPEN) {
       if (cell.state_ == HIDDEN) {
-        Neighbors neighbors(a.point, dims_, false);
+        Neighbors neighbors(a.point, dims, false);
         if (cell.bomb_) {
           cell.state_ = BOMB;
           cell.user_ = a.user;
           for (Pointi n : neighbors) {
-            state_[n].marked_ += 1;  // Treat as if it's marked, even though it can't be unmarked.
+            state[n].marked_ += 1;  // Treat as if it's marked, even though it can't be unmarked.
           }
           updates.push_back({BOMB, a.point, a.user});
         } else {
           // Compute and reveal the true value.
           int8_t b = 0;
           for (Pointi n : neighbors) {
-            Cell& nc = state_[n];
+            Cell& nc = state[n];
             b += nc.bomb_;
             nc.cleared_ += 1;
             if (nc.complete()) {
@@ -111,7 +186,7 @@ std::vector<Update> Env::step(Action action) {
           // Propagate to the neighbors.
           if (b == 0) {
             for (Pointi n : neighbors) {
-              if (state_[n].state_ == HIDDEN) {
+              if (state[n].state_ == HIDDEN) {
                 q.push_back({OPEN, n, 0});
               }
             }
@@ -119,15 +194,110 @@ std::vector<Update> Env::step(Action action) {
         }
       } else if (cell.state_ == cell.neighbors_marked()) {  // Implicitly not marked/bomb or complete.
         // All bombs are found, assuming no mistaken marks, so open all remaining hidden.
-        for (Pointi n : Neighbors(a.point, dims_, false)) {
-          if (state_[n].state_ == HIDDEN) {
+        for (Pointi n : Neighbors(a.point, dims, false)) {
+          if (state[n].state_ == HIDDEN) {
             q.push_back({OPEN, n, a.user});
           }
         }
       }
     }
   }
-  return updates;
+}
+
+void Env::enable_frontier() {
+  if (!frontier_) {
+    frontier_ = std::make_unique<Frontier>(dims_);
+  }
+}
+
+void Env::enable_validation(int threads) {
+  if (!pool_) {
+    pool_ = std::make_unique<ThreadPool>(threads);
+    dirty_ = Array2D<uint8_t>({(dims_.x + kChunkSize - 1) / kChunkSize,
+                               (dims_.y + kChunkSize - 1) / kChunkSize});
+    dirty_.fill(true);
+  }
+}
+
+void Env::mark_dirty(Pointi p) {
+  // A change also affects the counters of the neighbors, which may be in the adjacent chunks.
+  int x1 = std::max(p.x - 1, 0) / kChunkSize;
+  int x2 = std::min(p.x + 1, dims_.x - 1) / kChunkSize;
+  int y1 = std::max(p.y - 1, 0) / kChunkSize;
+  int y2 = std::min(p.y + 1, dims_.y - 1) / kChunkSize;
+  for (int x = x1; x <= x2; x++) {
+    for (int y = y1; y <= y2; y++) {
+      dirty_(x, y) = true;
+    }
+  }
+}
+
+std::vector<std::string> Env::validate_dirty() {
+  assert(pool_);
+  std::vector<Pointi> chunks;
+  for (int x = 0; x < dirty_.width(); x++) {
+    for (int y = 0; y < dirty_.height(); y++) {
+      if (dirty_(x, y)) {
+        dirty_(x, y) = false;
+        chunks.push_back({x, y});
+      }
+    }
+  }
+
+  std::vector<std::vector<std::string>> errors(chunks.size());
+  pool_->parallel_for(chunks.size(), [this, &chunks, &errors](int i) {
+    Pointi tl = chunks[i] * kChunkSize;
+    Recti r = *Recti(tl, tl + kChunkSize).intersection(state_.rect());
+    for (int x = r.left(); x < r.right(); x++) {
+      for (int y = r.top(); y < r.bottom(); y++) {
+        if (std::optional<std::string> error = validate_cell({x, y})) {
+          errors[i].push_back(*error);
+        }
+      }
+    }
+  });
+
+  std::vector<std::string> out;
+  for (auto& e : errors) {
+    out.insert(out.end(), e.begin(), e.end());
+  }
+  return out;
+}
+
+std::optional<std::string> Env::validate_cell(Pointi p) const {
+  // Mirrors `validate` in env_test.cc, but reports instead of failing a test.
+  int neighbors = 0;
+  int cleared = 0;
+  int marked = 0;
+  int hidden = 0;
+  int bombs = 0;
+  for (Pointi n : Neighbors(p, dims_, false)) {
+    neighbors++;
+    bombs += (state_[n].bomb_);
+    cleared += (state_[n].state_ <= EIGHT || state_[n].state_ >= SCORE_ZERO);
+    marked += (state_[n].state_ == MARKED || state_[n].state_ == BOMB);
+    hidden += (state_[n].state_ == HIDDEN);
+  }
+
+  const Cell& c = state_[p];
+  bool valid = (
+      (c.state_ == HIDDEN ||
+       (c.bomb_ ? (c.state_ == BOMB || c.state_ == MARKED)
+                : (c.state_ & ~SCORE_ZERO) == CellState(bombs))) &&
+      neighbors == c.neighbors() &&
+      cleared == c.neighbors_cleared() &&
+      marked == c.neighbors_marked() &&
+      hidden == c.neighbors_hidden() &&
+      (c.state_ >= SCORE_ZERO) == c.complete());
+  if (valid) {
+    return std::nullopt;
+  }
+  return absl::StrFormat(
+      "Corrupt cell at %d,%d: state: %d, bomb: %d, neighbors: %d/%d, cleared: %d/%d, "
+      "marked: %d/%d, hidden: %d/%d, complete: %d",
+      p.x, p.y, int(c.state_), bool(c.bomb_), c.neighbors(), neighbors,
+      c.neighbors_cleared(), cleared, c.neighbors_marked(), marked,
+      c.neighbors_hidden(), hidden, c.complete());
 }
 
 
@@ -141,6 +311,15 @@ void FakeEnv::reset() {
       state_(x, y) = Cell(Neighbors({x, y}, dims_, false).size(), false);
     }
   }
+  if (frontier_) {
+    frontier_->reset();
+  }
+}
+
+void FakeEnv::enable_frontier() {
+  if (!frontier_) {
+    frontier_.emplace(dims_);
+  }
 }
 
 void FakeEnv::step(std::vector<Update> updates) {
@@ -195,6 +374,10 @@ void FakeEnv::step(std::vector<Update> updates) {
       assert(false);
     }
   }
+  if (frontier_) {
+    frontier_->next_round();
+    frontier_->update(state_, updates);
+  }
 }
 
 
@@ -1,28 +1,84 @@
 
 #pragma once
 
+#include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
+#include "frontier.h"
 #include "kdtree.h"
 #include "minesweeper.h"
 #include "point.h"
 #include "random.h"
+#include "thread.h"
 
 class Env {
  public:
-  Env(Pointi dims, float bomb_percentage, uint64_t seed = 0);
+  // With `no_guess`, `reset` moves bombs around until the board can be solved without guessing.
+  Env(Pointi dims, float bomb_percentage, uint64_t seed = 0, bool no_guess = false);
   std::vector<Update> reset();
   std::vector<Update> step(Action action);
+  // Appends the updates to `updates` instead, which saves a vector per action in a tight loop.
+  void step(Action action, std::vector<Update>& updates);
 
   const Array2D<Cell>& state() const { return state_; }
 
+  // With `no_guess`, how many boards from `reset` the solver gave up on, even after a few tries
+  // with new bombs, so they may need a guess.
+  int no_guess_failures() const { return no_guess_failures_; }
+  // Passes the solver gets per try, see `NoGuessSolver::run`. 0 always gives up, eg for tests.
+  void set_no_guess_passes(int passes) { no_guess_passes_ = passes; }
+
+  // Implemented and used in env_test.cc, not allowed elsewhere.
   void validate() const;
+  void corrupt(Pointi p);
+
+  // Starts tracking which chunks of the board change, so they can be checked by `validate_dirty`.
+  void enable_validation(int threads = 0);
+  // Checks the chunks changed since the last call in parallel, and returns a description of each
+  // corrupt cell. This is cheap enough to call often in long runs, unlike `validate`.
+  std::vector<std::string> validate_dirty();
+
+  // Starts keeping a `Frontier` up to date in `reset` and `step`, for agents to share. Its `fresh`
+  // builds up over steps until `next_round` is called on it, eg along with clearing the updates.
+  void enable_frontier();
+  Frontier* frontier() { return frontier_.get(); }
+  const Frontier* frontier() const { return frontier_.get(); }
 
  private:
+  static constexpr int kChunkSize = 64;
+  static constexpr int kNoGuessAttempts = 4;  // Boards to try before keeping one that may not do.
+
+  // Shared with BatchEnv. `generate` places the bombs and returns an empty place to start, setting
+  // `no_guess_failed` if `no_guess` was asked for but not achieved. `apply` appends the updates
+  // from an action, using `queue` as scratch space.
+  static Pointi generate(Array2D<Cell>& state, float bomb_percentage, bool no_guess,
+                         Xoshiro256pp& bitgen, int threads, int no_guess_passes,
+                         bool* no_guess_failed);
+  static void apply(Array2D<Cell>& state, Action action, std::vector<Action>& queue,
+                    std::vector<Update>& updates);
+
+  void mark_dirty(Pointi p);
+  std::optional<std::string> validate_cell(Pointi p) const;
+
   Pointi dims_;
   float bomb_percentage_;
+  bool no_guess_;
+  int no_guess_passes_;
+  int no_guess_failures_;
   Array2D<Cell> state_;
   Xoshiro256pp bitgen_;
+  std::vector<Action> queue_;  // Scratch space for `apply`.
+
+  // Only set once validation is enabled.
+  std::unique_ptr<ThreadPool> pool_;
+  Array2D<uint8_t> dirty_;  // One per chunk.
+
+  // Only set once the frontier is enabled.
+  std::unique_ptr<Frontier> frontier_;
+
+  friend class BatchEnv;
 };
 
 
@@ -36,9 +92,14 @@ class FakeEnv {
 
   const Array2D<Cell>& state() const { return state_; }
 
+  // As in `Env`, but `fresh` is only what was deduced from the last `step`.
+  void enable_frontier();
+  const Frontier* frontier() const { return frontier_ ? &*frontier_ : nullptr; }
+
  private:
   Pointi dims_;
   Array2D<Cell> state_;
+  std::optional<Frontier> frontier_;  // Not a pointer, so it can still be copied.
 };
 
 std::ostream& operator<<(std::ostream& stream, const Array2D<Cell>& state);
\ No newline at end of file
@@ -3,11 +3,19 @@
 
 #include <array>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "src/agent_last.h"
 #include "src/agent_random.h"
+#include "src/agent_round.h"
+#include "src/bucket_grid.h"
+#include "src/bucket_kdtree.h"
 #include "src/env.h"
+#include "src/flat_kdtree.h"
+#include "src/frontier.h"
+#include "src/hilbert_queue.h"
 #include "src/minesweeper.h"
 #include "src/point.h"
 
@@ -46,6 +54,11 @@ void Env::validate() const {
   }
 }
 
+void Env::corrupt(Pointi p) {
+  state_[p].cleared_ += 1;
+  mark_dirty(p);
+}
+
 
 TEST_CASE("env", "[env]") {
 
@@ -128,7 +141,76 @@ TEST_CASE("env", "[env]") {
   }
 }
 
-TEMPLATE_TEST_CASE("env benchmark", "[env]", AgentRandom, AgentLast) {
+TEST_CASE("validate dirty", "[env]") {
+  Pointi dims(150, 100);  // Several chunks.
+  Env env(dims, 0.1, Catch::getSeed());
+  env.enable_validation(2);
+  AgentRandom agent(env.state(), 1);
+  std::vector<Update> updates = env.reset();
+  REQUIRE(env.validate_dirty().empty());
+  REQUIRE(env.validate_dirty().empty());  // Nothing changed.
+
+  while (true) {
+    Action action = agent.step(updates);
+    if (action.action == PASS) {
+      break;
+    }
+    updates = env.step(action);
+    std::vector<std::string> errors = env.validate_dirty();
+    CAPTURE(errors);
+    REQUIRE(errors.empty());
+  }
+
+  env.corrupt({70, 40});
+  std::vector<std::string> errors = env.validate_dirty();
+  REQUIRE(errors.size() == 1);
+  REQUIRE(errors[0].find("Corrupt cell at 70,40") == 0);
+}
+
+TEST_CASE("no guess", "[env]") {
+  Pointi dims(120, 60);
+  Env env(dims, 0.2, Catch::getSeed(), true);  // Dense enough to need a guess without the solver.
+  AgentRandom agent(env.state(), 1);
+  std::vector<Update> updates = env.reset();
+  while (true) {
+    Action action = agent.step(updates);
+    if (action.action == PASS) {
+      break;
+    }
+    updates = env.step(action);
+  }
+
+  INFO("Final:\n" << env.state());
+  for (int x = 0; x < dims.x; ++x) {
+    for (int y = 0; y < dims.y; ++y) {
+      CAPTURE(x, y);
+      REQUIRE(env.state()(x, y).state() != HIDDEN);
+      REQUIRE(env.state()(x, y).state() != BOMB);
+    }
+  }
+  REQUIRE(env.no_guess_failures() == 0);
+}
+
+TEST_CASE("no guess gives up", "[env]") {
+  // Without any passes the solver always gives up, which is counted, and the board still plays.
+  Pointi dims(60, 40);
+  Env env(dims, 0.2, Catch::getSeed(), true);
+  env.set_no_guess_passes(0);
+  env.reset();
+  REQUIRE(env.no_guess_failures() == 1);
+  env.validate();
+  env.reset();
+  REQUIRE(env.no_guess_failures() == 2);
+
+  // It's only counted when asked for.
+  Env guessing(dims, 0.2, Catch::getSeed(), false);
+  guessing.set_no_guess_passes(0);
+  guessing.reset();
+  REQUIRE(guessing.no_guess_failures() == 0);
+}
+
+TEMPLATE_TEST_CASE("env benchmark", "[env]", AgentRandom, AgentLast, AgentLastT<FlatKDTree>,
+                   AgentLastT<BucketKDTree>, AgentLastT<BucketGrid>, AgentLastT<HilbertQueue>) {
   BENCHMARK("solve known state") {
     Pointi dims(120, 60);  // Small enough to be printed in a high resolution console.
     Env env(dims, 0.15, 42);  // Pass a constant random seed.
@@ -144,6 +226,13 @@ TEMPLATE_TEST_CASE("env benchmark", "[env]", AgentRandom, AgentLast) {
   };
 }
 
+TEST_CASE("no guess benchmark", "[env]") {
+  BENCHMARK("reset 960x540") {
+    Env env({960, 540}, 0.16, 42, true);
+    return env.reset();
+  };
+}
+
 void check_equal(const Array2D<Cell>& a, const Array2D<Cell>& b) {
   REQUIRE(a.dims() == b.dims());
   for (int x = 0; x < a.width(); ++x) {
@@ -199,3 +288,89 @@ TEST_CASE("fake env", "[env]") {
     check_equal(env.state(), fake_env.state());
   }
 }
+
+TEMPLATE_TEST_CASE("step_many", "[env]", AgentRandom, AgentLast) {
+  // Applying batches of actions gets as far as applying them one at a time, as they only make
+  // safe moves.
+  Pointi dims(120, 60);
+  auto make_agents = [](Env& env) {
+    std::vector<std::unique_ptr<Agent>> agents;
+    agents.push_back(std::make_unique<TestType>(env.state(), 1));
+    return agents;
+  };
+
+  std::vector<CellState> single = AgentRound::play_to_end(dims, make_agents);
+  REQUIRE(AgentRound::play_to_end(dims, make_agents, 1) == single);
+  REQUIRE(AgentRound::play_to_end(dims, make_agents, 1000) == single);
+}
+
+TEST_CASE("frontier", "[env]") {
+  // Matches working it out from scratch after every step, in `Env` and in a `FakeEnv` following it.
+  Pointi dims(60, 40);
+  Env env(dims, 0.15, Catch::getSeed());
+  env.enable_frontier();
+  FakeEnv fake(dims);
+  fake.enable_frontier();
+  AgentRandom agent(env.state(), 1);
+  std::vector<Update> updates = env.reset();
+  fake.step(updates);
+
+  Array2D<uint8_t> reported(dims);  // Fresh cells are only reported once each.
+  reported.fill(false);
+  while (true) {
+    REQUIRE(env.frontier()->fresh() == fake.frontier()->fresh());
+    for (Action a : env.frontier()->fresh()) {
+      CAPTURE(a.point);
+      REQUIRE(!reported[a.point]);
+      reported[a.point] = true;
+      REQUIRE(env.state()[a.point].state() == HIDDEN);
+    }
+
+    for (int x = 0; x < dims.x; x++) {
+      for (int y = 0; y < dims.y; y++) {
+        bool safe = false, mine = false;
+        if (env.state()(x, y).state() == HIDDEN) {
+          for (Pointi n : Neighbors({x, y}, dims, false)) {
+            Cell nc = env.state()[n];
+            if (nc.state() != HIDDEN && nc.state() == nc.neighbors_marked()) {
+              safe = true;
+            } else if (nc.state() != HIDDEN && nc.complete()) {
+              mine = true;
+            }
+          }
+        }
+        CAPTURE(x, y);
+        REQUIRE(env.frontier()->safe({x, y}) == safe);
+        REQUIRE(env.frontier()->mine({x, y}) == mine);
+        REQUIRE(fake.frontier()->safe({x, y}) == safe);
+        REQUIRE(fake.frontier()->mine({x, y}) == mine);
+      }
+    }
+
+    Action action = agent.step(updates);
+    if (action.action == PASS) {
+      break;
+    }
+    env.frontier()->next_round();
+    updates = env.step(action);
+    fake.step(updates);
+  }
+}
+
+TEMPLATE_TEST_CASE("frontier agents", "[env]", AgentRandom, AgentLast) {
+  // Taking the actions from the frontier gets as far as working them out from the updates.
+  Pointi dims(120, 60);
+  auto make_agents = [](bool frontier) {
+    return [frontier](Env& env) {
+      if (frontier) {
+        env.enable_frontier();
+      }
+      std::vector<std::unique_ptr<Agent>> agents;
+      agents.push_back(std::make_unique<TestType>(env.state(), 1, env.frontier()));
+      return agents;
+    };
+  };
+
+  REQUIRE(AgentRound::play_to_end(dims, make_agents(true)) ==
+          AgentRound::play_to_end(dims, make_agents(false)));
+}
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "flat_kdtree.h"
+
+
+FlatKDTree::FlatKDTree() : count_(0), removed_(0) {}
+
+FlatKDTree::FlatKDTree(const std::vector<Value>& values) : FlatKDTree() {
+  for (const auto& v : values) {
+    insert(v);
+  }
+}
+
+void FlatKDTree::clear() {
+  nodes_.clear();
+  buffer_.clear();
+  count_ = 0;
+  removed_ = 0;
+}
+
+FlatKDTree::Iterator FlatKDTree::begin() const {
+  return Iterator(this, 0, buffer_.begin());
+}
+FlatKDTree::Iterator FlatKDTree::end() const {
+  return Iterator(this, nodes_.size(), buffer_.end());
+}
+
+FlatKDTree::Iterator::Iterator(const FlatKDTree* tree, int i, KDTree::Iterator buffer) :
+    tree_(tree), i_(i), buffer_(buffer) {
+  skip_removed();
+}
+
+const FlatKDTree::Value& FlatKDTree::Iterator::operator*() const {
+  return *operator->();
+}
+const FlatKDTree::Value* FlatKDTree::Iterator::operator->() const {
+  if (i_ < int(tree_->nodes_.size())) {
+    return &tree_->nodes_[i_].value;
+  }
+  return buffer_.operator->();
+}
+
+FlatKDTree::Iterator& FlatKDTree::Iterator::operator++() {
+  if (i_ < int(tree_->nodes_.size())) {
+    i_++;
+    skip_removed();
+  } else {
+    ++buffer_;
+  }
+  return *this;
+}
+FlatKDTree::Iterator FlatKDTree::Iterator::operator++(int){
+  auto tmp = *this;
+  ++*this;
+  return tmp;
+}
+
+void FlatKDTree::Iterator::skip_removed() {
+  int n = tree_->nodes_.size();
+  while (i_ < n && tree_->nodes_[i_].removed) {
+    i_++;
+  }
+}
+
+
+bool FlatKDTree::insert(Value v) {
+  if (int i = find_node(v.p); i >= 0) {
+    if (!nodes_[i].removed) {
+      return false;  // Value already exists
+    }
+    // Still in the right place, so bring it back.
+    nodes_[i] = {v, false};
+    removed_ -= 1;
+    count_ += 1;
+    return true;
+  }
+  if (!buffer_.insert(v)) {
+    return false;
+  }
+  count_ += 1;
+  maybe_rebalance();
+  return true;
+}
+
+bool FlatKDTree::remove(Pointi p) {
+  if (int i = find_node(p); i >= 0 && !nodes_[i].removed) {
+    nodes_[i].removed = true;
+    removed_ += 1;
+  } else if (!buffer_.remove(p)) {
+    return false;
+  }
+  count_ -= 1;
+  maybe_rebalance();
+  return true;
+}
+
+int FlatKDTree::insert_many(std::span<const Value> values) {
+  // Most go to the buffer, which takes them in bulk. Reviving in the array has to happen first, as
+  // the buffer may not have a value that's in the array.
+  scratch_.clear();
+  int inserted = 0;
+  for (const Value& v : values) {
+    if (int i = find_node(v.p); i >= 0) {
+      if (nodes_[i].removed) {
+        nodes_[i] = {v, false};
+        removed_ -= 1;
+        inserted += 1;
+      }
+    } else {
+      scratch_.push_back(v);
+    }
+  }
+  inserted += buffer_.insert_many(scratch_);
+  count_ += inserted;
+  maybe_rebalance();
+  return inserted;
+}
+
+int FlatKDTree::remove_many(std::span<const Pointi> points) {
+  scratch_points_.clear();
+  int removed = 0;
+  for (Pointi p : points) {
+    if (int i = find_node(p); i >= 0) {
+      if (!nodes_[i].removed) {
+        nodes_[i].removed = true;
+        removed_ += 1;
+        removed += 1;
+      }
+    } else {
+      scratch_points_.push_back(p);
+    }
+  }
+  removed += buffer_.remove_many(scratch_points_);
+  count_ -= removed;
+  maybe_rebalance();
+  return removed;
+}
+
+bool FlatKDTree::exists(Pointi p) const {
+  return bool(find(p));
+}
+
+std::optional<FlatKDTree::Value> FlatKDTree::find(Pointi p) const {
+  if (int i = find_node(p); i >= 0) {
+    // A removed node can't also be in the buffer, as inserting it would have brought it back.
+    return nodes_[i].removed ? std::nullopt : std::optional(nodes_[i].value);
+  }
+  return buffer_.find(p);
+}
+
+FlatKDTree::Value FlatKDTree::find_closest(Pointi p) {
+  return find_closest_index(p).first;
+}
+
+FlatKDTree::Value FlatKDTree::pop_closest(Pointi p) {
+  auto [out, i] = find_closest_index(p);
+  if (i >= 0) {
+    nodes_[i].removed = true;
+    removed_ += 1;
+  } else {
+    buffer_.remove(out.p);
+  }
+  count_ -= 1;
+  maybe_rebalance();
+  return out;
+}
+
+int FlatKDTree::find_node(Pointi p) const {
+  int n = nodes_.size();
+  int i = 0;
+  int depth = 0;
+  while (i < n) {
+    const Node& node = nodes_[i];
+    if (node.value.p == p) {
+      return i;
+    }
+    i = 2 * i + (less(p, node.value.p, depth % 2) ? 1 : 2);
+    depth += 1;
+  }
+  return -1;
+}
+
+std::pair<FlatKDTree::Value, int> FlatKDTree::find_closest_index(Pointi p) {
+  assert(count_ > 0);
+  // Recent inserts are usually near the query, and removed nodes near it can't bound the search,
+  // so start with the buffer's best to prune the array.
+  std::optional<Value> buffered;
+  int best_dist = std::numeric_limits<int>::max();
+  if (!buffer_.empty()) {
+    buffered = buffer_.find_closest(p);
+    best_dist = distance(p, buffered->p);
+  }
+  int best = -1;
+  find_closest(0, 0, p, best_dist, best);
+  if (best < 0) {
+    assert(buffered);
+    return {*buffered, -1};
+  }
+  return {nodes_[best].value, best};
+}
+
+void FlatKDTree::find_closest(int i, int depth, Pointi p, int& best_dist, int& best) const {
+  if (i >= int(nodes_.size())) {
+    return;
+  }
+  const Node& node = nodes_[i];
+
+  if (!node.removed) {
+    int dist = distance(p, node.value.p);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = i;
+    }
+  }
+
+  int axis = depth % 2;
+  int search_first = less(p, node.value.p, axis) ? 1 : 2;
+  find_closest(2 * i + search_first, depth + 1, p, best_dist, best);
+  // Values on the other side are at least as far along this axis as this node.
+  if (std::abs(p.coords[axis] - node.value.p.coords[axis]) < best_dist) {
+    find_closest(2 * i + 3 - search_first, depth + 1, p, best_dist, best);
+  }
+}
+
+void FlatKDTree::maybe_rebalance() {
+  int live = nodes_.size() - removed_;
+  if (buffer_.size() > std::max(kMinBuffer, live) ||
+      (removed_ > kMinBuffer && removed_ > live)) {
+    rebalance();
+  }
+}
+
+void FlatKDTree::rebalance() {
+  scratch_.clear();
+  scratch_.reserve(count_);
+  for (const Node& n : nodes_) {
+    if (!n.removed) {
+      scratch_.push_back(n.value);
+    }
+  }
+  scratch_.insert(scratch_.end(), buffer_.begin(), buffer_.end());
+  assert(int(scratch_.size()) == count_);
+
+  nodes_.resize(scratch_.size());
+  buffer_.clear();
+  removed_ = 0;
+  build(scratch_.begin(), scratch_.end(), 0, 0);
+}
+
+int FlatKDTree::left_size(int n) {
+  if (n <= 1) {
+    return 0;
+  }
+  // All levels but the last are full, and the last is filled from the left.
+  int levels = std::bit_width(unsigned(n));
+  int full = (1 << (levels - 1)) - 1;  // Nodes above the last level.
+  int last = n - full;
+  int half = 1 << (levels - 2);  // Slots in the last level under the left subtree.
+  return (half - 1) + std::min(last, half);
+}
+
+void FlatKDTree::build(
+    std::vector<Value>::iterator start, std::vector<Value>::iterator end, int i, int depth) {
+  if (start == end) {
+    return;
+  }
+  int axis = depth % 2;
+  auto mid = start + left_size(end - start);
+  std::nth_element(start, mid, end, [axis](const Value& a, const Value& b) {
+      return less(a.p, b.p, axis); });
+  nodes_[i] = {*mid, false};
+  build(start, mid, 2 * i + 1, depth + 1);
+  build(mid + 1, end, 2 * i + 2, depth + 1);
+}
+
+void FlatKDTree::print_tree(std::ostream& stream) const {
+  for (int i = 0; i < int(nodes_.size()); i++) {
+    int depth = std::bit_width(unsigned(i + 1)) - 1;
+    stream << std::string(2 * depth, ' ') << nodes_[i].value
+           << (nodes_[i].removed ? " removed" : "") << std::endl;
+  }
+  stream << "buffer:" << std::endl << buffer_;
+}
+
+std::ostream& operator<<(std::ostream& stream, const FlatKDTree& t) {
+  t.print_tree(stream);
+  return stream;
+}
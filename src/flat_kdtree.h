@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include "kdtree.h"
+#include "point.h"
+
+
+// A KDTree laid out as an implicit complete binary tree in breadth-first order, so the children of
+// node `i` are at `2i+1` and `2i+2` and the top levels share cache lines, instead of chasing a
+// pointer per level. It has the same interface as `KDTree`, so they can be swapped, eg in
+// `AgentLastT`.
+//
+// The array is only ever built in one go. Removed values are marked and skipped until a rebuild,
+// and inserts go to a regular `KDTree` on the side, which is merged in by the next rebuild. Both
+// are rebuilt once they outgrow the live part of the array, so rebuilds stay amortized O(log n)
+// per operation. Points are ordered by their coordinate along the axis and then by the other
+// one, so they're unique and each side of a split is well defined even with equal coordinates.
+class FlatKDTree {
+ public:
+  typedef KDTree::Value Value;
+
+ private:
+  struct Node {
+    Value value;
+    bool removed;
+  };
+
+ public:
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Value;
+    using pointer = Value*;
+    using reference = Value&;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() : tree_(nullptr), i_(0) {}
+    Iterator(const FlatKDTree* tree, int i, KDTree::Iterator buffer);
+
+    const Value& operator*() const;
+    const Value* operator->() const;
+    Iterator& operator++();
+    Iterator operator++(int);
+    bool operator==(const Iterator& o) const { return i_ == o.i_ && buffer_ == o.buffer_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+   private:
+    void skip_removed();
+
+    const FlatKDTree* tree_;
+    int i_;  // Into `nodes_`, then `buffer_` takes over.
+    KDTree::Iterator buffer_;
+  };
+  typedef const Iterator const_iterator;
+
+  FlatKDTree();
+  FlatKDTree(const std::vector<Value>& values);
+
+  bool empty() const { return count_ == 0; }
+  int size() const { return count_; }
+  void clear();
+
+  Iterator begin() const;
+  Iterator end() const;
+
+  bool insert(Value v);
+  bool remove(Pointi p);
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Pointi> points);
+  bool exists(Pointi p) const;
+  std::optional<Value> find(Pointi p) const;
+  Value find_closest(Pointi p);
+  Value pop_closest(Pointi p);
+
+  // Merges the buffer and drops the removed values. Happens automatically as they accumulate.
+  void rebalance();
+
+  void print_tree(std::ostream& stream = std::cout) const;
+  void validate() const;  // Implemented and used in flat_kdtree_test.cc, not allowed elsewhere.
+
+ private:
+  static constexpr int kMinBuffer = 16;
+
+  // Strict order along `axis`, breaking ties with the other axis.
+  static bool less(Pointi a, Pointi b, int axis) {
+    return (a.coords[axis] < b.coords[axis] ||
+            (a.coords[axis] == b.coords[axis] && a.coords[!axis] < b.coords[!axis]));
+  }
+  static int distance(Pointi a, Pointi b) {
+    return std::abs(a.x - b.x) + std::abs(a.y - b.y);  // manhattan distance
+  }
+  // Size of the left subtree of a complete binary tree of `n` nodes.
+  static int left_size(int n);
+
+  int find_node(Pointi p) const;  // Index in `nodes_`, including removed nodes, or -1.
+  // Returns the closest value, and its index in `nodes_`, or -1 if it's in the buffer.
+  std::pair<Value, int> find_closest_index(Pointi p);
+  void find_closest(int i, int depth, Pointi p, int& best_dist, int& best) const;
+  void maybe_rebalance();
+
+  void build(std::vector<Value>::iterator start, std::vector<Value>::iterator end, int i, int depth);
+  void validate(int i, int depth) const;
+
+  std::vector<Node> nodes_;
+  KDTree buffer_;
+  std::vector<Value> scratch_;  // Reused by `rebalance` and `insert_many`.
+  std::vector<Pointi> scratch_points_;  // Reused by `remove_many`.
+  int count_;
+  int removed_;  // Removed nodes still in `nodes_`.
+};
+
+std::ostream& operator<<(std::ostream& stream, const FlatKDTree& t);
@@ -0,0 +1,53 @@
+#include <vector>
+
+#include "catch2/catch_amalgamated.h"
+#include "flat_kdtree.h"
+#include "kdtree.h"
+#include "point.h"
+
+
+void FlatKDTree::validate() const {
+  int live = 0;
+  for (const Node& n : nodes_) {
+    live += !n.removed;
+  }
+  REQUIRE(live + buffer_.size() == count_);
+  REQUIRE(int(nodes_.size()) - live == removed_);
+  validate(0, 0);
+  buffer_.validate();
+  for (KDTree::Value v : buffer_) {
+    REQUIRE(find_node(v.p) == -1);
+  }
+}
+
+void FlatKDTree::validate(int i, int depth) const {
+  int n = nodes_.size();
+  if (i >= n) {
+    return;
+  }
+  // Everything in the left subtree sorts before this node, and everything in the right after.
+  int axis = depth % 2;
+  std::vector<int> stack = {2 * i + 1};
+  while (!stack.empty()) {
+    int j = stack.back();
+    stack.pop_back();
+    if (j < n) {
+      REQUIRE(less(nodes_[j].value.p, nodes_[i].value.p, axis));
+      stack.push_back(2 * j + 1);
+      stack.push_back(2 * j + 2);
+    }
+  }
+  stack = {2 * i + 2};
+  while (!stack.empty()) {
+    int j = stack.back();
+    stack.pop_back();
+    if (j < n) {
+      REQUIRE(less(nodes_[i].value.p, nodes_[j].value.p, axis));
+      stack.push_back(2 * j + 1);
+      stack.push_back(2 * j + 2);
+    }
+  }
+  validate(2 * i + 1, depth + 1);
+  validate(2 * i + 2, depth + 1);
+}
+
@@ -0,0 +1,60 @@
+#include "frontier.h"
+
+#include <algorithm>
+#include <span>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+Frontier::Frontier(Pointi dims) :
+    dims_(dims), safe_((dims.x * dims.y + 63) / 64), mine_((dims.x * dims.y + 63) / 64) {}
+
+void Frontier::reset() {
+  std::fill(safe_.begin(), safe_.end(), 0);
+  std::fill(mine_.begin(), mine_.end(), 0);
+  fresh_.clear();
+}
+
+bool Frontier::set(std::vector<uint64_t>& bits, Pointi p, bool value) {
+  int i = p.y * dims_.x + p.x;
+  uint64_t mask = uint64_t(1) << (i % 64);
+  bool was = bits[i / 64] & mask;
+  bits[i / 64] = value ? bits[i / 64] | mask : bits[i / 64] & ~mask;
+  return value && !was;
+}
+
+void Frontier::update(const Array2D<Cell>& state, std::span<const Update> updates) {
+  for (const Update& u : updates) {
+    if (u.state >= SCORE_ZERO) {
+      continue;  // All neighbors are cleared, so nothing left to do.
+    }
+    if (u.state != HIDDEN) {
+      // Opened or marked, so nothing is left to do there.
+      set(safe_, u.point, false);
+      set(mine_, u.point, false);
+    }
+
+    for (Pointi n : Neighbors(u.point, dims_, true)) {
+      Cell nc = state[n];
+      if (nc.state() == HIDDEN || nc.neighbors_hidden() == 0) {
+        continue;
+      }
+      bool open;
+      if (nc.state() == nc.neighbors_marked()) {
+        open = true;  // All mines are found, assuming no mistaken marks.
+      } else if (nc.complete()) {
+        open = false;  // All remaining hidden must be mines.
+      } else {
+        continue;  // Still unknown.
+      }
+
+      for (Pointi nn : Neighbors(n, dims_, false)) {
+        if (state[nn].state() == HIDDEN && set(open ? safe_ : mine_, nn, true)) {
+          fresh_.push_back({open ? OPEN : MARK, nn, 0});
+        }
+      }
+    }
+  }
+}
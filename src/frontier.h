@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+// The hidden cells that are known to be safe to open, or known to be mines, from the numbers
+// around them, kept up to date from each step's updates. This is the same deduction `AgentLast`
+// and `AgentRandom` do for every update, done once by the environment for all of them.
+//
+// A hidden cell can be deduced when an open neighbor has all its mines marked, so the rest are
+// safe, or has as many hidden neighbors left as mines, so they're all mines. That only changes
+// when a cell within 1 of that neighbor changes, so only cells within 2 of an update are checked.
+// Each cell is reported in `fresh` once when it's first deduced, and forgotten once it's opened or
+// marked, which `Env` guarantees for the rest of the game.
+class Frontier {
+ public:
+  Frontier(Pointi dims);
+  void reset();
+
+  // Checks around `updates`, which must already be applied to `state`.
+  void update(const Array2D<Cell>& state, std::span<const Update> updates);
+  // Forgets `fresh`, eg once every agent has seen it.
+  void next_round() { fresh_.clear(); }
+
+  bool safe(Pointi p) const { return get(safe_, p); }
+  bool mine(Pointi p) const { return get(mine_, p); }
+  // Cells deduced since `next_round`, as OPEN or MARK actions for user 0, in the order found.
+  const std::vector<Action>& fresh() const { return fresh_; }
+
+ private:
+  bool get(const std::vector<uint64_t>& bits, Pointi p) const {
+    int i = p.y * dims_.x + p.x;
+    return (bits[i / 64] >> (i % 64)) & 1;
+  }
+  // Returns whether it was newly set.
+  bool set(std::vector<uint64_t>& bits, Pointi p, bool value);
+
+  Pointi dims_;
+  // Row major, one bit per cell.
+  std::vector<uint64_t> safe_;
+  std::vector<uint64_t> mine_;
+  std::vector<Action> fresh_;
+};
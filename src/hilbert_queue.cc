@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "hilbert_queue.h"
+
+
+HilbertQueue::HilbertQueue() : order_(0), levels_(1, std::vector<uint64_t>(1, 0)) {}
+
+HilbertQueue::HilbertQueue(const std::vector<Value>& values) : HilbertQueue() {
+  insert_many(values);
+}
+
+void HilbertQueue::clear() {
+  // Keeps the curve, so the next game doesn't have to grow it again.
+  for (auto& level : levels_) {
+    std::fill(level.begin(), level.end(), 0);
+  }
+  values_.clear();
+}
+
+HilbertQueue::Iterator HilbertQueue::begin() const {
+  return Iterator(this, 0);
+}
+HilbertQueue::Iterator HilbertQueue::end() const {
+  return Iterator();
+}
+
+HilbertQueue::Iterator::Iterator(const HilbertQueue* queue, int64_t key)
+    : queue_(queue), key_(key) {
+  settle();
+}
+
+HilbertQueue::Iterator& HilbertQueue::Iterator::operator++() {
+  key_ += 1;
+  settle();
+  return *this;
+}
+HilbertQueue::Iterator HilbertQueue::Iterator::operator++(int) {
+  auto tmp = *this;
+  ++*this;
+  return tmp;
+}
+
+void HilbertQueue::Iterator::settle() {
+  key_ = queue_->next(key_);
+  if (key_ >= 0) {
+    value_ = Value(queue_->values_.at(key_), point(key_, queue_->order_));
+  }
+}
+
+
+uint64_t HilbertQueue::key(Pointi p, int order) {
+  // Each step picks the quadrant, then rotates and flips `p` into that quadrant's frame.
+  uint64_t x = p.x, y = p.y, key = 0;
+  for (uint64_t s = (uint64_t(1) << order) / 2; s > 0; s /= 2) {
+    uint64_t rx = (x & s) > 0;
+    uint64_t ry = (y & s) > 0;
+    key += s * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - (x & (s - 1));
+        y = s - 1 - (y & (s - 1));
+      }
+      std::swap(x, y);
+    }
+    x &= s - 1;
+    y &= s - 1;
+  }
+  return key;
+}
+
+Pointi HilbertQueue::point(uint64_t key, int order) {
+  uint64_t x = 0, y = 0;
+  for (uint64_t s = 1; s < (uint64_t(1) << order); s *= 2) {
+    uint64_t rx = 1 & (key / 2);
+    uint64_t ry = 1 & (key ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+    x += s * rx;
+    y += s * ry;
+    key /= 4;
+  }
+  return Pointi(x, y);
+}
+
+int64_t HilbertQueue::next(int64_t key) const {
+  // Up until a word has a bit at or after `key`, then down to the first bit under it.
+  for (int l = 0; l < int(levels_.size()); l++) {
+    uint64_t word = key >> 6;
+    if (word >= levels_[l].size()) {
+      return -1;
+    }
+    if (uint64_t bits = levels_[l][word] & (~uint64_t(0) << (key & 63))) {
+      key = (word << 6) | std::countr_zero(bits);
+      for (int d = l - 1; d >= 0; d--) {
+        key = (key << 6) | std::countr_zero(levels_[d][key]);
+      }
+      return key;
+    }
+    key = word + 1;
+  }
+  return -1;
+}
+
+void HilbertQueue::set(uint64_t key) {
+  for (auto& level : levels_) {
+    uint64_t& word = level[key >> 6];
+    bool was_empty = word == 0;
+    word |= uint64_t(1) << (key & 63);
+    if (!was_empty) {
+      break;  // The levels above already have it.
+    }
+    key >>= 6;
+  }
+}
+
+void HilbertQueue::reset(uint64_t key) {
+  for (auto& level : levels_) {
+    uint64_t& word = level[key >> 6];
+    word &= ~(uint64_t(1) << (key & 63));
+    if (word != 0) {
+      break;  // The levels above still need it.
+    }
+    key >>= 6;
+  }
+}
+
+void HilbertQueue::grow(Pointi p) {
+  int order = std::max({order_, int(std::bit_width(unsigned(p.x))),
+                        int(std::bit_width(unsigned(p.y)))});
+  if (order == order_) {
+    return;
+  }
+  std::vector<Value> values(begin(), end());
+  order_ = order;
+  levels_.clear();
+  uint64_t bits = uint64_t(1) << (2 * order);
+  do {
+    uint64_t words = (bits + 63) / 64;
+    levels_.emplace_back(words, 0);
+    bits = words;
+  } while (bits > 1);
+  values_.clear();
+  insert_many(values);
+}
+
+uint64_t HilbertQueue::cursor(Pointi p) const {
+  int max = (1 << order_) - 1;
+  return key(Pointi(std::clamp(p.x, 0, max), std::clamp(p.y, 0, max)), order_);
+}
+
+bool HilbertQueue::insert(Value v) {
+  assert(v.p.x >= 0 && v.p.y >= 0);
+  grow(v.p);
+  uint64_t k = key(v.p, order_);
+  if (!values_.try_emplace(k, v.value).second) {
+    return false;  // Value already exists
+  }
+  set(k);
+  return true;
+}
+
+bool HilbertQueue::remove(Pointi p) {
+  if (p.x < 0 || p.y < 0 || p.x >= (1 << order_) || p.y >= (1 << order_)) {
+    return false;
+  }
+  uint64_t k = key(p, order_);
+  if (!values_.erase(k)) {
+    return false;
+  }
+  reset(k);
+  return true;
+}
+
+int HilbertQueue::insert_many(std::span<const Value> values) {
+  int inserted = 0;
+  for (const Value& v : values) {
+    inserted += insert(v);
+  }
+  return inserted;
+}
+
+int HilbertQueue::remove_many(std::span<const Pointi> points) {
+  int removed = 0;
+  for (Pointi p : points) {
+    removed += remove(p);
+  }
+  return removed;
+}
+
+bool HilbertQueue::exists(Pointi p) const {
+  return bool(find(p));
+}
+
+std::optional<HilbertQueue::Value> HilbertQueue::find(Pointi p) const {
+  if (p.x < 0 || p.y < 0 || p.x >= (1 << order_) || p.y >= (1 << order_)) {
+    return std::nullopt;
+  }
+  auto it = values_.find(key(p, order_));
+  if (it == values_.end()) {
+    return std::nullopt;
+  }
+  return Value(it->second, p);
+}
+
+HilbertQueue::Value HilbertQueue::find_closest(Pointi p) {
+  assert(!empty());
+  int64_t k = next(cursor(p));
+  if (k < 0) {
+    k = next(0);
+  }
+  return Value(values_.at(k), point(k, order_));
+}
+
+HilbertQueue::Value HilbertQueue::pop_closest(Pointi p) {
+  Value out = find_closest(p);
+  uint64_t k = key(out.p, order_);
+  values_.erase(k);
+  reset(k);
+  return out;
+}
+
+
+void HilbertQueue::print_tree(std::ostream& stream) const {
+  for (Value v : *this) {
+    stream << key(v.p, order_) << ": " << v << std::endl;
+  }
+}
+
+std::ostream& operator<<(std::ostream& stream, const HilbertQueue& t) {
+  t.print_tree(stream);
+  return stream;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "kdtree.h"
+#include "point.h"
+
+
+// Pending actions keyed by their index along a Hilbert curve over the plane, which visits every
+// point of a 2^k square once while staying local. Instead of the closest value to a point, it pops
+// the next one along the curve from there, so consecutive pops from a moving cursor sweep the
+// board in small squares, much like `AgentLast`'s closest search, for a fraction of the cost.
+//
+// The keys are a bitmap with a summary bitmap on top of each level, one bit per 64-bit word of the
+// level below, so the next key at or after any other is a bit scan per level, which is a constant
+// 4-5 levels for a 4K board. The payloads are kept in a hash map by key. It has the same interface
+// as `KDTree`, so it can be used in `AgentLastT`, but `find_closest` and `pop_closest` take the
+// next value along the curve from the point rather than the closest one.
+//
+// Points must not be negative. The curve grows to fit the points inserted, which rekeys them all.
+class HilbertQueue {
+ public:
+  typedef KDTree::Value Value;
+
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Value;
+    using pointer = Value*;
+    using reference = Value&;
+    using difference_type = std::ptrdiff_t;
+
+    Iterator() : queue_(nullptr), key_(-1) {}
+    Iterator(const HilbertQueue* queue, int64_t key);
+
+    const Value& operator*() const { return value_; }
+    const Value* operator->() const { return &value_; }
+    Iterator& operator++();
+    Iterator operator++(int);
+    bool operator==(const Iterator& o) const { return key_ == o.key_; }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
+   private:
+    void settle();  // Moves to the next key, if the current one isn't set.
+
+    const HilbertQueue* queue_;
+    int64_t key_;  // -1 at the end.
+    Value value_;
+  };
+  typedef const Iterator const_iterator;
+
+  HilbertQueue();
+  HilbertQueue(const std::vector<Value>& values);
+
+  bool empty() const { return values_.empty(); }
+  int size() const { return values_.size(); }
+  void clear();
+
+  // In order along the curve.
+  Iterator begin() const;
+  Iterator end() const;
+
+  bool insert(Value v);
+  bool remove(Pointi p);
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Pointi> points);
+  bool exists(Pointi p) const;
+  std::optional<Value> find(Pointi p) const;
+  // The first value at or after `p` along the curve, wrapping around to the start.
+  Value find_closest(Pointi p);
+  Value pop_closest(Pointi p);
+
+  // Along a curve of `order`, covering [0, 2^order) on both axes.
+  static uint64_t key(Pointi p, int order);
+  static Pointi point(uint64_t key, int order);
+
+  void print_tree(std::ostream& stream = std::cout) const;
+  void validate() const;  // Implemented and used in hilbert_queue_test.cc, not allowed elsewhere.
+
+ private:
+  // The first set key at or after `key`, or -1.
+  int64_t next(int64_t key) const;
+  void set(uint64_t key);
+  void reset(uint64_t key);
+  void grow(Pointi p);  // Until `p` is on the curve.
+  // The key for a query, clamped onto the curve.
+  uint64_t cursor(Pointi p) const;
+
+  int order_;
+  // `levels_[0]` has a bit per key, and each level after has a bit per word of the one before,
+  // set if the word isn't zero. The last level is a single word.
+  std::vector<std::vector<uint64_t>> levels_;
+  absl::flat_hash_map<uint64_t, int> values_;  // Payloads by key.
+};
+
+std::ostream& operator<<(std::ostream& stream, const HilbertQueue& t);
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "absl/random/random.h"
+
+#include "catch2/catch_amalgamated.h"
+#include "hilbert_queue.h"
+#include "kdtree.h"
+#include "point.h"
+#include "random.h"
+
+
+void HilbertQueue::validate() const {
+  // Each level's bits are exactly the keys, or the non-zero words of the level below.
+  REQUIRE(levels_[0].size() == std::max<uint64_t>(1, (uint64_t(1) << (2 * order_)) / 64));
+  REQUIRE(levels_.back().size() == 1);
+  int keys = 0;
+  for (uint64_t word : levels_[0]) {
+    keys += std::popcount(word);
+  }
+  REQUIRE(keys == int(values_.size()));
+  for (auto [k, v] : values_) {
+    REQUIRE((levels_[0][k >> 6] >> (k & 63)) & 1);
+  }
+  for (int l = 1; l < int(levels_.size()); l++) {
+    for (uint64_t i = 0; i < levels_[l - 1].size(); i++) {
+      REQUIRE(bool((levels_[l][i >> 6] >> (i & 63)) & 1) == (levels_[l - 1][i] != 0));
+    }
+  }
+}
+
+
+TEST_CASE("Hilbert curve", "[kdtree]") {
+  // Visits every point once, and each step is to a neighbor.
+  for (int order = 0; order <= 5; order++) {
+    CAPTURE(order);
+    int n = 1 << order;
+    std::vector<bool> seen(n * n);
+    for (uint64_t k = 0; k < uint64_t(n * n); k++) {
+      Pointi p = HilbertQueue::point(k, order);
+      CAPTURE(k, p);
+      REQUIRE(HilbertQueue::key(p, order) == k);
+      REQUIRE(!seen[p.y * n + p.x]);
+      seen[p.y * n + p.x] = true;
+      if (k > 0) {
+        Pointi prev = HilbertQueue::point(k - 1, order);
+        REQUIRE(std::abs(p.x - prev.x) + std::abs(p.y - prev.y) == 1);
+      }
+    }
+  }
+}
+
+TEST_CASE("HilbertQueue", "[kdtree]") {
+  // Membership matches `KDTree`, and pops take the next key along the curve, wrapping around.
+  HilbertQueue queue;
+  KDTree tree;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen](int max) {
+    return Pointi(absl::Uniform(bitgen, 0, max), absl::Uniform(bitgen, 0, max));
+  };
+
+  int order = 0;  // The curve only grows, even as points are removed.
+  for (int i = 0; i < 10000; i++) {
+    // The points spread out as it goes, so the curve has to grow.
+    Pointi p = gen_point(20 + i / 50);
+    CAPTURE(i, p);
+    int op = absl::Uniform(bitgen, 0, 10);
+    if (op < 5) {
+      order = std::max({order, int(std::bit_width(unsigned(p.x))),
+                        int(std::bit_width(unsigned(p.y)))});
+      REQUIRE(queue.insert({i, p}) == tree.insert({i, p}));
+    } else if (op < 7) {
+      REQUIRE(queue.remove(p) == tree.remove(p));
+    } else if (op < 9) {
+      REQUIRE(queue.find(p) == tree.find(p));
+    } else if (!tree.empty()) {
+      std::vector<KDTree::Value> values(tree.begin(), tree.end());
+      auto key = [order](const KDTree::Value& v) { return HilbertQueue::key(v.p, order); };
+      int max = (1 << order) - 1;
+      uint64_t cursor = HilbertQueue::key(Pointi(std::min(p.x, max), std::min(p.y, max)), order);
+      auto next = absl::c_min_element(values, [&](const auto& a, const auto& b) {
+        // Those at or after the cursor first, then by key.
+        return std::pair(key(a) < cursor, key(a)) < std::pair(key(b) < cursor, key(b));
+      });
+      REQUIRE(queue.pop_closest(p) == *next);
+      REQUIRE(tree.remove(next->p));
+    }
+    REQUIRE(queue.size() == tree.size());
+    REQUIRE(queue.empty() == tree.empty());
+    if (i % 100 == 0) {
+      INFO(queue);
+      queue.validate();
+      std::vector<KDTree::Value> a(queue.begin(), queue.end()), b(tree.begin(), tree.end());
+      absl::c_sort(a, [](auto a, auto b) { return a.p < b.p; });
+      absl::c_sort(b, [](auto a, auto b) { return a.p < b.p; });
+      REQUIRE(a == b);
+    }
+  }
+
+  SECTION("Clear") {
+    queue.clear();
+    REQUIRE(queue.empty());
+    REQUIRE(queue.begin() == queue.end());
+    queue.validate();
+    REQUIRE(queue.insert({1, {2, 3}}));
+    REQUIRE(queue.insert({2, {0, 0}}));
+    REQUIRE(queue.find({2, 3})->value == 1);
+    // Off the curve is clamped onto it.
+    REQUIRE(queue.pop_closest({-5, -5}).value == 2);
+  }
+}
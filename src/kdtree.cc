@@ -1,411 +1,1099 @@
 #include <algorithm>
 #include <bit>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <functional>
 #include <iostream>
 #include <limits>
-#include <memory>
 #include <vector>
 
 #include "absl/strings/str_format.h"
 
 #include "kdtree.h"
+#include "thread.h"
 
 
-std::ostream& operator<< (std::ostream& stream, const KDTree::Value& v) {
-  return stream << "Value(" << v.value << ", {" << v.p.x << ", " << v.p.y << "})";
+KDTreeStats& KDTreeStats::operator+=(const KDTreeStats& o) {
+  searches += o.searches;
+  visited += o.visited;
+  rebalances += o.rebalances;
+  rebalance_ns += o.rebalance_ns;
+  rebuilds += o.rebuilds;
+  rebuilt_values += o.rebuilt_values;
+  largest_rebuild = std::max(largest_rebuild, o.largest_rebuild);
+  return *this;
+}
+
+std::string KDTreeStats::str() const {
+  return absl::StrFormat(
+      "searches: %d, nodes visited: %.1f/search, rebalances: %d in %.3f ms, "
+      "rebuilds: %d of %.1f values on average, largest %d",
+      searches, searches ? double(visited) / searches : 0., rebalances, rebalance_ns / 1e6,
+      rebuilds, rebuilds ? double(rebuilt_values) / rebuilds : 0., largest_rebuild);
 }
 
 
-KDTree::KDTree() : root(nullptr), count(0), sum_depth(0) {}
+template<class Payload, class Coord, int Dims, class Metric>
+KDTreeT<Payload, Coord, Dims, Metric>::KDTreeT()
+    : root(NONE), count(0), tombstones(0), sum_depth(0) {}
 
-KDTree::KDTree(const std::vector<Value>& values) : KDTree() {
+template<class Payload, class Coord, int Dims, class Metric>
+KDTreeT<Payload, Coord, Dims, Metric>::KDTreeT(const std::vector<Value>& values) : KDTreeT() {
   for (const auto& v : values) {
     insert(v);
   }
 }
 
-bool KDTree::empty() const {
-  return root == nullptr;
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::empty() const {
+  return count == 0;
 }
 
-int KDTree::size() const {
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::size() const {
   return count;
 }
 
-void KDTree::clear() {
-  root.reset();
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::clear() {
+  // Keeps the pool's capacity.
+  nodes.clear();
+  free_nodes.clear();
+  root = NONE;
   count = 0;
+  tombstones = 0;
   sum_depth = 0;
 }
 
-KDTree::Iterator KDTree::begin() const {
-  return KDTree::Iterator(root.get());
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::begin() const -> Iterator {
+  return Iterator(this, root);
+}
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::end() const -> Iterator {
+  return Iterator();
 }
-KDTree::Iterator KDTree::end() const {
-  return KDTree::Iterator();
+
+template<class Payload, class Coord, int Dims, class Metric>
+KDTreeT<Payload, Coord, Dims, Metric>::Iterator::Iterator() : tree(nullptr), size(0) {}
+template<class Payload, class Coord, int Dims, class Metric>
+KDTreeT<Payload, Coord, Dims, Metric>::Iterator::Iterator(const KDTreeT* tree, NodeId n)
+    : tree(tree), size(0) {
+  if (n != NONE) {
+    stack[size++] = n;
+    skip_removed();
+  }
 }
 
-KDTree::Iterator::Iterator() {}
-KDTree::Iterator::Iterator(const KDTree::Node* n) {
-  stack.push_back(n);
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::Iterator::operator*() const -> const Value& {
+  assert(size > 0);
+  return tree->nodes[stack[size - 1]].value;
+}
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::Iterator::operator->() const -> const Value* {
+  assert(size > 0);
+  return &tree->nodes[stack[size - 1]].value;
 }
 
-const KDTree::Value& KDTree::Iterator::operator*() const {
-  assert(!stack.empty());
-  return stack.back()->value;
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::Iterator::operator++() -> Iterator& {
+  next();
+  skip_removed();
+  return *this;
+}
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::Iterator::operator++(int) -> Iterator {
+  auto tmp = *this;
+  ++*this;
+  return tmp;
 }
-const KDTree::Value* KDTree::Iterator::operator->() const {
-  assert(!stack.empty());
-  return &stack.back()->value;
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::Iterator::next() {
+  assert(size > 0);
+  const Node& node = tree->nodes[stack[--size]];
+  // One entry per level at most, plus the left child.
+  assert(size + 2 <= kMaxDepth + 1);
+  if (node.children[1] != NONE) {
+    stack[size++] = node.children[1];
+  }
+  if (node.children[0] != NONE) {
+    stack[size++] = node.children[0];
+  }
 }
 
-KDTree::Iterator& KDTree::Iterator::operator++() {
-  assert(!stack.empty());
-  const Node* node = stack.back();
-  stack.pop_back();
-  if (node->children[1]) {
-    stack.push_back(node->children[1].get());
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::Iterator::skip_removed() {
+  while (size > 0 && tree->nodes[stack[size - 1]].removed) {
+    next();
   }
-  if (node->children[0]) {
-    stack.push_back(node->children[0].get());
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::OrderedIterator(
+    const KDTreeT* tree, Point p, int axis) : tree(tree), p(p), axis(axis) {
+  assert(axis >= -1 && axis < Dims);
+  if (tree->root != NONE && tree->nodes[tree->root].live > 0) {
+    push(tree->root, false);
+    settle();
   }
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::operator*() const -> const Value& {
+  assert(!heap.empty());
+  return tree->nodes[heap.front().node].value;
+}
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::operator->() const
+    -> const Value* {
+  assert(!heap.empty());
+  return &tree->nodes[heap.front().node].value;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::operator++() -> OrderedIterator& {
+  assert(!heap.empty());
+  std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+  heap.pop_back();
+  settle();
   return *this;
 }
-KDTree::Iterator KDTree::Iterator::operator++(int){
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::operator++(int) -> OrderedIterator {
   auto tmp = *this;
   ++*this;
   return tmp;
 }
 
+template<class Payload, class Coord, int Dims, class Metric>
+Coord KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::key(
+    const Node& n, bool value) const {
+  // A subtree's key is the least any of its values could have.
+  if (axis < 0) {
+    return value ? Metric::distance(p, n.value.p) : box_distance(p, n);
+  }
+  return value ? n.value.p.coords[axis] : n.min.coords[axis];
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::push(NodeId node, bool value) {
+  heap.push_back({key(tree->nodes[node], value), node, value});
+  std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::OrderedIterator::settle() {
+  while (!heap.empty() && !heap.front().value) {
+    NodeId n = heap.front().node;
+    std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+    heap.pop_back();
+    const Node& node = tree->nodes[n];
+    if (!node.removed) {
+      push(n, true);
+    }
+    for (NodeId c : node.children) {
+      if (c != NONE && tree->nodes[c].live > 0) {
+        push(c, false);
+      }
+    }
+  }
+}
+
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::new_node(Value v, int depth) -> NodeId {
+  NodeId n;
+  if (!free_nodes.empty()) {
+    n = free_nodes.back();
+    free_nodes.pop_back();
+    nodes[n] = Node{v, depth, 1, 1, {NONE, NONE}, false, v.p, v.p};
+  } else {
+    assert(nodes.size() < NONE);
+    n = nodes.size();
+    nodes.push_back(Node{v, depth, 1, 1, {NONE, NONE}, false, v.p, v.p});
+  }
+  sum_depth += depth;
+  count += 1;
+  return n;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::free_node(NodeId n) {
+  // The caller accounts for whether it was a value or a tombstone.
+  sum_depth -= nodes[n].depth;
+  free_nodes.push_back(n);
+}
 
-bool KDTree::insert(Value v) {
-  std::unique_ptr<Node>* node = &root;
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::insert(Value v) {
+  path.clear();
+  NodeId node = root;
+  int child = 0;
   int depth = 0;
-  while (*node) {
-    if ((*node)->value.p == v.p) {
-      return false; // Value already exists
+  while (node != NONE) {
+    Node& n = nodes[node];
+    if (n.value.p == v.p) {
+      if (!n.removed) {
+        return false; // Value already exists
+      }
+      // Still in the right place, so bring it back.
+      n.value = v;
+      n.removed = false;
+      include(n, v.p);
+      n.live += 1;
+      for (NodeId a : path) {
+        include(nodes[a], v.p);
+        nodes[a].live += 1;
+      }
+      tombstones -= 1;
+      count += 1;
+      return true;
     }
-    int axis = depth % 2;
-    int child = (v.p.coords[axis] < (*node)->value.p.coords[axis] ? 0 : 1);
-    node = &(*node)->children[child];
+    int axis = depth % Dims;
+    child = (less(v.p, n.value.p, axis) ? 0 : 1);
+    path.push_back(node);
+    node = n.children[child];
     depth += 1;
   }
-  *node = std::make_unique<Node>(v, depth);
-  count += 1;
-  sum_depth += depth;
+  node = new_node(v, depth);
+  (path.empty() ? root : nodes[path.back()].children[child]) = node;
+  for (NodeId a : path) {
+    include(nodes[a], v.p);
+    nodes[a].size += 1;
+    nodes[a].live += 1;
+  }
 
-  if (sum_depth > std::bit_width((unsigned)count) * count + 1) {
-    // `bit_width(count)` is the max depth for a complete balanced tree.
-    // `sum_depth / count` is the average depth, which should be a 1-2 less than the
-    // max for a balanced tree, but will exceed that if it's suffiently unbalanced.
-    // Move `/ count` to the other side to avoid division, in particular by 0.
-    // There may be better metrics for how balanced a tree is, but this one is cheap
-    // and easy to compute incrementally and seems to work.
-    rebalance();
+  if (depth > std::log(count + tombstones) / std::log(1 / kAlpha)) {
+    // Too deep, so some ancestor must be unbalanced. Rebuild the deepest one.
+    int size = 1;
+    for (int i = path.size() - 1; i >= 0; i--) {
+      int parent_size = nodes[path[i]].size;
+      if (size > kAlpha * parent_size) {
+        rebuild_subtree(i);
+        break;
+      }
+      size = parent_size;
+    }
   }
 
   return true;
 }
 
-bool KDTree::remove(Pointi p) {
-  std::unique_ptr<Node>* node = &root;
-  while (*node) {
-    if ((*node)->value.p == p) {
-      remove_node(*node);
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::remove(Point p) {
+  path.clear();
+  NodeId node = root;
+  while (node != NONE) {
+    const Node& n = nodes[node];
+    if (n.value.p == p) {
+      if (n.removed) {
+        return false;
+      }
+      remove_node(node);
       return true;
     }
-    int axis = (*node)->depth % 2;
-    int child = (p.coords[axis] < (*node)->value.p.coords[axis] ? 0 : 1);
-    node = &(*node)->children[child];
+    path.push_back(node);
+    int axis = n.depth % Dims;
+    int child = (less(p, n.value.p, axis) ? 0 : 1);
+    node = n.children[child];
   }
   return false;
 }
 
-bool KDTree::exists(Pointi p) const {
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::exists(Point p) const {
   return bool(find(p));
 }
 
-std::optional<KDTree::Value> KDTree::find(Pointi p) const {
-  Node* node = root.get();
-  while (node) {
-    if (node->value.p == p) {
-      return node->value;
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find(Point p) const -> std::optional<Value> {
+  NodeId node = root;
+  while (node != NONE) {
+    const Node& n = nodes[node];
+    if (n.value.p == p) {
+      return n.removed ? std::nullopt : std::optional(n.value);
     }
-    int axis = node->depth % 2;
-    int child = (p.coords[axis] < node->value.p.coords[axis] ? 0 : 1);
-    node = node->children[child].get();
+    int axis = n.depth % Dims;
+    int child = (less(p, n.value.p, axis) ? 0 : 1);
+    node = n.children[child];
   }
   return {};
 }
 
-KDTree::Value KDTree::find_closest(Pointi p) {
-  assert(root != nullptr);
-  std::unique_ptr<Node> *best_node = nullptr;
-  int best_dist = std::numeric_limits<int>::max();
-  find_closest(&root, p, best_dist, best_node);
-  assert(best_node);
-  return (*best_node)->value;
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find_closest(Point p) -> Value {
+  assert(count > 0);
+  NodeId best_node = find_closest_node(p);
+  assert(best_node != NONE);
+  return nodes[best_node].value;
 }
 
-void KDTree::find_closest(
-    std::unique_ptr<Node> *node, Pointi p, int &best_dist,
-    std::unique_ptr<Node> *&best_node) const {
-  if (!*node) {
-    return;
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find_closest_node(Point p) const -> NodeId {
+  // Depth first, nearer side of each split first, so only the farther child of each node on the
+  // way down waits on the stack. It waits with the distance to the split, which is a lower bound
+  // that doesn't need to look at the child. Once there, its bounds are a better one.
+  //
+  // Not best first, with a heap of subtrees by their bounds: AgentLast searches right next to its
+  // last action, where the nearer side almost always holds the answer. There, best first visited
+  // 6% fewer nodes but took 25% longer for the heap, and only following the heap for the farther
+  // sides took 8% longer for no fewer nodes.
+  struct Pending {
+    NodeId node;
+    Coord dist;
+  };
+  tally(&KDTreeStats::searches);
+  Pending stack[kMaxDepth + 2];
+  int top = 0;
+  NodeId best_node = NONE;
+  Coord best_dist = std::numeric_limits<Coord>::max();
+  if (root != NONE) {
+    stack[top++] = {root, 0};
   }
+  while (top > 0) {
+    Pending next = stack[--top];
+    if (next.dist >= best_dist) {
+      continue;
+    }
+    const Node& n = nodes[next.node];
+    if (n.live == 0 || box_distance(p, n) >= best_dist) {
+      continue;
+    }
+    tally(&KDTreeStats::visited);
+
+    if (!n.removed) {
+      Coord dist = distance(p, n.value.p);
+      if (dist < best_dist) {
+        best_dist = dist;
+        best_node = next.node;
+      }
+    }
 
-  int dist = distance(p, (*node)->value.p);
-  if (dist < best_dist) {
-    best_dist = dist;
-    best_node = node;
+    int axis = n.depth % Dims;
+    int search_first = less(p, n.value.p, axis) ? 0 : 1;
+    NodeId near = n.children[search_first], far = n.children[!search_first];
+    Coord split = Metric::axis_distance(p.coords[axis], n.value.p.coords[axis]);
+    assert(top + 2 <= kMaxDepth + 2);
+    if (far != NONE && split < best_dist) {
+      stack[top++] = {far, split};
+    }
+    if (near != NONE) {
+      stack[top++] = {near, next.dist};
+    }
   }
+  return best_node;
+}
 
-  int axis = (*node)->depth % 2;
-  int search_first = (p.coords[axis] < (*node)->value.p.coords[axis]) ? 0 : 1;
-  find_closest(&(*node)->children[search_first], p, best_dist, best_node);
-  if (std::abs(p.coords[axis] - (*node)->value.p.coords[axis]) < best_dist) {
-    find_closest(&(*node)->children[!search_first], p, best_dist, best_node);
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::link(NodeId node) -> NodeId& {
+  if (path.empty()) {
+    return root;
   }
+  Node& parent = nodes[path.back()];
+  return parent.children[parent.children[0] == node ? 0 : 1];
 }
 
-void KDTree::find_leftmost_along_axis(
-    std::unique_ptr<Node> *node, int coord, int axis, int &best_dist,
-    std::unique_ptr<Node> *&best_node) const {
-  if (!*node) {
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::remove_node(NodeId node) {
+  Node& n = nodes[node];
+  assert(!n.removed);
+  count -= 1;
+  for (NodeId a : path) {
+    nodes[a].live -= 1;
+  }
+  if (n.children[0] != NONE || n.children[1] != NONE) {
+    // Replacing an inner node means promoting the next value along the axis from a subtree, which
+    // cascades. Leave it to route searches instead, and compact them a subtree at a time.
+    n.removed = true;
+    n.live -= 1;
+    tombstones += 1;
+    path.push_back(node);
+    for (int i = path.size() - 1; i >= 0 && update_bounds(path[i]); i--) {}
+    compact_path();
     return;
   }
 
-  int dist = (*node)->value.p.coords[axis] - coord;
-  if (dist < best_dist ||
-      (dist == best_dist && (!best_node || (*node)->depth > (*best_node)->depth))) {
-    // Prioritizing the deepest means less cascading of intermediate nodes being replaced
-    // by deeper nodes, or rebuilding a smaller tree.
-    best_dist = dist;
-    best_node = node;
+  // A leaf can just be removed, along with any tombstones above it that become leaves.
+  int freed = 0;
+  while (true) {
+    link(node) = NONE;
+    free_node(node);
+    freed += 1;
+    if (path.empty()) {
+      break;
+    }
+    const Node& parent = nodes[path.back()];
+    if (!parent.removed || parent.children[0] != NONE || parent.children[1] != NONE) {
+      break;
+    }
+    node = path.back();
+    path.pop_back();
+  }
+  tombstones -= freed - 1;
+  for (NodeId a : path) {
+    nodes[a].size -= freed;  // `live` is already done.
+  }
+  for (int i = path.size() - 1; i >= 0 && update_bounds(path[i]); i--) {}
+  compact_path();  // Fewer nodes can leave too many tombstones, as in `remove_many`.
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::compact_path() {
+  for (int i = path.size() - 1; i >= 0; i--) {
+    if (too_many_tombstones(path[i])) {
+      rebuild_subtree(i);  // Leaves `path` as its ancestors, which are next.
+    }
   }
+}
 
-  find_leftmost_along_axis(&(*node)->children[0], coord, axis, best_dist, best_node);
-  if (axis != (*node)->depth % 2) {
-    // No need to search the right side if we're searching along the axis as they have
-    // values greater or equal than this node. It's plausible there's a deeper node with
-    // equal value, but it's probably not worth the effort to search for. We do need to
-    // search the right side for off-axis levels as we make no claim about them.
-    find_leftmost_along_axis(&(*node)->children[1], coord, axis, best_dist, best_node);
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::rebuild_subtree(int i) {
+  NodeId node = path[i];
+  int dropped = nodes[node].size - nodes[node].live;  // Tombstones.
+  path.resize(i);  // Now the ancestors of `node`.
+  NodeId rebuilt = rebuild(node);
+  link(node) = rebuilt;
+  for (NodeId a : path) {
+    nodes[a].size -= dropped;
   }
 }
 
-void KDTree::remove_node(std::unique_ptr<Node> &node) {
-  if (!node) {
-    return;
-  } else if (node->children[1]) {
-    // It is valid to replace this node with any of the leftmost nodes in the right subtree.
-    // There may be multiple leftmost nodes, but any will do as they will all sort to the
-    // right of any of the others.
-    std::unique_ptr<Node> *best_node = nullptr;
-    int best_dist = std::numeric_limits<int>::max();
-    int axis = node->depth % 2;
-    int coord = node->value.p.coords[axis];
-    find_leftmost_along_axis(&node->children[1], coord, axis, best_dist, best_node);
-
-    // If there is a right subtree, there will be a left-most node with value >= this one.
-    assert(best_dist >= 0);
-    assert(best_node);
-
-    node->value = (*best_node)->value;
-    remove_node(*best_node);
-    return;
-  } else if (node->children[0]) {
-    // It is NOT valid to replace this node with the rightmost node of the left subtree,
-    // as promoting that node would break the invariant for all nodes that have a value
-    // equal to it along that axis, so they'd need to move from the left subtree to the
-    // right subtree. Finding/moving all of those would be a pain, so just rebuild instead.
-    int depth = node->depth;
-    sum_depth -= depth;
-    count -= 1;
-    std::vector<Value> values;
-    // Skip collecting this node as it's being removed.
-    collect_values(node->children[0], values);
-    assert(!node->children[1]);  // Otherwise we'd have replaced this node above.
-    node = build_balanced_tree(values.begin(), values.end(), depth);
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::rebuild(NodeId node) -> NodeId {
+  int depth = nodes[node].depth;
+  std::vector<Value> values;
+  values.reserve(nodes[node].live);
+  collect_values(node, values);
+  tally(&KDTreeStats::rebuilds);
+  tally(&KDTreeStats::rebuilt_values, values.size());
+  if constexpr (kKDTreeStats) {
+    counters.largest_rebuild = std::max<int64_t>(counters.largest_rebuild, values.size());
+  }
+  // Rebuilding reuses the nodes just freed, so the pool doesn't grow.
+  size_t pool_size = nodes.size();
+  node = build_balanced_tree(values.begin(), values.end(), depth);
+  assert(nodes.size() == pool_size);
+  return node;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::collect_values(
+    NodeId node, std::vector<Value> &values) {
+  if (node == NONE) {
     return;
+  }
+  const Node& n = nodes[node];
+  if (n.removed) {
+    tombstones -= 1;
   } else {
-    // A leaf node can just be removed.
-    sum_depth -= node->depth;
+    values.push_back(n.value);
+    count -= 1;
+  }
+  collect_values(n.children[0], values);
+  collect_values(n.children[1], values);
+  free_node(node);
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::insert_many(std::span<const Value> values) {
+  if (values.size() < kMinBatch) {
+    int inserted = 0;
+    for (const Value& v : values) {
+      inserted += insert(v);
+    }
+    return inserted;
+  }
+
+  // Only the first of any duplicates counts, as later inserts of it would fail.
+  batch.assign(values.begin(), values.end());
+  std::stable_sort(batch.begin(), batch.end(), [](const Value& a, const Value& b) {
+      return a.p < b.p; });
+  batch.erase(std::unique(batch.begin(), batch.end(), [](const Value& a, const Value& b) {
+      return a.p == b.p; }), batch.end());
+
+  int before = count;
+  int deepest = 0;
+  float max_depth = std::log(count + tombstones + batch.size()) / std::log(1 / kAlpha);
+  root = insert_many(root, batch.begin(), batch.end(), 0, max_depth, deepest);
+  return count - before;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::insert_many(
+    NodeId node, typename std::vector<Value>::iterator start,
+    typename std::vector<Value>::iterator end, int depth, float max_depth, int& deepest)
+    -> NodeId {
+  if (start == end) {
+    return node;
+  }
+  if (node == NONE) {
+    deepest = std::max(deepest, depth + int(std::bit_width(unsigned(end - start))) - 1);
+    return build_balanced_tree(start, end, depth);
+  }
+
+  // Building may grow the pool, so don't hold on to references into it.
+  Point p = nodes[node].value.p;
+  int axis = depth % Dims;
+  auto mid = std::partition(start, end, [p, axis](const Value& v) { return less(v.p, p, axis); });
+  auto right = std::partition(mid, end, [p](const Value& v) { return v.p == p; });
+  if (mid != right && nodes[node].removed) {
+    // Still in the right place, so bring it back.
+    nodes[node].value = *mid;
+    nodes[node].removed = false;
+    tombstones -= 1;
+    count += 1;
+  }
+
+  int deepest_below = 0;
+  NodeId left_child = insert_many(
+      nodes[node].children[0], start, mid, depth + 1, max_depth, deepest_below);
+  nodes[node].children[0] = left_child;
+  NodeId right_child = insert_many(
+      nodes[node].children[1], right, end, depth + 1, max_depth, deepest_below);
+  nodes[node].children[1] = right_child;
+  update(node);
+
+  // Like `insert`, rebuild the deepest unbalanced subtree above anything too deep.
+  const Node& n = nodes[node];
+  if (deepest_below > max_depth) {
+    for (NodeId c : n.children) {
+      if (c != NONE && nodes[c].size > kAlpha * n.size) {
+        node = rebuild(node);
+        deepest_below = depth + int(std::bit_width(unsigned(nodes[node].size))) - 1;
+        break;
+      }
+    }
+  }
+  deepest = std::max(deepest, deepest_below);
+  return node;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::remove_many(std::span<const Point> points) {
+  if (points.size() < kMinBatch) {
+    int removed = 0;
+    for (Point p : points) {
+      removed += remove(p);
+    }
+    return removed;
+  }
+
+  int before = count;
+  batch_points.assign(points.begin(), points.end());
+  root = remove_many(root, batch_points.begin(), batch_points.end());
+  return before - count;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::remove_many(
+    NodeId node, typename std::vector<Point>::iterator start,
+    typename std::vector<Point>::iterator end) -> NodeId {
+  if (start == end || node == NONE) {
+    return node;
+  }
+
+  Node& n = nodes[node];
+  int axis = n.depth % Dims;
+  Point p = n.value.p;
+  auto mid = std::partition(start, end, [p, axis](const Point& q) { return less(q, p, axis); });
+  auto right = std::partition(mid, end, [p](const Point& q) { return q == p; });
+  if (mid != right && !n.removed) {
+    n.removed = true;
+    tombstones += 1;
     count -= 1;
-    node.reset();
+  }
+  // Removing doesn't allocate, so `n` stays valid.
+  n.children[0] = remove_many(n.children[0], start, mid);
+  n.children[1] = remove_many(n.children[1], right, end);
+
+  if (n.removed && n.children[0] == NONE && n.children[1] == NONE) {
+    free_node(node);
+    tombstones -= 1;
+    return NONE;
+  }
+  update(node);
+  if (too_many_tombstones(node)) {
+    node = rebuild(node);
+  }
+  return node;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::update(NodeId node) {
+  Node& n = nodes[node];
+  n.size = 1;
+  n.live = !n.removed;
+  for (NodeId c : n.children) {
+    if (c != NONE) {
+      n.size += nodes[c].size;
+      n.live += nodes[c].live;
+    }
+  }
+  update_bounds(node);
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::too_many_tombstones(NodeId node) const {
+  const Node& n = nodes[node];
+  int dead = n.size - n.live;
+  return dead > kMinTombstones && dead > kMaxTombstones * n.size;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+bool KDTreeT<Payload, Coord, Dims, Metric>::update_bounds(NodeId node) {
+  Node& n = nodes[node];
+  Point min = n.min, max = n.max;
+  bool any = !n.removed;
+  if (any) {
+    n.min = n.max = n.value.p;
+  }
+  for (NodeId c : n.children) {
+    if (c == NONE || nodes[c].live == 0) {
+      continue;
+    }
+    const Node& child = nodes[c];
+    if (!any) {
+      n.min = child.min;
+      n.max = child.max;
+      any = true;
+      continue;
+    }
+    for (int i = 0; i < Dims; i++) {
+      n.min.coords[i] = std::min(n.min.coords[i], child.min.coords[i]);
+      n.max.coords[i] = std::max(n.max.coords[i], child.max.coords[i]);
+    }
+  }
+  // Without values, the bounds are stale, and the parent needs updating to ignore them.
+  return !any || n.min != min || n.max != max;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::pop_closest(Point p) -> Value {
+  assert(count > 0);
+  NodeId best_node = find_closest_node(p);
+  assert(best_node != NONE);
+  Value out = nodes[best_node].value;
+  remove(out.p);  // Again, to find the path.
+  return out;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find_k_closest(Point p, int k) const
+    -> std::vector<Value> {
+  tally(&KDTreeStats::searches);
+  std::vector<std::pair<Coord, NodeId>> heap;
+  if (k > 0) {
+    heap.reserve(k);
+    find_k_closest(root, p, k, heap);
+  }
+  std::sort_heap(heap.begin(), heap.end());
+  std::vector<Value> out;
+  out.reserve(heap.size());
+  for (auto [dist, node] : heap) {
+    out.push_back(nodes[node].value);
+  }
+  return out;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::find_k_closest(
+    NodeId node, Point p, int k, std::vector<std::pair<Coord, NodeId>>& heap) const {
+  // Like `find_closest`, but the bound is the k-th best so far.
+  if (node == NONE || nodes[node].live == 0) {
+    return;
+  }
+  const Node& n = nodes[node];
+  if (int(heap.size()) == k && box_distance(p, n) >= heap.front().first) {
     return;
   }
+  tally(&KDTreeStats::visited);
+
+  if (!n.removed) {
+    Coord dist = distance(p, n.value.p);
+    if (int(heap.size()) < k) {
+      heap.push_back({dist, node});
+      std::push_heap(heap.begin(), heap.end());
+    } else if (dist < heap.front().first) {
+      std::pop_heap(heap.begin(), heap.end());
+      heap.back() = {dist, node};
+      std::push_heap(heap.begin(), heap.end());
+    }
+  }
+
+  int axis = n.depth % Dims;
+  int search_first = less(p, n.value.p, axis) ? 0 : 1;
+  find_k_closest(n.children[search_first], p, k, heap);
+  if (int(heap.size()) < k ||
+      Metric::axis_distance(p.coords[axis], n.value.p.coords[axis]) < heap.front().first) {
+    find_k_closest(n.children[!search_first], p, k, heap);
+  }
 }
 
-KDTree::Value KDTree::pop_closest(Pointi p) {
-  assert(root != nullptr);
-  std::unique_ptr<Node> *best_node = nullptr;
-  int best_dist = std::numeric_limits<int>::max();
-  find_closest(&root, p, best_dist, best_node);
-  assert(best_node);
-  Value out = (*best_node)->value;
-  remove_node(*best_node);
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find_within(Point p, Coord radius) const
+    -> std::vector<Value> {
+  tally(&KDTreeStats::searches);
+  std::vector<Value> out;
+  find_within(root, p, radius, out);
   return out;
 }
 
-void KDTree::print_tree(std::ostream& stream) const {
-  if (root) {
-    stream << root->value << std::endl;
-    print_tree(stream, root->children[0].get(), "", true);
-    print_tree(stream, root->children[1].get(), "", false);
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::find_within(
+    NodeId node, Point p, Coord radius, std::vector<Value>& out) const {
+  if (node == NONE || nodes[node].live == 0 || box_distance(p, nodes[node]) > radius) {
+    return;
+  }
+  tally(&KDTreeStats::visited);
+  const Node& n = nodes[node];
+  if (!n.removed && distance(p, n.value.p) <= radius) {
+    out.push_back(n.value);
+  }
+  // Values on the left are at most this node's coordinate along the axis, and on the right at
+  // least, so skip a side the radius doesn't reach without looking at it.
+  int axis = n.depth % Dims;
+  Coord c = n.value.p.coords[axis];
+  Coord d = Metric::axis_distance(p.coords[axis], c);
+  if (p.coords[axis] <= c || d <= radius) {
+    find_within(n.children[0], p, radius, out);
+  }
+  if (p.coords[axis] >= c || d <= radius) {
+    find_within(n.children[1], p, radius, out);
   }
 }
 
-std::ostream& operator<<(std::ostream& stream, const KDTree& t) {
-  t.print_tree(stream);
-  return stream;
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::find_in_box(Point min, Point max) const
+    -> std::vector<Value> {
+  tally(&KDTreeStats::searches);
+  std::vector<Value> out;
+  find_in_box(root, min, max, out);
+  return out;
 }
 
-void KDTree::print_tree(std::ostream& stream, const Node* node, std::string prefix, bool first) const {
-  if (!node) {
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::find_in_box(
+    NodeId node, Point min, Point max, std::vector<Value>& out) const {
+  if (node == NONE || nodes[node].live == 0) {
     return;
   }
-  stream << prefix << (first ? "├─" : "└─") << node->value << std::endl;
-  prefix += (first ? "│ " : "  ");
-  print_tree(stream, node->children[0].get(), prefix, true);
-  print_tree(stream, node->children[1].get(), prefix, false);
+  const Node& n = nodes[node];
+  for (int i = 0; i < Dims; i++) {
+    if (n.max.coords[i] < min.coords[i] || n.min.coords[i] >= max.coords[i]) {
+      return;
+    }
+  }
+  tally(&KDTreeStats::visited);
+  if (!n.removed) {
+    bool inside = true;
+    for (int i = 0; i < Dims; i++) {
+      inside &= min.coords[i] <= n.value.p.coords[i] && n.value.p.coords[i] < max.coords[i];
+    }
+    if (inside) {
+      out.push_back(n.value);
+    }
+  }
+  int axis = n.depth % Dims;
+  Coord c = n.value.p.coords[axis];
+  if (min.coords[axis] <= c) {
+    find_in_box(n.children[0], min, max, out);
+  }
+  if (c < max.coords[axis]) {
+    find_in_box(n.children[1], min, max, out);
+  }
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::pop_within(Point p, Coord radius)
+    -> std::vector<Value> {
+  std::vector<Value> out = find_within(p, radius);
+  std::vector<Point> points;
+  points.reserve(out.size());
+  for (const Value& v : out) {
+    points.push_back(v.p);
+  }
+  remove_many(points);
+  return out;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::print_tree(std::ostream& stream) const {
+  if (root != NONE) {
+    print_tree(stream, root, "", true);
+  }
 }
 
-void KDTree::collect_values(std::unique_ptr<Node> &node, std::vector<Value> &values) {
-  if (!node) {
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::print_tree(
+    std::ostream& stream, NodeId node, std::string prefix, bool first) const {
+  if (node == NONE) {
     return;
   }
-  values.push_back(node->value);
-  collect_values(node->children[0], values);
-  collect_values(node->children[1], values);
-  sum_depth -= node->depth;
-  count -= 1;
-  node.reset();
+  const Node& n = nodes[node];
+  if (node == root) {
+    stream << n.value << (n.removed ? " removed" : "") << std::endl;
+  } else {
+    stream << prefix << (first ? "├─" : "└─") << n.value << (n.removed ? " removed" : "")
+           << std::endl;
+    prefix += (first ? "│ " : "  ");
+  }
+  print_tree(stream, n.children[0], prefix, true);
+  print_tree(stream, n.children[1], prefix, false);
 }
 
-void KDTree::rebalance() {
-  if (!root) {
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::rebalance(ThreadPool& pool) {
+  if (root == NONE) {
     return;
   }
+  std::chrono::steady_clock::time_point start;
+  if constexpr (kKDTreeStats) {
+    start = std::chrono::steady_clock::now();
+  }
+
+  std::vector<Value> values(begin(), end());
+  clear();
+  nodes.resize(values.size());
+
+  // Split the big subtrees one level at a time across the pool, then build all the small ones in
+  // one `parallel_for`, which the threads take from as they finish, so a slow subtree only holds up
+  // its own thread. The pool can't fork tasks from within a task, so the splitting waits for each
+  // level, but that's only log2(n / kMinParallelBuild) levels of partitioning. Every subtree knows
+  // where its nodes go, so the threads never share anything.
+  struct Subtree {
+    typename std::vector<Value>::iterator start, end;
+    int depth;
+    NodeId first;
+  };
+  std::vector<Subtree> level, next, small;
+  (int(values.size()) < kMinParallelBuild ? small : level).push_back(
+      {values.begin(), values.end(), 0, 0});
+  std::vector<NodeId> split;  // The nodes built one level at a time, in order.
+  while (!level.empty()) {
+    next.assign(2 * level.size(), {values.end(), values.end(), 0, NONE});
+    pool.parallel_for(level.size(), [this, &level, &next](int i) {
+      const Subtree& t = level[i];
+      auto mid = partition(t.start, t.end, t.depth % Dims);
+      NodeId left = t.first + 1;
+      NodeId right = t.first + 1 + (mid - t.start);
+      int size = t.end - t.start;
+      nodes[t.first] = Node{
+          *mid, t.depth, size, size,
+          {mid == t.start ? NONE : left, mid + 1 == t.end ? NONE : right}, false, mid->p, mid->p};
+      next[2 * i] = {t.start, mid, t.depth + 1, left};
+      next[2 * i + 1] = {mid + 1, t.end, t.depth + 1, right};
+    });
+    for (const Subtree& t : level) {
+      sum_depth += t.depth;
+      split.push_back(t.first);
+    }
+    level.clear();
+    for (const Subtree& t : next) {
+      if (t.end - t.start >= kMinParallelBuild) {
+        level.push_back(t);
+      } else if (t.start != t.end) {
+        small.push_back(t);
+      }
+    }
+  }
+  std::vector<int> depths(small.size());
+  pool.parallel_for(small.size(), [this, &small, &depths](int i) {
+    depths[i] = build_range(small[i].start, small[i].end, small[i].depth, small[i].first);
+  });
+  for (int d : depths) {
+    sum_depth += d;
+  }
+  // Their children are done now, so they can take their bounds from them, deepest first.
+  for (int i = split.size() - 1; i >= 0; i--) {
+    update_bounds(split[i]);
+  }
+  count = values.size();
+  root = 0;
+  tally_rebalance(start);
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::rebalance() {
+  if (root == NONE) {
+    return;
+  }
+  std::chrono::steady_clock::time_point start;
+  if constexpr (kKDTreeStats) {
+    start = std::chrono::steady_clock::now();
+  }
 
   // std::cout << "before " << balance_str() << std::endl;
 
   std::vector<Value> values;
   values.reserve(count);
-  collect_values(root, values);
-
-  assert(!root);
-  assert(sum_depth == 0);
-  assert(count == 0);
+  for (Value v : *this) {
+    values.push_back(v);
+  }
+  clear();  // Every node is about to be rebuilt, so reuse the pool from the start.
 
   root = build_balanced_tree(values.begin(), values.end(), 0);
-  assert(values.size() == size());
+  assert(int(values.size()) == size());
 
   // std::cout << "after  " << balance_str() << std::endl;
+  tally_rebalance(start);
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::tally_rebalance(
+    std::chrono::steady_clock::time_point start) {
+  if constexpr (kKDTreeStats) {
+    counters.rebalances += 1;
+    counters.rebalance_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
 }
 
-std::unique_ptr<KDTree::Node> KDTree::build_balanced_tree(
-    std::vector<Value>::iterator start, std::vector<Value>::iterator end, int depth) {
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::build_balanced_tree(
+    typename std::vector<Value>::iterator start, typename std::vector<Value>::iterator end,
+    int depth) -> NodeId {
   if (start == end) {
-    return nullptr;
+    return NONE;
   }
 
-  int axis = depth % 2;
+  auto mid = partition(start, end, depth % Dims);
+  NodeId node = new_node(*mid, depth);
+  NodeId left = build_balanced_tree(start, mid, depth + 1);
+  NodeId right = build_balanced_tree(mid + 1, end, depth + 1);
+  nodes[node].children[0] = left;
+  nodes[node].children[1] = right;
+  nodes[node].size = end - start;
+  nodes[node].live = end - start;
+  update_bounds(node);
 
+  return node;
+}
+
+template<class Payload, class Coord, int Dims, class Metric>
+auto KDTreeT<Payload, Coord, Dims, Metric>::partition(
+    typename std::vector<Value>::iterator start, typename std::vector<Value>::iterator end,
+    int axis) -> typename std::vector<Value>::iterator {
   // Choose the pivot.
-  std::vector<Value>::iterator mid = std::next(start, std::distance(start, end) / 2);
-  // Find the pivot value
+  auto mid = std::next(start, std::distance(start, end) / 2);
+  // Find the pivot value. Ties are broken by the other axes, so even a row of equal values splits
+  // in half.
   std::nth_element(start, mid, end, [axis](const Value &a, const Value &b) {
-      return a.p.coords[axis] < b.p.coords[axis]; });
-  Value pivot = *mid;
-  // Find the pivot's true location, as it has to be the first of that value.
-  mid = std::partition(start, mid, [axis, pivot](const Value& a) {
-      return a.p.coords[axis] < pivot.p.coords[axis]; });
-
-  auto node = std::make_unique<Node>(*mid, depth);
-  sum_depth += depth;
-  count += 1;
-  node->children[0] = build_balanced_tree(start, mid, depth + 1);
-  node->children[1] = build_balanced_tree(mid + 1, end, depth + 1);
+      return less(a.p, b.p, axis); });
+  return mid;
+}
 
-  return node;
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::build_range(
+    typename std::vector<Value>::iterator start, typename std::vector<Value>::iterator end,
+    int depth, NodeId first) {
+  if (start == end) {
+    return 0;
+  }
+  auto mid = partition(start, end, depth % Dims);
+  NodeId left = first + 1;
+  NodeId right = first + 1 + (mid - start);
+  int size = end - start;
+  nodes[first] = Node{
+      *mid, depth, size, size, {mid == start ? NONE : left, mid + 1 == end ? NONE : right}, false,
+      mid->p, mid->p};
+  int sum = (depth + build_range(start, mid, depth + 1, left) +
+             build_range(mid + 1, end, depth + 1, right));
+  update_bounds(first);
+  return sum;
 }
 
-std::string KDTree::balance_str() const {
+template<class Payload, class Coord, int Dims, class Metric>
+std::string KDTreeT<Payload, Coord, Dims, Metric>::balance_str() const {
   return absl::StrFormat(
       "size: %i, max depth: %i, avg depth: %.3f, std dev: %.3f, balance: %.3f",
       size(), depth_max(), depth_avg(), depth_stddev(), balance_factor());
 }
 
-int KDTree::depth_max() const {
-  return depth_max(root.get());
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::depth_max() const {
+  return depth_max(root);
 }
-int KDTree::depth_max(const Node* node) const {
-  if (!node) {
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::depth_max(NodeId node) const {
+  if (node == NONE) {
     return 0;
   }
   return std::max({
-    node->depth,
-    depth_max(node->children[0].get()),
-    depth_max(node->children[1].get())
+    nodes[node].depth,
+    depth_max(nodes[node].children[0]),
+    depth_max(nodes[node].children[1])
   });
 }
 
-float KDTree::depth_avg() const {
-  if (count > 0) {
-    return float(sum_depth) / count;
-    // return float(sum_node_depth(root.get())) / count;
+template<class Payload, class Coord, int Dims, class Metric>
+float KDTreeT<Payload, Coord, Dims, Metric>::depth_avg() const {
+  // Tombstones count, as they're still part of the tree's shape.
+  if (int total = count + tombstones; total > 0) {
+    return float(sum_depth) / total;
+    // return float(sum_node_depth(root)) / total;
   } else {
     return 0;
   }
 }
-int KDTree::sum_node_depth(const Node* node) const {
-  if (!node) {
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::sum_node_depth(NodeId node) const {
+  if (node == NONE) {
     return 0;
   } else {
-    return (sum_node_depth(node->children[0].get()) + 
-            sum_node_depth(node->children[1].get()) + node->depth);
+    return (sum_node_depth(nodes[node].children[0]) + 
+            sum_node_depth(nodes[node].children[1]) + nodes[node].depth);
   }
 }
 
-float KDTree::balance_factor() const {
-  if (count == 0) {
+template<class Payload, class Coord, int Dims, class Metric>
+float KDTreeT<Payload, Coord, Dims, Metric>::balance_factor() const {
+  if (root == NONE) {
     return 1;
   } else {
-    int leaves = leaf_count(root.get());
-    return 2.0 * leaves / count;
+    int leaves = leaf_count(root);
+    return 2.0 * leaves / (count + tombstones);
   }
 }
 
-int KDTree::leaf_count(const Node* node) const {
-  if (!node) {
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::leaf_count(NodeId node) const {
+  if (node == NONE) {
     return 0;
-  } else if (!node->children[0] && !node->children[1]) {
+  } else if (nodes[node].children[0] == NONE && nodes[node].children[1] == NONE) {
     return 1;
   } else {
-    return (leaf_count(node->children[0].get()) + 
-            leaf_count(node->children[1].get()));
+    return (leaf_count(nodes[node].children[0]) + 
+            leaf_count(nodes[node].children[1]));
   }
 }
 
-double KDTree::depth_stddev() const {
-  if (count > 0) {
-    auto [_, variance] = depth_variance(root.get());
-    return std::sqrt(variance / count);
+template<class Payload, class Coord, int Dims, class Metric>
+double KDTreeT<Payload, Coord, Dims, Metric>::depth_stddev() const {
+  if (int total = count + tombstones; total > 0) {
+    auto [_, variance] = depth_variance(root);
+    return std::sqrt(variance / total);
   } else {
     return 0;
   }
 }
 
-std::pair<int, double> KDTree::depth_variance(Node *node) const {
-  if (!node) return {0, 0.0};
+template<class Payload, class Coord, int Dims, class Metric>
+std::pair<int, double> KDTreeT<Payload, Coord, Dims, Metric>::depth_variance(
+    NodeId node) const {
+  if (node == NONE) return {0, 0.0};
 
-  auto [left_height, left_variance] = depth_variance(node->children[0].get());
-  auto [right_height, right_variance] = depth_variance(node->children[1].get());
+  auto [left_height, left_variance] = depth_variance(nodes[node].children[0]);
+  auto [right_height, right_variance] = depth_variance(nodes[node].children[1]);
 
   int height = std::max(left_height, right_height) + 1;
   int height_diff = left_height - right_height;
   double variance = left_variance + right_variance + height_diff * height_diff;
   return {height, variance};
 }
+
+template class KDTreeT<int, int, 2, ManhattanDistance>;
+template class KDTreeT<int, int, 2, SquaredEuclideanDistance>;
+template class KDTreeT<int, float, 3, SquaredEuclideanDistance>;
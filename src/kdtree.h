@@ -1,60 +1,233 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
+#include <iterator>
+#include <optional>
 #include <ostream>
-#include <memory>
+#include <span>
+#include <string>
 #include <vector>
 
 #include "point.h"
 
-class KDTree {
+class ThreadPool;
+
+
+// A point with `Dims` coordinates, for trees other than the 2D int one, which uses `Pointi`.
+template<class Coord, int Dims>
+struct KDPoint {
+  Coord coords[Dims];
+
+  bool operator==(const KDPoint& o) const = default;
+  bool operator<(const KDPoint& o) const {
+    for (int i = 0; i < Dims; i++) {
+      if (coords[i] != o.coords[i]) {
+        return coords[i] < o.coords[i];
+      }
+    }
+    return false;
+  }
+};
+
+template<class Coord, int Dims>
+struct KDPointType { typedef KDPoint<Coord, Dims> type; };
+template<>
+struct KDPointType<int, 2> { typedef Pointi type; };
+
+// Metrics for `KDTreeT`. `distance` is between two points, and `axis_distance` is between two
+// coordinates along one axis, which is a lower bound for the distance of points that far apart.
+struct ManhattanDistance {
+  template<class Point>
+  static auto distance(const Point& a, const Point& b) {
+    auto d = std::abs(a.coords[0] - b.coords[0]);
+    for (size_t i = 1; i < std::size(a.coords); i++) {
+      d += std::abs(a.coords[i] - b.coords[i]);
+    }
+    return d;
+  }
+  template<class Coord>
+  static Coord axis_distance(Coord a, Coord b) { return std::abs(a - b); }
+};
+
+// Squared, so it's exact for int coordinates, and orders the same.
+struct SquaredEuclideanDistance {
+  template<class Point>
+  static auto distance(const Point& a, const Point& b) {
+    auto d = (a.coords[0] - b.coords[0]) * (a.coords[0] - b.coords[0]);
+    for (size_t i = 1; i < std::size(a.coords); i++) {
+      d += (a.coords[i] - b.coords[i]) * (a.coords[i] - b.coords[i]);
+    }
+    return d;
+  }
+  template<class Coord>
+  static Coord axis_distance(Coord a, Coord b) { return (a - b) * (a - b); }
+};
+
+
+// Counters for tuning the balancing from real workloads, eg `minesweeper --benchmark`. They're
+// only kept when built with `make KDTREE_STATS=1`, and otherwise compile away and stay zero.
+#ifdef KDTREE_STATS
+constexpr bool kKDTreeStats = true;
+#else
+constexpr bool kKDTreeStats = false;
+#endif
+
+struct KDTreeStats {
+  int64_t searches = 0;  // `find_closest` and the other searches.
+  int64_t visited = 0;  // Nodes looked at by those.
+  int64_t rebalances = 0;
+  int64_t rebalance_ns = 0;
+  // Subtrees rebuilt by inserts and removes, to keep them balanced or drop tombstones.
+  int64_t rebuilds = 0;
+  int64_t rebuilt_values = 0;
+  int64_t largest_rebuild = 0;
+
+  KDTreeStats& operator+=(const KDTreeStats& o);
+  std::string str() const;
+};
+
+
+// A KDTree of `Payload`s at points with `Dims` coordinates of type `Coord`, searched by `Metric`.
+// Distances are `Coord`s too. `KDTree` below is the one the agents use. Instantiated for the
+// combinations in use at the bottom of kdtree.cc, like `AgentLastT`.
+template<class Payload, class Coord, int Dims, class Metric>
+class KDTreeT {
  public:
+  typedef typename KDPointType<Coord, Dims>::type Point;
+
   struct Value {
-    int value;
-    Pointi p;
+    Payload value;
+    Point p;
 
     Value() = default;
-    Value(int v, Pointi p) : value(v), p(p) {}
+    Value(Payload v, Point p) : value(v), p(p) {}
 
     bool operator==(const Value& o) const = default;
     bool operator!=(const Value& o) const = default;
+
+    friend std::ostream& operator<<(std::ostream& stream, const Value& v) {
+      stream << "Value(" << v.value << ", {";
+      for (int i = 0; i < Dims; i++) {
+        stream << (i ? ", " : "") << v.p.coords[i];
+      }
+      return stream << "})";
+    }
   };
 
  private:
+  // Nodes live in a pool and refer to each other by index, so the tree is compact, and inserts,
+  // removes and rebalances reuse freed nodes instead of going through malloc.
+  typedef uint32_t NodeId;
+  static constexpr NodeId NONE = UINT32_MAX;
+
+  // Bounds the depth, and so the stacks in `find_closest` and `Iterator`. Rebalancing keeps trees
+  // of up to 2^32 nodes under 45 deep.
+  static constexpr int kMaxDepth = 64;
+
   struct Node {
     Value value;
     int depth;
-    std::unique_ptr<Node> children[2];
-
-    Node(Value v, int d) : value(v), depth(d) {}
+    int size;  // Nodes in this subtree, including tombstones.
+    int live;  // Values in this subtree, not including tombstones.
+    NodeId children[2];
+    bool removed;  // A tombstone, kept to route searches until its subtree is rebuilt.
+    // Bounds of the values in this subtree, inclusive. Only meaningful if `live > 0`.
+    Point min, max;
   };
 
  public:
+  // In pre-order. The stack holds the current node and the right children waiting on the way down
+  // to it, so it's bounded by the depth and kept inline, and iterating doesn't allocate.
   class Iterator {
    public:
-    using iterator_category = std::input_iterator_tag;
+    using iterator_category = std::forward_iterator_tag;
     using value_type = Value;
-    using pointer = Value*;
-    using reference = Value&;
+    using pointer = const Value*;
+    using reference = const Value&;
     using difference_type = std::ptrdiff_t;
 
     Iterator();
-    Iterator(const Node* n);
+    Iterator(const KDTreeT* tree, NodeId n);
 
     const Value& operator*() const;
     const Value* operator->() const;
     Iterator& operator++();
     Iterator operator++(int);
-    bool operator==(const Iterator&) const = default;
-    bool operator!=(const Iterator&) const = default;
+    // The position is the current node, if any.
+    bool operator==(const Iterator& o) const {
+      return size == o.size && (size == 0 || stack[size - 1] == o.stack[size - 1]);
+    }
+    bool operator!=(const Iterator& o) const { return !(*this == o); }
    private:
-    std::vector<const Node*> stack;
+    void next();
+    void skip_removed();
+
+    const KDTreeT* tree;
+    int size;
+    NodeId stack[kMaxDepth + 1];
   };
   typedef const Iterator const_iterator;
 
-  KDTree();
-  KDTree(const std::vector<Value>& values);
+  // Streams the values in order of a key, lazily: a subtree waits in a heap under a lower bound of
+  // its keys, from its bounds, and is only opened once nothing before it is left. So taking the
+  // first few costs about as much as searching for them. Unlike `Iterator`, the heap allocates.
+  class OrderedIterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Value;
+    using pointer = const Value*;
+    using reference = const Value&;
+    using difference_type = std::ptrdiff_t;
+
+    OrderedIterator() : tree(nullptr), axis(-1) {}
+    // By `axis`, or by distance from `p` if it's -1.
+    OrderedIterator(const KDTreeT* tree, Point p, int axis);
+
+    const Value& operator*() const;
+    const Value* operator->() const;
+    OrderedIterator& operator++();
+    OrderedIterator operator++(int);
+    bool operator==(const OrderedIterator& o) const {
+      return (heap.empty() || o.heap.empty() ? heap.empty() == o.heap.empty()
+                                             : heap.front().node == o.heap.front().node);
+    }
+    bool operator!=(const OrderedIterator& o) const { return !(*this == o); }
+   private:
+    struct Entry {
+      Coord key;
+      NodeId node;
+      bool value;  // The node's own value, rather than its subtree.
+
+      // Ordered this way round to make a min-heap with the standard heap functions.
+      bool operator>(const Entry& o) const { return key > o.key; }
+    };
+    Coord key(const Node& n, bool value) const;
+    void push(NodeId node, bool value);
+    void settle();  // Opens subtrees until a value is first.
+
+    const KDTreeT* tree;
+    Point p;
+    int axis;
+    std::vector<Entry> heap;
+  };
+
+  struct OrderedRange {
+    const KDTreeT* tree;
+    Point p;
+    int axis;
+
+    OrderedIterator begin() const { return OrderedIterator(tree, p, axis); }
+    OrderedIterator end() const { return OrderedIterator(); }
+  };
+
+  KDTreeT();
+  KDTreeT(const std::vector<Value>& values);
 
   bool empty() const;
   int size() const;
@@ -62,54 +235,181 @@ class KDTree {
 
   Iterator begin() const;
   Iterator end() const;
+  // The values closest first, or in order along `axis`, with ties in no particular order.
+  OrderedRange by_distance(Point p) const { return {this, p, -1}; }
+  OrderedRange by_axis(int axis) const { return {this, Point(), axis}; }
 
   bool insert(Value v);
-  bool remove(Pointi p);
-  bool exists(Pointi p) const;
-  std::optional<Value> find(Pointi p) const;
-  Value find_closest(Pointi p);
-  Value pop_closest(Pointi p);
+  bool remove(Point p);
+  bool exists(Point p) const;
+  std::optional<Value> find(Point p) const;
+  Value find_closest(Point p);
+  Value pop_closest(Point p);
+
+  // Up to `k` values, closest first.
+  std::vector<Value> find_k_closest(Point p, int k) const;
+  // Values at most `radius` from `p` by `Metric`, so squared for `SquaredEuclideanDistance`, or
+  // with `min <= p < max` in every coordinate, in no particular order.
+  std::vector<Value> find_within(Point p, Coord radius) const;
+  std::vector<Value> find_in_box(Point min, Point max) const;
+  std::vector<Value> find_in_rect(Recti r) const requires std::same_as<Point, Pointi> {
+    return find_in_box(r.tl, r.br);
+  }
+  std::vector<Value> pop_within(Point p, Coord radius);
+
+  // The same as calling `insert` or `remove` for each in order, but the batch is split up along
+  // the way down, so it's one pass over the tree, and new subtrees are built balanced. Return the
+  // number inserted or removed.
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Point> points);
 
   void print_tree(std::ostream& stream = std::cout) const;
   void validate() const;  // Implemented and used in kdtree_test.cc, not allowed elsewhere.
 
   void rebalance();
+  // The same result, down to where each node is in the pool, but the subtrees are built in
+  // parallel, so it's worth it for big trees.
+  void rebalance(ThreadPool& pool);
   std::string balance_str() const;
+  // Since construction, not reset by `clear`. All zero unless `kKDTreeStats`.
+  const KDTreeStats& stats() const { return counters; }
   int depth_max() const;
   float depth_avg() const;
   double depth_stddev() const;
   float balance_factor() const;
 
  private:
-  std::unique_ptr<Node> root;
-  int count;
-  int sum_depth;
+  std::vector<Node> nodes;
+  std::vector<NodeId> free_nodes;
+  NodeId root;
+  int count;  // Values, not including tombstones.
+  int tombstones;
+  int sum_depth;  // Of all nodes, including tombstones.
+  std::vector<NodeId> path;  // Scratch space for the ancestors of a node being changed.
+  std::vector<Value> batch;  // Scratch space for `insert_many`.
+  std::vector<Point> batch_points;  // Scratch space for `remove_many`.
+  mutable KDTreeStats counters;
+
+  // Removed inner nodes are left as tombstones, as removing them for real means replacing them
+  // from a subtree, or rebuilding it. Once they're this fraction of a subtree's nodes, it's rebuilt
+  // without them. Removed leaves are dropped right away.
+  static constexpr float kMaxTombstones = 0.25;
+  static constexpr int kMinTombstones = 16;
+
+  // Scapegoat tree balancing: an insert deeper than `log(n) / log(1 / kAlpha)` rebuilds the
+  // deepest subtree on its path where one side holds more than `kAlpha` of the nodes. This keeps
+  // inserts amortized O(log n) without pausing to rebuild the whole tree.
+  static constexpr float kAlpha = 0.6;
+
+  // Smaller batches are cheaper to insert or remove one at a time than to sort and split.
+  static constexpr size_t kMinBatch = 16;
+
+  // Smaller subtrees are built by a single thread in the parallel `rebalance`.
+  static constexpr int kMinParallelBuild = 1 << 14;
+
+  void tally(int64_t KDTreeStats::* counter, int64_t n = 1) const {
+    if constexpr (kKDTreeStats) {
+      counters.*counter += n;
+    }
+  }
+  void tally_rebalance(std::chrono::steady_clock::time_point start);
 
-  static int distance(Pointi a, Pointi b) {
-    return std::abs(a.x - b.x) + std::abs(a.y - b.y);  // manhattan distance
-    // return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+  // Strict order along `axis`, breaking ties with the other axes. Values on the left of a node are
+  // less than it, and on the right are greater.
+  static bool less(const Point& a, const Point& b, int axis) {
+    if constexpr (Dims == 2) {
+      return (a.coords[axis] < b.coords[axis] ||
+              (a.coords[axis] == b.coords[axis] && a.coords[!axis] < b.coords[!axis]));
+    } else {
+      if (a.coords[axis] != b.coords[axis]) {
+        return a.coords[axis] < b.coords[axis];
+      }
+      for (int i = 0; i < Dims; i++) {
+        if (i != axis && a.coords[i] != b.coords[i]) {
+          return a.coords[i] < b.coords[i];
+        }
+      }
+      return false;
+    }
+  }
+  static Coord distance(const Point& a, const Point& b) {
+    return Metric::distance(a, b);
+  }
+  // Grows the bounds of `n` to cover `p`. Call it before counting `p` in `live`.
+  static void include(Node& n, const Point& p) {
+    if (n.live == 0) {
+      n.min = n.max = p;
+      return;
+    }
+    for (int i = 0; i < Dims; i++) {
+      n.min.coords[i] = std::min(n.min.coords[i], p.coords[i]);
+      n.max.coords[i] = std::max(n.max.coords[i], p.coords[i]);
+    }
+  }
+  // To the closest point in the node's bounds, so a lower bound for its subtree.
+  static Coord box_distance(const Point& p, const Node& n) {
+    Point c = p;
+    for (int i = 0; i < Dims; i++) {
+      c.coords[i] = std::clamp(p.coords[i], n.min.coords[i], n.max.coords[i]);
+    }
+    return Metric::distance(p, c);
   }
 
-  void find_closest(
-      std::unique_ptr<Node> *node, Pointi p, int &best_dist,
-      std::unique_ptr<Node> *&best_node) const;
+  NodeId new_node(Value v, int depth);
+  void free_node(NodeId n);
 
-  void find_leftmost_along_axis(
-      std::unique_ptr<Node> *node, int coord, int axis, int &best_dist,
-      std::unique_ptr<Node> *&best_node) const;
-  void remove_node(std::unique_ptr<Node> &node);
+  NodeId find_closest_node(Point p) const;
+  // `heap` is a max-heap of the best `k` so far, by distance.
+  void find_k_closest(NodeId node, Point p, int k,
+                      std::vector<std::pair<Coord, NodeId>>& heap) const;
+  void find_within(NodeId node, Point p, Coord radius, std::vector<Value>& out) const;
+  void find_in_box(NodeId node, Point min, Point max, std::vector<Value>& out) const;
 
-  void print_tree(std::ostream& stream, const Node* node, std::string prefix, bool first) const;
-  void validate(const Node* node, int depth, Pointi min, Pointi max) const;
+  // These take `path` to hold the ancestors of `node`, root first.
+  NodeId& link(NodeId node);  // The parent's child slot pointing at `node`, or `root`.
+  void remove_node(NodeId node);
+  // Rebuilds each subtree on `path` with too many tombstones, deepest first, as `remove_many` does.
+  // A rebuild drops tombstones from its ancestors too, so they're checked after it.
+  void compact_path();
+  void rebuild_subtree(int i);  // Rebuilds the subtree at `path[i]`.
 
-  int depth_max(const Node* node) const;
-  int sum_node_depth(const Node* node) const;
-  int leaf_count(const Node* node) const;
-  std::pair<int, double> depth_variance(Node *node) const;
+  // These return the new root of the subtree at `node`, which the caller links in.
+  NodeId rebuild(NodeId node);  // Without its tombstones.
+  // `deepest` is the depth of the deepest new node, and subtrees are rebuilt past `max_depth`.
+  NodeId insert_many(NodeId node, typename std::vector<Value>::iterator start,
+                     typename std::vector<Value>::iterator end, int depth, float max_depth,
+                     int& deepest);
+  NodeId remove_many(NodeId node, typename std::vector<Point>::iterator start,
+                     typename std::vector<Point>::iterator end);
+  void update(NodeId node);  // `size`, `live` and bounds, from its children.
+  bool too_many_tombstones(NodeId node) const;
+  bool update_bounds(NodeId node);  // Returns whether they changed.
 
-  void collect_values(std::unique_ptr<Node> &node, std::vector<Value> &values);
-  std::unique_ptr<Node> build_balanced_tree(std::vector<Value>::iterator start, std::vector<Value>::iterator end, int depth);
+  void print_tree(std::ostream& stream, NodeId node, std::string prefix, bool first) const;
+  int validate(NodeId node, int depth) const;  // Returns the size.
+
+  int depth_max(NodeId node) const;
+  int sum_node_depth(NodeId node) const;
+  int leaf_count(NodeId node) const;
+  std::pair<int, double> depth_variance(NodeId node) const;
+
+  void collect_values(NodeId node, std::vector<Value> &values);
+  // Moves the median along `axis` into place, and returns it.
+  static typename std::vector<Value>::iterator partition(
+      typename std::vector<Value>::iterator start, typename std::vector<Value>::iterator end,
+      int axis);
+  NodeId build_balanced_tree(typename std::vector<Value>::iterator start,
+                             typename std::vector<Value>::iterator end, int depth);
+  // Builds the same subtree as `build_balanced_tree` into `nodes` from `first` on, in the order
+  // `new_node` would take them from an empty pool. Returns the sum of their depths.
+  int build_range(typename std::vector<Value>::iterator start,
+                  typename std::vector<Value>::iterator end, int depth, NodeId first);
 };
 
-std::ostream& operator<<(std::ostream& stream, const KDTree::Value& v);
-std::ostream& operator<<(std::ostream& stream, const KDTree& t);
+template<class Payload, class Coord, int Dims, class Metric>
+std::ostream& operator<<(std::ostream& stream, const KDTreeT<Payload, Coord, Dims, Metric>& t) {
+  t.print_tree(stream);
+  return stream;
+}
+
+typedef KDTreeT<int, int, 2, ManhattanDistance> KDTree;
@@ -1,50 +1,110 @@
 
+#include <bit>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 
 #include "absl/algorithm/container.h"
 #include "absl/random/random.h"
 #include "absl/strings/str_format.h"
 
+#include "bucket_grid.h"
+#include "bucket_kdtree.h"
 #include "catch2/catch_amalgamated.h"
+#include "flat_kdtree.h"
+#include "hilbert_queue.h"
 #include "kdtree.h"
 #include "point.h"
 #include "random.h"
+#include "thread.h"
 
 
-void KDTree::validate() const {
-  int min = std::numeric_limits<int>::min();
-  int max = std::numeric_limits<int>::max();
-  validate(root.get(), 0, Pointi(min, min), Pointi(max, max));
+template<class Payload, class Coord, int Dims, class Metric>
+void KDTreeT<Payload, Coord, Dims, Metric>::validate() const {
+  REQUIRE(validate(root, 0) == size() + tombstones);
+  REQUIRE(size() + tombstones + free_nodes.size() == nodes.size());
+
+  int values = 0, removed = 0;
+  std::vector<NodeId> stack;
+  if (root != NONE) {
+    stack.push_back(root);
+  }
+  while (!stack.empty()) {
+    const Node& n = nodes[stack.back()];
+    stack.pop_back();
+    values += !n.removed;
+    removed += n.removed;
+    // Removed leaves are dropped right away.
+    REQUIRE((!n.removed || n.children[0] != NONE || n.children[1] != NONE));
+    for (NodeId c : n.children) {
+      if (c != NONE) {
+        stack.push_back(c);
+      }
+    }
+  }
+  REQUIRE(values == size());
+  REQUIRE(removed == tombstones);
 }
 
-void KDTree::validate(const Node* node, int depth, Pointi min, Pointi max) const {
-  if (!node) {
-    return;
+template<class Payload, class Coord, int Dims, class Metric>
+int KDTreeT<Payload, Coord, Dims, Metric>::validate(NodeId node, int depth) const {
+  if (node == NONE) {
+    return 0;
   }
 
-  REQUIRE(node->depth == depth);
-  REQUIRE(node->value.p.x >= min.x);
-  REQUIRE(node->value.p.y >= min.y);
-  REQUIRE(node->value.p.x < max.x);
-  REQUIRE(node->value.p.y < max.y);
+  const Node& n = nodes[node];
+  REQUIRE(n.depth == depth);
+
+  // Everything in the left subtree sorts before this node, and everything in the right after.
+  // The bounds are exactly those of the values.
+  int axis = depth % Dims;
+  Point min = n.value.p, max = n.value.p;
+  bool any = !n.removed;
+  for (int side = 0; side < 2; side++) {
+    std::vector<NodeId> stack = {n.children[side]};
+    while (!stack.empty()) {
+      NodeId c = stack.back();
+      stack.pop_back();
+      if (c != NONE) {
+        Point p = nodes[c].value.p;
+        REQUIRE((side == 0 ? less(p, n.value.p, axis) : less(n.value.p, p, axis)));
+        if (!nodes[c].removed) {
+          if (!any) {
+            min = max = p;
+            any = true;
+          }
+          for (int i = 0; i < Dims; i++) {
+            min.coords[i] = std::min(min.coords[i], p.coords[i]);
+            max.coords[i] = std::max(max.coords[i], p.coords[i]);
+          }
+        }
+        stack.push_back(nodes[c].children[0]);
+        stack.push_back(nodes[c].children[1]);
+      }
+    }
+  }
 
-  if (depth % 2 == 0) {
-    validate(
-        node->children[0].get(), depth + 1,
-        Pointi(min.x, min.y), Pointi(node->value.p.x, max.y));
-    validate(
-        node->children[1].get(), depth + 1,
-        Pointi(node->value.p.x, min.y), Pointi(max.x, max.y));
-  } else {
-    validate(
-        node->children[0].get(), depth + 1,
-        Pointi(min.x, min.y), Pointi(max.x, node->value.p.y));
-    validate(
-        node->children[1].get(), depth + 1,
-        Pointi(min.x, node->value.p.y), Pointi(max.x, max.y));
+  int size = 1 + validate(n.children[0], depth + 1) + validate(n.children[1], depth + 1);
+  REQUIRE(n.size == size);
+  int live = !n.removed;
+  for (NodeId c : n.children) {
+    if (c != NONE) {
+      live += nodes[c].live;
+    }
+  }
+  REQUIRE(n.live == live);
+  if (live > 0) {
+    REQUIRE(n.min == min);
+    REQUIRE(n.max == max);
   }
+  return size;
 }
 
+// Others, like `FlatKDTree::validate`, call these from elsewhere.
+template void KDTreeT<int, int, 2, ManhattanDistance>::validate() const;
+template void KDTreeT<int, float, 3, SquaredEuclideanDistance>::validate() const;
+
 
 TEST_CASE("KDtree", "[kdtree]") {
   KDTree tree;
@@ -75,13 +135,13 @@ TEST_CASE("KDtree", "[kdtree]") {
   INFO("Tree: \n" << tree);
 
   std::vector<KDTree::Value> values(tree.begin(), tree.end());
-  REQUIRE(points.size() == tree.size());
+  REQUIRE(int(points.size()) == tree.size());
   REQUIRE(points.size() == values.size());
 
   SECTION("Points are equal") {
     absl::c_sort(points);
     absl::c_sort(values, [](auto a, auto b) { return a.p < b.p; });
-    for (int i = 0; i < points.size(); i++) {
+    for (int i = 0; i < int(points.size()); i++) {
       REQUIRE(points[i] == values[i].p);
     }
   }
@@ -97,7 +157,7 @@ TEST_CASE("KDtree", "[kdtree]") {
     for (int x = 0; x < 10; x++) {
       for (int y = 0; y < 10; y++) {
         int index = absl::c_find(points, Pointi(x, y)) - points.begin();
-        bool exists = (index != points.size());
+        bool exists = (index != int(points.size()));
         INFO("Find " << Pointi(x, y) << ", exists: " << exists << ", index: " << index << "\n" << tree);
         REQUIRE(exists == tree.exists({x, y}));
         auto value = tree.find({x, y});
@@ -131,7 +191,7 @@ TEST_CASE("KDtree", "[kdtree]") {
   }
 
   SECTION("pop works") {
-    REQUIRE(tree.size() == points.size());
+    REQUIRE(tree.size() == int(points.size()));
     while (!tree.empty()) {
       tree.pop_closest({3, 4});
       tree.validate();
@@ -139,6 +199,400 @@ TEST_CASE("KDtree", "[kdtree]") {
   }
 }
 
+TEST_CASE("KDTree tombstones", "[kdtree]") {
+  // Lazy removal answers every query the same as a plain list of the values would.
+  KDTree tree;
+  std::vector<KDTree::Value> values;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 30), absl::Uniform(bitgen, 0, 30));
+  };
+  auto find = [&values](Pointi p) -> std::optional<KDTree::Value> {
+    auto it = absl::c_find_if(values, [p](const KDTree::Value& v) { return v.p == p; });
+    return it == values.end() ? std::nullopt : std::optional(*it);
+  };
+  auto dist = [](Pointi a, Pointi b) { return std::abs(a.x - b.x) + std::abs(a.y - b.y); };
+
+  for (int i = 0; i < 5000; i++) {
+    Pointi p = gen_point();
+    CAPTURE(i, p);
+    // Grow, then shrink, then grow again, so the tree goes through compactions.
+    int op = absl::Uniform(bitgen, 0, 10) + (i % 2000 < 1000 ? -2 : 2);
+    if (op < 5) {
+      bool missing = !find(p);
+      REQUIRE(tree.insert({i, p}) == missing);
+      if (missing) {
+        values.push_back({i, p});
+      }
+    } else if (op < 8) {
+      bool exists = bool(find(p));
+      REQUIRE(tree.remove(p) == exists);
+      std::erase_if(values, [p](const KDTree::Value& v) { return v.p == p; });
+    } else if (op < 9) {
+      REQUIRE(tree.find(p) == find(p));
+    } else if (!values.empty()) {
+      KDTree::Value a = tree.pop_closest(p);
+      int best = dist(p, values[0].p);
+      for (const KDTree::Value& v : values) {
+        best = std::min(best, dist(p, v.p));
+      }
+      REQUIRE(dist(p, a.p) == best);
+      REQUIRE(find(a.p) == a);
+      std::erase_if(values, [a](const KDTree::Value& v) { return v.p == a.p; });
+    }
+    REQUIRE(tree.size() == int(values.size()));
+    REQUIRE(tree.empty() == values.empty());
+    if (i % 50 == 0) {
+      INFO(tree);
+      tree.validate();
+      std::vector<KDTree::Value> a(tree.begin(), tree.end()), b = values;
+      absl::c_sort(a, [](auto a, auto b) { return a.p < b.p; });
+      absl::c_sort(b, [](auto a, auto b) { return a.p < b.p; });
+      REQUIRE(a == b);
+    }
+  }
+}
+
+TEST_CASE("KDTree bulk", "[kdtree]") {
+  // Matches inserting and removing one at a time, including duplicates within a batch.
+  KDTree bulk, tree;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 40), absl::Uniform(bitgen, 0, 40));
+  };
+
+  for (int i = 0; i < 300; i++) {
+    CAPTURE(i);
+    // Batches of all sizes, from a few points to most of the tree.
+    int n = absl::Uniform(bitgen, 1, 1 << absl::Uniform(bitgen, 1, 11));
+    if (absl::Uniform(bitgen, 0, 2)) {
+      std::vector<KDTree::Value> values;
+      int inserted = 0;
+      for (int j = 0; j < n; j++) {
+        values.push_back({i * 1000 + j, gen_point()});
+        inserted += tree.insert(values.back());
+      }
+      REQUIRE(bulk.insert_many(values) == inserted);
+    } else {
+      std::vector<Pointi> points;
+      int removed = 0;
+      for (int j = 0; j < n; j++) {
+        points.push_back(gen_point());
+        removed += tree.remove(points.back());
+      }
+      REQUIRE(bulk.remove_many(points) == removed);
+    }
+    REQUIRE(bulk.size() == tree.size());
+    INFO(bulk);
+    bulk.validate();
+    std::vector<KDTree::Value> a(bulk.begin(), bulk.end()), b(tree.begin(), tree.end());
+    absl::c_sort(a, [](auto a, auto b) { return a.p < b.p; });
+    absl::c_sort(b, [](auto a, auto b) { return a.p < b.p; });
+    REQUIRE(a == b);
+  }
+}
+
+TEST_CASE("KDTree sorted inserts stay balanced", "[kdtree]") {
+  KDTree tree;
+  for (int x = 0; x < 100; x++) {
+    for (int y = 0; y < 100; y++) {
+      tree.insert({x, {x, y}});
+    }
+  }
+  tree.validate();
+  REQUIRE(tree.depth_max() <= 2.5 * std::bit_width(10000u));
+
+  // Values in a line are equal along one axis, but still split along it by the other.
+  tree.clear();
+  for (int y = 0; y < 10000; y++) {
+    tree.insert({y, {0, y}});
+  }
+  tree.validate();
+  REQUIRE(tree.depth_max() <= 2.5 * std::bit_width(10000u));
+}
+
+TEST_CASE("KDTree queries", "[kdtree]") {
+  // Each query matches a scan over all the values, with tombstones in the way.
+  KDTree tree;
+  std::vector<KDTree::Value> values;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 60), absl::Uniform(bitgen, 0, 60));
+  };
+  auto dist = [](Pointi a, Pointi b) { return std::abs(a.x - b.x) + std::abs(a.y - b.y); };
+  auto by_point = [](std::vector<KDTree::Value> v) {
+    absl::c_sort(v, [](auto a, auto b) { return a.p < b.p; });
+    return v;
+  };
+  for (int i = 0; i < 2000; i++) {
+    KDTree::Value v(i, gen_point());
+    if (tree.insert(v)) {
+      values.push_back(v);
+    }
+  }
+  for (int i = 0; i < 500; i++) {
+    Pointi p = gen_point();
+    if (tree.remove(p)) {
+      std::erase_if(values, [p](const KDTree::Value& v) { return v.p == p; });
+    }
+  }
+
+  for (int i = 0; i < 300; i++) {
+    Pointi p = gen_point();
+    CAPTURE(i, p);
+
+    int k = absl::Uniform(bitgen, 0, 20);
+    std::vector<int> dists;
+    for (const KDTree::Value& v : values) {
+      dists.push_back(dist(p, v.p));
+    }
+    absl::c_sort(dists);
+    dists.resize(std::min<int>(k, dists.size()));
+    std::vector<int> found;
+    for (const KDTree::Value& v : tree.find_k_closest(p, k)) {
+      REQUIRE(tree.find(v.p) == v);
+      found.push_back(dist(p, v.p));
+    }
+    REQUIRE(found == dists);
+
+    int radius = absl::Uniform(bitgen, 0, 15);
+    std::vector<KDTree::Value> within;
+    absl::c_copy_if(values, std::back_inserter(within),
+                    [&](const KDTree::Value& v) { return dist(p, v.p) <= radius; });
+    REQUIRE(by_point(tree.find_within(p, radius)) == by_point(within));
+
+    Recti r(p, p + Pointi(absl::Uniform(bitgen, 0, 20), absl::Uniform(bitgen, 0, 20)));
+    std::vector<KDTree::Value> inside;
+    absl::c_copy_if(values, std::back_inserter(inside),
+                    [&](const KDTree::Value& v) { return r.contains(v.p); });
+    REQUIRE(by_point(tree.find_in_rect(r)) == by_point(inside));
+
+    if (i % 10 == 0) {
+      REQUIRE(by_point(tree.pop_within(p, radius)) == by_point(within));
+      std::erase_if(values, [&](const KDTree::Value& v) { return dist(p, v.p) <= radius; });
+      REQUIRE(tree.size() == int(values.size()));
+      REQUIRE(tree.find_within(p, radius).empty());
+      tree.validate();
+    }
+  }
+}
+
+TEST_CASE("KDTree ordered traversal", "[kdtree]") {
+  // Each order visits every live value once, sorted, with tombstones in the way.
+  KDTree tree;
+  std::vector<KDTree::Value> values;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 60), absl::Uniform(bitgen, 0, 60));
+  };
+  auto dist = [](Pointi a, Pointi b) { return std::abs(a.x - b.x) + std::abs(a.y - b.y); };
+  auto by_point = [](std::vector<KDTree::Value> v) {
+    absl::c_sort(v, [](auto a, auto b) { return a.p < b.p; });
+    return v;
+  };
+  REQUIRE(tree.by_distance({0, 0}).begin() == tree.by_distance({0, 0}).end());
+  for (int i = 0; i < 1000; i++) {
+    KDTree::Value v(i, gen_point());
+    if (tree.insert(v)) {
+      values.push_back(v);
+    }
+  }
+  for (int i = 0; i < 300; i++) {
+    Pointi p = gen_point();
+    if (tree.remove(p)) {
+      std::erase_if(values, [p](const KDTree::Value& v) { return v.p == p; });
+    }
+  }
+
+  for (int i = 0; i < 20; i++) {
+    Pointi p = gen_point();
+    CAPTURE(i, p);
+    std::vector<KDTree::Value> found(tree.by_distance(p).begin(), tree.by_distance(p).end());
+    REQUIRE(absl::c_is_sorted(found, [&](auto a, auto b) { return dist(p, a.p) < dist(p, b.p); }));
+    REQUIRE(by_point(found) == by_point(values));
+
+    // Stopping early gives the same as a search.
+    std::vector<int> first, closest;
+    for (const KDTree::Value& v : tree.by_distance(p)) {
+      if (first.size() == 10) {
+        break;
+      }
+      first.push_back(dist(p, v.p));
+    }
+    for (const KDTree::Value& v : tree.find_k_closest(p, 10)) {
+      closest.push_back(dist(p, v.p));
+    }
+    REQUIRE(first == closest);
+  }
+
+  for (int axis = 0; axis < 2; axis++) {
+    CAPTURE(axis);
+    std::vector<KDTree::Value> found(tree.by_axis(axis).begin(), tree.by_axis(axis).end());
+    REQUIRE(absl::c_is_sorted(
+        found, [axis](auto a, auto b) { return a.p.coords[axis] < b.p.coords[axis]; }));
+    REQUIRE(by_point(found) == by_point(values));
+  }
+
+  SECTION("Pre-order") {
+    // The plain iterator copies and compares by position.
+    auto it = tree.begin();
+    auto copy = it++;
+    REQUIRE(copy == tree.begin());
+    REQUIRE(copy != it);
+    REQUIRE(++copy == it);
+    REQUIRE(std::distance(tree.begin(), tree.end()) == tree.size());
+  }
+}
+
+TEST_CASE("KDTree stats", "[kdtree]") {
+  // Counted only if compiled in, and kept across `clear`.
+  KDTree tree;
+  for (int i = 0; i < 1000; i++) {
+    tree.insert({i, {i, i}});  // Sorted, so it needs rebuilds.
+  }
+  for (int i = 0; i < 10; i++) {
+    tree.find_closest({i, 0});
+  }
+  tree.find_within({0, 0}, 10);
+  tree.rebalance();
+  tree.clear();
+  const KDTreeStats& stats = tree.stats();
+  INFO(stats.str());
+  if (kKDTreeStats) {
+    REQUIRE(stats.searches == 11);
+    REQUIRE(stats.visited >= 11);
+    REQUIRE(stats.rebalances == 1);
+    REQUIRE(stats.rebuilds > 0);
+    REQUIRE(stats.largest_rebuild <= stats.rebuilt_values);
+  } else {
+    REQUIRE(stats.searches == 0);
+    REQUIRE(stats.visited == 0);
+    REQUIRE(stats.rebalances == 0);
+    REQUIRE(stats.rebuilds == 0);
+  }
+
+  KDTreeStats sum;
+  sum += stats;
+  sum += stats;
+  REQUIRE(sum.searches == 2 * stats.searches);
+  REQUIRE(sum.largest_rebuild == stats.largest_rebuild);
+}
+
+TEST_CASE("KDTreeT", "[kdtree]") {
+  // The same searches work with other metrics and dimensions.
+  Xoshiro256pp bitgen(Catch::getSeed());
+
+  SECTION("Euclidean") {
+    KDTreeT<int, int, 2, SquaredEuclideanDistance> tree;
+    std::vector<Pointi> points;
+    for (int i = 0; i < 1000; i++) {
+      Pointi p(absl::Uniform(bitgen, 0, 100), absl::Uniform(bitgen, 0, 100));
+      if (tree.insert({i, p})) {
+        points.push_back(p);
+      }
+    }
+    auto dist = [](Pointi a, Pointi b) {
+      return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+    };
+    for (int i = 0; i < 100; i++) {
+      Pointi p(absl::Uniform(bitgen, 0, 100), absl::Uniform(bitgen, 0, 100));
+      int best = dist(p, points[0]);
+      for (Pointi q : points) {
+        best = std::min(best, dist(p, q));
+      }
+      REQUIRE(dist(p, tree.find_closest(p).p) == best);
+    }
+  }
+
+  SECTION("3D") {
+    typedef KDTreeT<int, float, 3, SquaredEuclideanDistance> Tree;
+    Tree tree;
+    std::vector<Tree::Value> values;
+    auto gen_point = [&bitgen]() {
+      return Tree::Point{{absl::Uniform(bitgen, 0.0f, 1.0f), absl::Uniform(bitgen, 0.0f, 1.0f),
+                          absl::Uniform(bitgen, 0.0f, 1.0f)}};
+    };
+    for (int i = 0; i < 2000; i++) {
+      values.push_back({i, gen_point()});
+    }
+    REQUIRE(tree.insert_many(values) == 2000);
+    for (int i = 0; i < 500; i++) {
+      REQUIRE(tree.remove(values.back().p));
+      values.pop_back();
+    }
+    tree.validate();
+
+    auto dist = [](const Tree::Point& a, const Tree::Point& b) {
+      return SquaredEuclideanDistance::distance(a, b);
+    };
+    auto sorted = [](std::vector<Tree::Value> v) {
+      absl::c_sort(v, [](auto a, auto b) { return a.value < b.value; });
+      return v;
+    };
+    for (int i = 0; i < 100; i++) {
+      Tree::Point p = gen_point();
+      std::vector<float> dists;
+      for (const Tree::Value& v : values) {
+        dists.push_back(dist(p, v.p));
+      }
+      absl::c_sort(dists);
+      dists.resize(5);
+      std::vector<float> found;
+      for (const Tree::Value& v : tree.find_k_closest(p, 5)) {
+        found.push_back(dist(p, v.p));
+      }
+      REQUIRE(found == dists);
+
+      std::vector<Tree::Value> within, inside;
+      Tree::Point max = {{p.coords[0] + 0.2f, p.coords[1] + 0.2f, p.coords[2] + 0.2f}};
+      for (const Tree::Value& v : values) {
+        if (dist(p, v.p) <= 0.01f) {
+          within.push_back(v);
+        }
+        if (!(v.p.coords[0] < p.coords[0] || v.p.coords[1] < p.coords[1] ||
+              v.p.coords[2] < p.coords[2] || v.p.coords[0] >= max.coords[0] ||
+              v.p.coords[1] >= max.coords[1] || v.p.coords[2] >= max.coords[2])) {
+          inside.push_back(v);
+        }
+      }
+      REQUIRE(sorted(tree.find_within(p, 0.01f)) == sorted(within));
+      REQUIRE(sorted(tree.find_in_box(p, max)) == sorted(inside));
+    }
+  }
+}
+
+TEST_CASE("KDTree parallel rebalance", "[kdtree]") {
+  // The big one splits a few levels across the pool before building the rest, the small one is
+  // built whole by one thread.
+  for (int n : {1000, 100000}) {
+    CAPTURE(n);
+    std::vector<KDTree::Value> values;
+    Xoshiro256pp bitgen(Catch::getSeed());
+    for (int i = 0; i < n; i++) {
+      values.push_back({i, {absl::Uniform(bitgen, 0, 1000), absl::Uniform(bitgen, 0, 1000)}});
+    }
+    KDTree serial, parallel;
+    serial.insert_many(values);
+    parallel.insert_many(values);
+    serial.rebalance();
+    ThreadPool pool(4);
+    parallel.rebalance(pool);
+    parallel.validate();
+    REQUIRE(parallel.size() == serial.size());
+    REQUIRE(parallel.depth_avg() == serial.depth_avg());
+    REQUIRE(parallel.depth_max() == serial.depth_max());
+    std::ostringstream a, b;
+    a << serial;
+    b << parallel;
+    REQUIRE(a.str() == b.str());
+
+    // And it still works as a tree afterwards.
+    REQUIRE(parallel.remove(values[0].p));
+    REQUIRE(parallel.insert(values[0]));
+    parallel.validate();
+  }
+}
+
 TEST_CASE("KDTree Benchmark", "[kdtree]") {
   const int num_points = 10000;
   const Pointi dims = {4000, 4000};
@@ -185,6 +639,53 @@ TEST_CASE("KDTree Benchmark", "[kdtree]") {
     meter.measure([&tree, &gen_point](int i) { return tree.find_closest(gen_point()); });
   };
 
+  BENCHMARK_ADVANCED("find_k_closest 10")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) { return tree.find_k_closest(gen_point(), 10); });
+  };
+
+  BENCHMARK_ADVANCED("find_within 50")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) { return tree.find_within(gen_point(), 50); });
+  };
+
+  BENCHMARK_ADVANCED("by_distance first 10")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) {
+      int sum = 0;
+      auto it = tree.by_distance(gen_point()).begin();
+      for (int j = 0; j < 10; j++, ++it) {
+        sum += it->value;
+      }
+      return sum;
+    });
+  };
+
+  BENCHMARK_ADVANCED("by_axis first 10")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree](int i) {
+      int sum = 0;
+      auto it = tree.by_axis(i % 2).begin();
+      for (int j = 0; j < 10; j++, ++it) {
+        sum += it->value;
+      }
+      return sum;
+    });
+  };
+
+  BENCHMARK_ADVANCED("find_in_rect 100x100")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) {
+      Pointi p = gen_point();
+      return tree.find_in_rect(Recti(p, p + Pointi(100, 100)));
+    });
+  };
+
   BENCHMARK_ADVANCED("insert + pop_closest")(Catch::Benchmark::Chronometer meter) {
     KDTree tree(values);
     tree.rebalance();
@@ -195,8 +696,300 @@ TEST_CASE("KDTree Benchmark", "[kdtree]") {
     REQUIRE(tree.size() > num_points * 0.9);  // If this fails, insert is getting many collisions.
   };
 
+  BENCHMARK_ADVANCED("insert + remove")(Catch::Benchmark::Chronometer meter) {
+    // Removing an inner node may rebuild its subtree, like `AgentLast` does for every update.
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &values](int i) {
+      Pointi p = values[i % values.size()].p;
+      tree.remove(p);
+      tree.insert({i, p});
+      return tree.size();
+    });
+  };
+
+  BENCHMARK_ADVANCED("insert_many + remove_many 100")(Catch::Benchmark::Chronometer meter) {
+    // A batch of nearby points, like the cells one reveal makes actionable.
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) {
+      Pointi c = gen_point();
+      std::vector<KDTree::Value> batch;
+      std::vector<Pointi> points;
+      for (int j = 0; j < 100; j++) {
+        batch.push_back({j, {c.x + j % 10, c.y + j / 10}});
+        points.push_back(batch.back().p);
+      }
+      tree.insert_many(batch);
+      return tree.remove_many(points);
+    });
+  };
+
+  BENCHMARK_ADVANCED("insert + remove 100")(Catch::Benchmark::Chronometer meter) {
+    KDTree tree(values);
+    tree.rebalance();
+    meter.measure([&tree, &gen_point](int i) {
+      Pointi c = gen_point();
+      std::vector<KDTree::Value> batch;
+      for (int j = 0; j < 100; j++) {
+        batch.push_back({j, {c.x + j % 10, c.y + j / 10}});
+      }
+      for (KDTree::Value v : batch) {
+        tree.insert(v);
+      }
+      int removed = 0;
+      for (KDTree::Value v : batch) {
+        removed += tree.remove(v.p);
+      }
+      return removed;
+    });
+  };
+
   BENCHMARK_ADVANCED("rebalance")(Catch::Benchmark::Chronometer meter) {
     KDTree tree(values);
     meter.measure([&tree](int i) { tree.rebalance(); return tree.depth_avg(); });
   };
-}
\ No newline at end of file
+
+  BENCHMARK_ADVANCED("clear + insert")(Catch::Benchmark::Chronometer meter) {
+    // A refill after `clear` reuses the nodes, like `AgentLast::reset`.
+    KDTree tree(values);
+    meter.measure([&tree, &values](int i) {
+      tree.clear();
+      for (KDTree::Value v : values) {
+        tree.insert(v);
+      }
+      return tree.size();
+    });
+  };
+
+  if (kKDTreeStats && !Catch::getCurrentContext().getConfig()->skipBenchmarks()) {
+    // How much of the tree each search looks at, which the bounds keep down.
+    KDTree tree(values);
+    auto per_query = [&tree, &gen_point](auto search) {
+      int64_t before = tree.stats().visited;
+      for (int i = 0; i < 10000; i++) {
+        search(gen_point());
+      }
+      return (tree.stats().visited - before) / 10000.0;
+    };
+    for (bool rebalanced : {false, true}) {
+      if (rebalanced) {
+        tree.rebalance();
+      }
+      std::cout << absl::StrFormat(
+          "nodes visited per query%s: find_closest %.1f, find_k_closest 10 %.1f, "
+          "find_within 50 %.1f\n", rebalanced ? " after rebalance" : "",
+          per_query([&tree](Pointi p) { return tree.find_closest(p); }),
+          per_query([&tree](Pointi p) { return tree.find_k_closest(p, 10); }),
+          per_query([&tree](Pointi p) { return tree.find_within(p, 50); }));
+    }
+  }
+
+  if (!Catch::getCurrentContext().getConfig()->skipBenchmarks()) {
+    // The mean hides rebuilds, so time each step of a sweep like `AgentLast`'s: the frontier moves
+    // along, with new points added in order ahead of it and the closest popped behind it.
+    KDTree tree;
+    std::vector<int64_t> times;
+    times.reserve(100000);
+    for (int x = 0; x < 1000; x++) {
+      for (int y = 0; y < 100; y++) {
+        auto start = std::chrono::steady_clock::now();
+        tree.insert({y, {x, y}});
+        if (tree.size() > 1000) {
+          tree.pop_closest({x - 10, 50});
+        }
+        times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+      }
+    }
+    absl::c_sort(times);
+    auto percentile = [&times](double p) { return times[int(p * (times.size() - 1))]; };
+    std::cout << absl::StrFormat(
+        "sweep step latency: p50 %d ns, p99 %d ns, p99.9 %d ns, max %d ns\n",
+        percentile(0.5), percentile(0.99), percentile(0.999), times.back());
+  }
+
+  if (!Catch::getCurrentContext().getConfig()->skipBenchmarks()) {
+    // How the parallel rebuild scales with the size of the tree and the number of threads.
+    ThreadPool pool;
+    for (int n : {1000000, 10000000}) {
+      std::vector<KDTree::Value> values;
+      values.reserve(n);
+      for (int i = 0; i < n; i++) {
+        values.push_back(
+            {i, {absl::Uniform(bitgen, 0, 1 << 16), absl::Uniform(bitgen, 0, 1 << 16)}});
+      }
+      KDTree tree;
+      tree.insert_many(values);
+      auto time_ms = [&tree](auto rebalance) {
+        auto start = std::chrono::steady_clock::now();
+        rebalance();
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+      };
+      double serial = time_ms([&tree]() { tree.rebalance(); });
+      double parallel = time_ms([&tree, &pool]() { tree.rebalance(pool); });
+      std::cout << absl::StrFormat(
+          "rebalance %d points: serial %.0f ms, %d threads %.0f ms, speedup %.2fx\n",
+          tree.size(), serial, pool.size(), parallel, serial / parallel);
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Like KDTree", "[kdtree]", FlatKDTree, BucketKDTree, BucketGrid) {
+  // Every operation matches `KDTree`, up to ties in distance.
+  TestType like;
+  KDTree tree;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 100), absl::Uniform(bitgen, 0, 70));
+  };
+
+  for (int i = 0; i < 10000; i++) {
+    Pointi p = gen_point();
+    CAPTURE(i, p);
+    // Mostly inserts to start with, then mostly removes, so it both grows and shrinks.
+    int op = absl::Uniform(bitgen, 0, 10) + (i < 5000 ? -2 : 2);
+    if (op < 5) {
+      REQUIRE(like.insert({i, p}) == tree.insert({i, p}));
+    } else if (op < 7) {
+      REQUIRE(like.remove(p) == tree.remove(p));
+    } else if (op < 9) {
+      REQUIRE(like.find(p) == tree.find(p));
+    } else if (!tree.empty()) {
+      // Including queries outside the points.
+      Pointi q = p * 2 - Pointi(50, 35);
+      KDTree::Value a = like.pop_closest(q);
+      KDTree::Value b = tree.find_closest(q);
+      REQUIRE(std::abs(a.p.x - q.x) + std::abs(a.p.y - q.y) ==
+              std::abs(b.p.x - q.x) + std::abs(b.p.y - q.y));
+      REQUIRE(tree.find(a.p) == a);
+      REQUIRE(tree.remove(a.p));
+    }
+    REQUIRE(like.size() == tree.size());
+    REQUIRE(like.empty() == tree.empty());
+    if (i % 100 == 0) {
+      INFO(like);
+      like.validate();
+      std::vector<KDTree::Value> a(like.begin(), like.end()), b(tree.begin(), tree.end());
+      absl::c_sort(a, [](auto a, auto b) { return a.p < b.p; });
+      absl::c_sort(b, [](auto a, auto b) { return a.p < b.p; });
+      REQUIRE(a == b);
+    }
+  }
+
+  if constexpr (requires { like.rebalance(); }) {
+    SECTION("Rebalance") {
+      like.rebalance();
+      like.validate();
+      REQUIRE(like.size() == tree.size());
+    }
+  }
+
+  SECTION("Bulk") {
+    std::vector<KDTree::Value> values;
+    std::vector<Pointi> points;
+    for (int i = 0; i < 200; i++) {
+      values.push_back({i, gen_point()});
+      points.push_back(gen_point());
+    }
+    REQUIRE(like.insert_many(values) == tree.insert_many(values));
+    like.validate();
+    REQUIRE(like.remove_many(points) == tree.remove_many(points));
+    like.validate();
+    REQUIRE(like.size() == tree.size());
+    std::vector<KDTree::Value> a(like.begin(), like.end()), b(tree.begin(), tree.end());
+    absl::c_sort(a, [](auto a, auto b) { return a.p < b.p; });
+    absl::c_sort(b, [](auto a, auto b) { return a.p < b.p; });
+    REQUIRE(a == b);
+  }
+
+  SECTION("Clear") {
+    like.clear();
+    REQUIRE(like.empty());
+    REQUIRE(like.begin() == like.end());
+    REQUIRE(like.insert({1, {2, 3}}));
+    REQUIRE(like.find({2, 3})->value == 1);
+  }
+}
+
+TEMPLATE_TEST_CASE("Like KDTree Benchmark", "[kdtree]",
+                   FlatKDTree, BucketKDTree, BucketGrid, HilbertQueue) {
+  // The same as the KDTree benchmarks, to compare them.
+  const int num_points = 10000;
+  const Pointi dims = {4000, 4000};
+
+  std::vector<KDTree::Value> values;
+  values.reserve(num_points);
+  Xoshiro256pp bitgen(Catch::getSeed());
+
+  auto gen_point = [&bitgen, dims]() {
+    return Pointi(absl::Uniform(bitgen, 0, dims.x), absl::Uniform(bitgen, 0, dims.y));
+  };
+
+  {  // Generate `points`.
+    TestType tree;
+    while (values.size() < num_points) {
+      KDTree::Value v(int(values.size()), gen_point());
+      if (tree.insert(v)) {
+        values.push_back(v);
+      }
+    }
+  }
+
+  // Those that can be rebalanced are measured balanced, like after a reset.
+  auto make = [&values]() {
+    TestType tree(values);
+    if constexpr (requires { tree.rebalance(); }) {
+      tree.rebalance();
+    }
+    return tree;
+  };
+
+  BENCHMARK(absl::StrFormat("insert %d points", num_points)) {
+    TestType tree;
+    for (KDTree::Value v : values) {
+      tree.insert(v);
+    }
+  };
+
+  BENCHMARK_ADVANCED("iterate into vector")(Catch::Benchmark::Chronometer meter) {
+    TestType tree(values);
+    meter.measure([&tree](int i) { return std::vector(tree.begin(), tree.end()); });
+  };
+
+  BENCHMARK_ADVANCED("find")(Catch::Benchmark::Chronometer meter) {
+    TestType tree = make();
+    meter.measure([&tree, &gen_point](int i) { return tree.find(gen_point()); });
+  };
+
+  BENCHMARK_ADVANCED("find_closest")(Catch::Benchmark::Chronometer meter) {
+    TestType tree = make();
+    meter.measure([&tree, &gen_point](int i) { return tree.find_closest(gen_point()); });
+  };
+
+  BENCHMARK_ADVANCED("insert + pop_closest")(Catch::Benchmark::Chronometer meter) {
+    TestType tree = make();
+    meter.measure([&tree, &gen_point](int i) {
+      tree.insert({i, gen_point()});
+      return tree.pop_closest(gen_point());
+    });
+  };
+
+  BENCHMARK_ADVANCED("insert + remove")(Catch::Benchmark::Chronometer meter) {
+    TestType tree = make();
+    meter.measure([&tree, &values](int i) {
+      Pointi p = values[i % values.size()].p;
+      tree.remove(p);
+      tree.insert({i, p});
+      return tree.size();
+    });
+  };
+
+  if constexpr (requires (TestType t) { t.rebalance(); }) {
+    BENCHMARK_ADVANCED("rebalance")(Catch::Benchmark::Chronometer meter) {
+      TestType tree(values);
+      meter.measure([&tree](int i) { tree.rebalance(); return tree.size(); });
+    };
+  }
+}
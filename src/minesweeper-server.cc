@@ -19,11 +19,16 @@
 #include "env.h"
 #include "minesweeper.h"
 #include "point.h"
+#include "update_bus.h"
 
 ABSL_FLAG(int, size, 1000, "Field size, squared.");
 ABSL_FLAG(float, mines, 0.16, "Mines percentage");
 ABSL_FLAG(int, port, 9001, "Port to run the websocket server on.");
 ABSL_FLAG(int, seed, 0, "Random seed for the environment.");
+ABSL_FLAG(bool, no_guess, false, "Generate a board that can be solved without guessing.");
+ABSL_FLAG(bool, validate, false, "Check the parts of the board that changed for corruption after every action.");
+ABSL_FLAG(int, bus_capacity, 1 << 20, "Updates kept for clients to catch up on before they need their whole view resent.");
+ABSL_FLAG(double, flush_interval, 0.02, "Seconds between sending each client the updates in its view. Must be more than 0.");
 
 using session_ptr = std::shared_ptr<beauty::websocket_session>;
 
@@ -57,6 +62,7 @@ void serve_file(beauty::response& res, const std::filesystem::path& path) {
 struct ClientInfo {
   std::weak_ptr<beauty::websocket_session> session;
   int userid;
+  UpdateBus::Subscriber updates;
 };
 
 struct User {
@@ -89,6 +95,22 @@ int send_rect(const session_ptr& session, const Array2D<Cell>& state, Recti r) {
   return sent;
 }
 
+void flush_updates(ClientInfo& client, const session_ptr& session, const Array2D<Cell>& state,
+                   Recti view) {
+  // Sends what the client hasn't seen yet, or its whole view if it fell too far behind.
+  uint64_t missed = client.updates.drain([&session, &client, view](Update u) {
+    if (u.state < SCORE_ZERO && view.contains(u.point)) {
+      send_update(session, u);
+    } else if (u.state > SCORE_ZERO && u.user == client.userid) {
+      int count = u.state & (SCORE_ZERO - 1);
+      session->send(absl::StrFormat("score %d %d %d", count * count, u.point.x, u.point.y));
+    }
+  });
+  if (missed > 0) {
+    send_rect(session, state, view);
+  }
+}
+
 void send_user(const session_ptr& session, const User& u) {
   auto now = std::chrono::system_clock::now();
   session->send(absl::StrFormat(
@@ -111,14 +133,29 @@ int main(int argc, char **argv) {
   absl::SetProgramUsageMessage("Minesweeper server.\n");
   absl::ParseCommandLine(argc, argv);
 
+  double flush_interval = absl::GetFlag(FLAGS_flush_interval);
+  if (!(flush_interval > 0)) {
+    std::cout << "--flush_interval must be more than 0 seconds.\n";
+    return 1;
+  }
+
   int size = absl::GetFlag(FLAGS_size);
   Pointi dims(size, size);
 
   std::cout << absl::StrFormat("grid: %ix%i\n", dims.x, dims.y);
 
-  Env env(dims, absl::GetFlag(FLAGS_mines), (uint64_t)absl::GetFlag(FLAGS_seed));
+  Env env(dims, absl::GetFlag(FLAGS_mines), (uint64_t)absl::GetFlag(FLAGS_seed),
+          absl::GetFlag(FLAGS_no_guess));
+  bool validate = absl::GetFlag(FLAGS_validate);
+  if (validate) {
+    env.enable_validation();
+  }
   std::vector<Update> updates = env.reset();
+  if (env.no_guess_failures() > 0) {
+    std::cout << "Couldn't make a board that can be solved without guessing, so it may need one.\n";
+  }
   std::vector<Action> actions;
+  UpdateBus bus(absl::GetFlag(FLAGS_bus_capacity));
 
   beauty::server server;
   absl::flat_hash_map<std::string, ClientInfo> clients;  // uuid -> client info
@@ -128,17 +165,18 @@ int main(int argc, char **argv) {
 
   server.add_route("/minefield")
       .ws(beauty::ws_handler{
-          .on_connect = [&clients, &dims](const beauty::ws_context& ctx) {
+          .on_connect = [&clients, &dims, &bus](const beauty::ws_context& ctx) {
             std::cout << "Connection opened" <<std::endl;
             clients[ctx.uuid] = ClientInfo{
               .session = ctx.ws_session,
               .userid = 0,
+              .updates = bus.subscribe(),
             };
             if (auto s = ctx.ws_session.lock(); s) {
               s->send(absl::StrFormat("grid %i %i", dims.x, dims.y));
             }
           },
-          .on_receive = [&clients, &users, &usernames, &next_userid, &env](
+          .on_receive = [&clients, &users, &usernames, &next_userid, &env, &bus, validate](
               const beauty::ws_context& ctx, const char* data, std::size_t size, bool is_text) {
             if (!is_text) {
               return;
@@ -220,31 +258,28 @@ int main(int argc, char **argv) {
                 Pointi p(x, y);
                 if (env.state().rect().contains(p) && (action == OPEN || action == MARK || action == UNMARK)) {
                   std::vector<Update> updates = env.step({action, p, userid});
+                  if (validate) {
+                    std::vector<std::string> errors = env.validate_dirty();
+                    for (const std::string& e : errors) {
+                      std::cout << e << "\n";
+                    }
+                    if (!errors.empty()) {
+                      std::cout << "Board corrupted by: " << str << std::endl;
+                      beauty::stop();
+                      return;
+                    }
+                  }
                   for (Update u: updates) {
-                    int score = 0;
                     if (u.user > 0) {
                       if (u.state > SCORE_ZERO) {
                         int count = u.state & (SCORE_ZERO - 1);
-                        score = count * count;
-                        users[u.user].score += score;
+                        users[u.user].score += count * count;
                       } else if (u.state == BOMB) {
-                        score = -std::max(100, users[u.user].score);
-                        users[u.user].score += score;
-                      }
-                    }
-                    for (auto& [_, client] : clients) {
-                      if (client.userid > 0 && u.state < SCORE_ZERO && users[client.userid].view.contains(u.point)) {
-                        if (auto s = client.session.lock(); s) {
-                          send_update(s, u);
-                        }
-                      }
-                      if (score > 0 && client.userid == u.user) {
-                        if (auto s = client.session.lock(); s) {
-                          s->send(absl::StrFormat("score %d %d %d", score, u.point.x, u.point.y));
-                        }
+                        users[u.user].score -= std::max(100, users[u.user].score);
                       }
                     }
                   }
+                  bus.publish(updates);
                 }
               } else if (command == "view") {
                 int x1, y1, x2, y2, force;
@@ -252,6 +287,15 @@ int main(int argc, char **argv) {
                 std::optional<Recti> new_view = env.state().rect().intersection({{x1, y1}, {x2, y2}});
                 if (new_view) {
                   Recti old_view = users[userid].view;
+                  // Updates are filtered by the view when they're flushed, so the ones from before
+                  // the change go out now with the view they were made in.
+                  for (auto& [_, client] : clients) {
+                    if (client.userid == userid) {
+                      if (auto s = client.session.lock(); s) {
+                        flush_updates(client, s, env.state(), old_view);
+                      }
+                    }
+                  }
                   users[userid].view = *new_view;
                   if (auto s = ctx.ws_session.lock(); s) {
                     if (force) {
@@ -333,6 +377,19 @@ int main(int argc, char **argv) {
     }
   });
 
+  // Clients are sent their updates here instead of in the action handler, so a step only costs
+  // publishing its updates, however many clients there are or however slow they are to send to.
+  beauty::repeat(flush_interval, [&clients, &users, &env, &bus]() {
+    for (auto& [_, client] : clients) {
+      auto s = client.session.lock();
+      if (!s || client.userid == 0) {
+        client.updates = bus.subscribe();  // Nothing to send, so skip ahead.
+        continue;
+      }
+      flush_updates(client, s, env.state(), users[client.userid].view);
+    }
+  });
+
   beauty::signal(SIGINT, [](int s) { beauty::stop(); });
 
   beauty::wait();
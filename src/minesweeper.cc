@@ -17,10 +17,14 @@
 #include "agent.h"
 #include "agent_last.h"
 #include "agent_random.h"
+#include "agent_round.h"
 #include "agent_sfml.h"
+#include "batch_env.h"
 #include "env.h"
 #include "minesweeper.h"
 #include "point.h"
+#include "thread.h"
+#include "update_router.h"
 
 ABSL_FLAG(int, size, 90, "Field size, multiplied by 16x9 for the actual size. 240 leads to a 4K size.");
 ABSL_FLAG(float, mines, 0.16, "Mines percentage");
@@ -29,6 +33,16 @@ ABSL_FLAG(int, aps, 0, "Actions per second");
 ABSL_FLAG(int, agents, 1, "Agents");
 ABSL_FLAG(int, seed, 0, "Random seed for the environment.");
 ABSL_FLAG(bool, benchmark, false, "Exit after the first run");
+ABSL_FLAG(bool, no_guess, false, "Generate boards that can be solved without guessing.");
+ABSL_FLAG(bool, validate, false, "Check the parts of the board that changed for corruption every frame.");
+ABSL_FLAG(int, batch, 0, "Play this many separate boards at once with AgentLast, without a window.");
+ABSL_FLAG(int, batch_games, 100000, "How many games to finish in batch mode before exiting.");
+ABSL_FLAG(int, threads, 0, "Threads to step the agents on, 0 for one per core. Only matters with several agents.");
+ABSL_FLAG(int, step_many, 0, "Let each agent take up to this many actions per step, 0 for one at a time.");
+ABSL_FLAG(bool, static_dispatch, true, "With --benchmark and no window, play with a loop specialized for the agent type.");
+ABSL_FLAG(bool, frontier, false, "Work out the safe cells and mines once in the environment for all agents, rather than in each one. Can't be used with --route_updates.");
+ABSL_FLAG(bool, route_updates, false, "Give each AgentLast a stripe of the board, and only the updates there.");
+ABSL_FLAG(std::string, agent_tree, "kdtree", "Where AgentLast keeps its pending actions: kdtree, flat, bucket, grid or hilbert.");
 
 namespace {
     volatile std::sig_atomic_t signal_status;
@@ -38,6 +52,89 @@ void signal_handler(int signal) {
   signal_status = signal;
 }
 
+// Plays many small games at once, one agent per board, for evaluating agents.
+int run_batch(Pointi dims, int boards) {
+  std::cout << absl::StrFormat("batch: %i boards of %ix%i\n", boards, dims.x, dims.y);
+
+  auto start = std::chrono::steady_clock::now();
+  BatchEnv env(boards, dims, absl::GetFlag(FLAGS_mines), (uint64_t)absl::GetFlag(FLAGS_seed),
+               absl::GetFlag(FLAGS_no_guess));
+  ThreadPool pool;
+  std::vector<std::unique_ptr<Agent>> agents;
+  for (int i = 0; i < boards; i++) {
+    agents.push_back(std::make_unique<AgentLast>(env.state(i), 1));
+  }
+  std::vector<Action> actions(boards);
+
+  env.reset();
+  int games = absl::GetFlag(FLAGS_batch_games);
+  auto finished = [&env]() {
+    return env.games(BatchEnv::WON) + env.games(BatchEnv::LOST) + env.games(BatchEnv::ABANDONED);
+  };
+  while (finished() < games && !signal_status) {
+    pool.parallel_for(boards, [&env, &agents, &actions](int i) {
+      if (env.outcome(i) != BatchEnv::PLAYING) {
+        agents[i]->reset();
+      }
+      actions[i] = agents[i]->step(env.updates(i));
+      if (actions[i].action == PASS) {
+        actions[i].action = RESET;  // Only guesses are left, so give up.
+      }
+    });
+    env.step(actions);
+  }
+
+  auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  std::cout << absl::StrFormat(
+      "Games: %d, won: %d, lost: %d, gave up: %d\n",
+      finished(), env.games(BatchEnv::WON), env.games(BatchEnv::LOST),
+      env.games(BatchEnv::ABANDONED));
+  std::cout << absl::StrFormat("Actions: %d, actions/s: %d\n",
+                               env.steps(), env.steps() * 1000000 / duration_us);
+  if (env.no_guess_failures() > 0) {
+    std::cout << absl::StrFormat("Boards that may need a guess: %d\n", env.no_guess_failures());
+  }
+  return 0;
+}
+
+// Plays the whole game for `--benchmark` without a window, where every agent is an `AgentT`. They
+// are called as `AgentT`, which is final, so the calls are direct instead of through `Agent`, and
+// can be inlined along with `Env::step` when built with LTO. Only OPEN and MARK come back, so
+// there are no UI actions to handle either. Returns the number of actions.
+template<class AgentT>
+long long run_static(Env& env, const std::vector<std::unique_ptr<Agent>>& agents,
+                     std::vector<Update>& updates, int step_many) {
+  std::vector<AgentT*> typed;
+  for (const auto& agent : agents) {
+    typed.push_back(static_cast<AgentT*>(agent.get()));
+  }
+  std::vector<Action> actions;
+  long long steps = 0;
+  while (!signal_status) {
+    actions.clear();
+    for (AgentT* agent : typed) {
+      if (step_many > 0) {
+        agent->step_many(updates, actions, step_many);
+      } else if (Action a = agent->step(updates); a.action != PASS) {
+        actions.push_back(a);
+      }
+    }
+    if (actions.empty()) {
+      break;
+    }
+    updates.clear();
+    if (Frontier* frontier = env.frontier()) {
+      frontier->next_round();
+    }
+    for (Action a : actions) {
+      env.step(a, updates);
+    }
+    steps += actions.size();
+  }
+  return steps;
+}
+
 int main(int argc, char **argv) {
   absl::SetProgramUsageMessage("Minesweeper: including an agent and UI.\n");
   absl::ParseCommandLine(argc, argv);
@@ -45,9 +142,19 @@ int main(int argc, char **argv) {
 
   bool benchmark = absl::GetFlag(FLAGS_benchmark);
 
+  // The frontier hands every agent all the cells found anywhere, so the stripes wouldn't hold.
+  if (absl::GetFlag(FLAGS_frontier) && absl::GetFlag(FLAGS_route_updates)) {
+    std::cout << "--frontier and --route_updates can't be used together.\n";
+    return 1;
+  }
+
   int size = absl::GetFlag(FLAGS_size);
   Pointi dims(size * 16, size * 9);
 
+  if (absl::GetFlag(FLAGS_batch) > 0) {
+    return run_batch(dims, absl::GetFlag(FLAGS_batch));
+  }
+
   int apf = absl::GetFlag(FLAGS_aps) / 60;
   if (apf == 0) {
     apf = size * 16 / std::max(1, absl::GetFlag(FLAGS_agents));
@@ -58,7 +165,15 @@ int main(int argc, char **argv) {
   auto bench_start = std::chrono::steady_clock::now();
   long long bench_actions = 0;
 
-  Env env(dims, absl::GetFlag(FLAGS_mines), (uint64_t)absl::GetFlag(FLAGS_seed));
+  Env env(dims, absl::GetFlag(FLAGS_mines), (uint64_t)absl::GetFlag(FLAGS_seed),
+          absl::GetFlag(FLAGS_no_guess));
+  bool validate = absl::GetFlag(FLAGS_validate);
+  if (validate) {
+    env.enable_validation();
+  }
+  if (absl::GetFlag(FLAGS_frontier)) {
+    env.enable_frontier();
+  }
   std::vector<Update> updates = env.reset();
 
   std::vector<std::unique_ptr<Agent>> agents;
@@ -67,47 +182,110 @@ int main(int argc, char **argv) {
   }
   for (int i = 0; i < absl::GetFlag(FLAGS_agents); i++) {
     // agents.push_back(std::make_unique<AgentRandom>(env.state(), agents.size() + 1));
-    agents.push_back(std::make_unique<AgentLast>(env.state(), agents.size() + 1));
+    std::string tree = absl::GetFlag(FLAGS_agent_tree);
+    int user = agents.size() + 1;
+    const Frontier* frontier = env.frontier();
+    if (tree == "flat") {
+      agents.push_back(std::make_unique<AgentLastT<FlatKDTree>>(env.state(), user, frontier));
+    } else if (tree == "bucket") {
+      agents.push_back(std::make_unique<AgentLastT<BucketKDTree>>(env.state(), user, frontier));
+    } else if (tree == "grid") {
+      agents.push_back(std::make_unique<AgentLastT<BucketGrid>>(env.state(), user, frontier));
+    } else if (tree == "hilbert") {
+      agents.push_back(std::make_unique<AgentLastT<HilbertQueue>>(env.state(), user, frontier));
+    } else {
+      agents.push_back(std::make_unique<AgentLast>(env.state(), user, frontier));
+    }
   }
 
-  std::vector<Action> actions;
+  // The SFML agent owns the window, so it always steps on this thread.
+  int serial_agents = absl::GetFlag(FLAGS_window) > 0 ? 1 : 0;
+  ThreadPool pool(absl::GetFlag(FLAGS_threads));
+
+  // With `route_updates`, each AgentLast gets a vertical stripe, plus the 2 cells each side where
+  // an update can change what it can do in its stripe. The SFML agent still sees everything.
+  bool route = absl::GetFlag(FLAGS_route_updates);
+  UpdateRouter router(dims);
+  int stripes = agents.size() - serial_agents;
+  for (int a = 0; a < int(agents.size()); a++) {
+    int s = a - serial_agents;
+    if (s < 0) {
+      router.subscribe(Recti({0, 0}, dims));
+    } else {
+      router.subscribe(Recti({dims.x * s / stripes - 2, -2},
+                             {dims.x * (s + 1) / stripes + 2, dims.y + 2}));
+    }
+  }
+  auto agent_updates = [&](int a) -> const std::vector<Update>& {
+    return route ? router.updates(a) : updates;
+  };
+  long long produced_updates = 0, delivered_updates = 0;
 
+  // With `step_many`, each agent returns a batch of actions per step instead of one, and they're
+  // applied together in agent order. A frame then needs fewer rounds for the same actions.
+  int step_many = absl::GetFlag(FLAGS_step_many);
+  int rounds = step_many > 0 ? std::max(1, apf / step_many) : apf;
+  AgentRound round(pool, serial_agents, step_many);
   bool paused = false;
+
   bool finished = false;
   bool quit = false;
+
+  // It plays the whole game, so the loop below is skipped.
+  bool static_loop = (benchmark && absl::GetFlag(FLAGS_window) <= 0 && !validate && !route &&
+                      (agents.size() == 1 || absl::GetFlag(FLAGS_threads) == 1) &&
+                      absl::GetFlag(FLAGS_static_dispatch));
+  if (static_loop) {
+    std::string tree = absl::GetFlag(FLAGS_agent_tree);
+    if (tree == "flat") {
+      bench_actions = run_static<AgentLastT<FlatKDTree>>(env, agents, updates, step_many);
+    } else if (tree == "bucket") {
+      bench_actions = run_static<AgentLastT<BucketKDTree>>(env, agents, updates, step_many);
+    } else if (tree == "grid") {
+      bench_actions = run_static<AgentLastT<BucketGrid>>(env, agents, updates, step_many);
+    } else if (tree == "hilbert") {
+      bench_actions = run_static<AgentLastT<HilbertQueue>>(env, agents, updates, step_many);
+    } else {
+      bench_actions = run_static<AgentLast>(env, agents, updates, step_many);
+    }
+    finished = true;
+  }
   while (!quit && !signal_status && !(finished && benchmark)) {
     auto start = std::chrono::steady_clock::now();
 
     finished = false;
-    for (int i = 0; i < apf && !quit && !finished; i++) {
-      for (auto& agent : agents) {
-        actions.push_back(agent->step(updates, paused));
+    for (int i = 0; i < rounds && !quit && !finished; i++) {
+      if (route) {
+        router.route(updates);
+      }
+      produced_updates += updates.size();
+      for (int a = 0; a < int(agents.size()); a++) {
+        delivered_updates += agent_updates(a).size();
       }
-      updates.clear();
-      finished = true;
-      for (Action a : actions) {
-        if (a.action == OPEN || a.action == MARK || a.action == UNMARK) {
-          bench_actions += 1;
-          finished = false;
-          for (Update u : env.step(a)) {
-            updates.push_back(u);
-          }
-        } else if (a.action == RESET) {
-          updates = env.reset();
-          for (auto& agent : agents) {
-            agent->reset();
-          }
-          finished = false;
-          break;
-        } else if (a.action == PAUSE) {
-          paused = !paused;
-          break;
-        } else if (a.action == QUIT) {
-          quit = true;
-          break;
+      Action control = round.play(env, agents, agent_updates, updates, paused);
+      bench_actions += round.applied().size();
+      finished = round.applied().empty();
+      if (control.action == RESET) {
+        updates = env.reset();
+        for (auto& agent : agents) {
+          agent->reset();
         }
+        finished = false;
+      } else if (control.action == PAUSE) {
+        paused = !paused;
+      } else if (control.action == QUIT) {
+        quit = true;
+      }
+    }
+
+    if (validate) {
+      std::vector<std::string> errors = env.validate_dirty();
+      for (const std::string& e : errors) {
+        std::cout << e << "\n";
+      }
+      if (!errors.empty()) {
+        return 1;
       }
-      actions.clear();
     }
 
     if (!benchmark) {
@@ -119,6 +297,17 @@ int main(int argc, char **argv) {
   auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
       std::chrono::steady_clock::now() - bench_start).count();
   std::cout << absl::StrFormat("Actions: %d, actions/s: %d\n", bench_actions, bench_actions * 1000000 / duration_us);
+  if (static_loop) {
+    std::cout << absl::StrFormat("Agent steps: %d agents, statically dispatched\n", agents.size());
+  } else {
+    auto step_us = std::chrono::duration_cast<std::chrono::microseconds>(round.step_time()).count();
+    std::cout << absl::StrFormat("Agent steps: %d agents on %d threads, %.1f%% of the time\n",
+                                 agents.size(), std::min<int>(pool.size(), agents.size()),
+                                 step_us * 100.0 / duration_us);
+    std::cout << absl::StrFormat("Updates: %d, each to %.2f agents%s\n", produced_updates,
+                                 delivered_updates / std::max(1.0, double(produced_updates)),
+                                 route ? " with routing" : "");
+  }
 
   int hidden = 0;
   int total = dims.x * dims.y;
@@ -130,6 +319,14 @@ int main(int argc, char **argv) {
     }
   }
   std::cout << absl::StrFormat("Hidden: %d / %d = %.6f%%\n", hidden, total, hidden * 100.0 / total);
+  if (env.no_guess_failures() > 0) {
+    std::cout << absl::StrFormat("Boards that may need a guess: %d\n", env.no_guess_failures());
+  }
+  for (const auto& agent : agents) {
+    if (std::string stats = agent->stats(); !stats.empty()) {
+      std::cout << stats << "\n";
+    }
+  }
 
   return 0;
 }
@@ -1,6 +1,9 @@
 
 #pragma once
 
+#include <utility>
+#include <vector>
+
 #include "point.h"
 
 class Neighbors {
@@ -42,21 +45,110 @@ class Neighbors {
 };
 
 
-template<class T>
+// Memory layouts for Array2D, which map a point to an index into the underlying storage.
+// Row-major is simplest, but vertical neighbors are a whole row apart. The tiled layouts store
+// the array as square tiles of `N`x`N`, so a cell and its neighbors usually share a few cache
+// lines, and Morton orders the cells within a tile along a z-order curve to keep them even closer.
+struct RowMajor {
+  RowMajor(Pointi dims) : width_(dims.x), size_(dims.x * dims.y) {}
+  int index(int x, int y) const { return y * width_ + x; }
+  int size() const { return size_; }  // Storage size, may be bigger than the number of points.
+
+ private:
+  int width_;
+  int size_;
+};
+
+template<int N>
+struct Tiled {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "Tile size must be a power of two.");
+
+  Tiled(Pointi dims) : tiles_x_((dims.x + N - 1) / N),
+                       size_(tiles_x_ * ((dims.y + N - 1) / N) * N * N) {}
+  int index(int x, int y) const {
+    return ((y / N) * tiles_x_ + x / N) * (N * N) + (y % N) * N + x % N;
+  }
+  int size() const { return size_; }
+
+ private:
+  int tiles_x_;
+  int size_;
+};
+
+template<int N>
+struct Morton {
+  static_assert(N > 0 && N <= 256 && (N & (N - 1)) == 0, "Tile size must be a power of two.");
+
+  Morton(Pointi dims) : tiles_x_((dims.x + N - 1) / N),
+                        size_(tiles_x_ * ((dims.y + N - 1) / N) * N * N) {}
+  int index(int x, int y) const {
+    return ((y / N) * tiles_x_ + x / N) * (N * N) + (spread(x % N) | (spread(y % N) << 1));
+  }
+  int size() const { return size_; }
+
+ private:
+  static int spread(int v) {  // Interleave zeros between the low 8 bits.
+    v = (v | (v << 4)) & 0x0F0F;
+    v = (v | (v << 2)) & 0x3333;
+    v = (v | (v << 1)) & 0x5555;
+    return v;
+  }
+
+  int tiles_x_;
+  int size_;
+};
+
+// Names that can be passed on the command line, eg: `make LAYOUT=Morton8`.
+using Tiled8 = Tiled<8>;
+using Tiled16 = Tiled<16>;
+using Morton8 = Morton<8>;
+using Morton16 = Morton<16>;
+
+// The board layout is chosen at compile time, so the index math can be inlined everywhere.
+class Cell;
+template<class T> struct DefaultLayout { using type = RowMajor; };
+#ifdef CELL_LAYOUT
+template<> struct DefaultLayout<Cell> { using type = CELL_LAYOUT; };
+#endif
+
+
+// Either owns its storage, or is a view of storage owned by someone else, like a batch of boards
+// in one allocation. Copying a view gives another view of the same storage.
+template<class T, class Layout = typename DefaultLayout<T>::type>
 class Array2D {
  public:
-  Array2D(Pointi dims) : dims_(dims) {
-    array.resize(dims_.x * dims_.y);
+  Array2D(Pointi dims) : dims_(dims), layout_(dims), array(layout_.size()), data_(array.data()) {}
+  Array2D(Pointi dims, T* data) : dims_(dims), layout_(dims), data_(data) {}
+  Array2D(const Array2D& o) : dims_(o.dims_), layout_(o.layout_), array(o.array),
+                              data_(o.owner() ? array.data() : o.data_) {}
+  Array2D(Array2D&& o) : dims_(o.dims_), layout_(o.layout_), array(std::move(o.array)),
+                         data_(o.data_) {}
+  Array2D& operator=(const Array2D& o) {
+    dims_ = o.dims_;
+    layout_ = o.layout_;
+    array = o.array;
+    data_ = (o.owner() ? array.data() : o.data_);
+    return *this;
   }
+  Array2D& operator=(Array2D&& o) {
+    dims_ = o.dims_;
+    layout_ = o.layout_;
+    array = std::move(o.array);
+    data_ = o.data_;
+    return *this;
+  }
+
+  // How many values a view of this size needs.
+  static int storage_size(Pointi dims) { return Layout(dims).size(); }
 
-  T& operator[](Pointi p) {                return array[p.y * dims_.x + p.x]; }
-  const T& operator[](Pointi p) const {    return array[p.y * dims_.x + p.x]; }
-  T& operator()(int x, int y) {             return array[y * dims_.x + x]; }
-  const T& operator()(int x, int y) const { return array[y * dims_.x + x]; }
+  T& operator[](Pointi p) {                return data_[layout_.index(p.x, p.y)]; }
+  const T& operator[](Pointi p) const {    return data_[layout_.index(p.x, p.y)]; }
+  T& operator()(int x, int y) {             return data_[layout_.index(x, y)]; }
+  const T& operator()(int x, int y) const { return data_[layout_.index(x, y)]; }
 
   void fill(const T& v) {
-    for (int i = 0; i < dims_.x * dims_.y; i++) {
-      array[i] = v;
+    for (int i = 0; i < layout_.size(); i++) {
+      data_[i] = v;
     }
   }
   int width() const { return dims_.x; }
@@ -66,8 +158,12 @@ class Array2D {
   int size() const { return dims_.x * dims_.y; }
 
  private:
+  bool owner() const { return !array.empty(); }
+
   Pointi dims_;
-  std::vector<T> array;
+  Layout layout_;
+  std::vector<T> array;  // Empty for views.
+  T* data_;
 };
 
 
@@ -98,6 +194,7 @@ enum CellState : int8_t {
 static_assert(sizeof(CellState) == 1, "CellState must be one byte");
 
 
+class BatchEnv;
 class Env;
 class FakeEnv;
 
@@ -130,6 +227,7 @@ class Cell {
   int8_t marked_;
   int user_;
 
+  friend BatchEnv;
   friend Env;
   friend FakeEnv;
  };
@@ -0,0 +1,112 @@
+#include <cstdint>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "absl/strings/str_format.h"
+
+#include "catch2/catch_amalgamated.h"
+#include "minesweeper.h"
+#include "point.h"
+#include "random.h"
+
+
+TEMPLATE_TEST_CASE("Array2D layout", "[minesweeper]",
+                   RowMajor, Tiled<1>, Tiled<4>, Tiled8, Morton<1>, Morton<4>, Morton16) {
+  for (Pointi dims : {Pointi(1, 1), Pointi(7, 3), Pointi(16, 16), Pointi(33, 17)}) {
+    CAPTURE(dims);
+    Array2D<int, TestType> a(dims);
+    REQUIRE(a.size() == dims.x * dims.y);
+
+    // Every point maps to its own storage.
+    a.fill(-1);
+    for (int x = 0; x < dims.x; x++) {
+      for (int y = 0; y < dims.y; y++) {
+        CAPTURE(x, y);
+        REQUIRE(a(x, y) == -1);
+        a(x, y) = y * dims.x + x;
+      }
+    }
+    for (int x = 0; x < dims.x; x++) {
+      for (int y = 0; y < dims.y; y++) {
+        CAPTURE(x, y);
+        REQUIRE(a(x, y) == y * dims.x + x);
+        REQUIRE(a[{x, y}] == y * dims.x + x);
+      }
+    }
+  }
+}
+
+TEMPLATE_TEST_CASE("Array2D layout benchmark", "[minesweeper]",
+                   RowMajor, Tiled8, Tiled16, Morton8, Morton16) {
+  // Cells are 8 bytes like `Cell`: the number of neighboring bombs, or -1 for a bomb, and which
+  // run opened it, so the board doesn't need resetting. The cascade mirrors the flood fill in
+  // `Env::step` when opening a zero.
+  struct Cell8 {
+    int8_t count = 0;
+    int opened = 0;
+  };
+  static_assert(sizeof(Cell8) == 8);
+
+  const Pointi dims(1920, 1080);  // Much bigger than the cache.
+  Array2D<Cell8, TestType> state(dims);
+  Xoshiro256pp bitgen(42);
+  for (int x = 0; x < dims.x; x++) {
+    for (int y = 0; y < dims.y; y++) {
+      if (absl::Uniform(bitgen, 0.0, 1.0) < 0.05) {
+        state(x, y).count = -1;
+      }
+    }
+  }
+  const Pointi start = dims * 0.5f;
+  for (Pointi n : Neighbors(start, dims, true)) {
+    state[n].count = 0;  // Make sure the cascade has somewhere to start.
+  }
+  for (int x = 0; x < dims.x; x++) {
+    for (int y = 0; y < dims.y; y++) {
+      if (state(x, y).count >= 0) {
+        for (Pointi n : Neighbors({x, y}, dims, false)) {
+          state(x, y).count += (state[n].count < 0);
+        }
+      }
+    }
+  }
+
+  int run = 0;
+  BENCHMARK("cascade") {
+    run++;
+    std::vector<Pointi> q;
+    q.push_back(start);
+    int opened = 0;
+    while (!q.empty()) {
+      Pointi p = q.back();
+      q.pop_back();
+      Cell8& c = state[p];
+      if (c.opened == run || c.count < 0) {
+        continue;
+      }
+      c.opened = run;
+      opened++;
+      if (c.count == 0) {
+        for (Pointi n : Neighbors(p, dims, false)) {
+          if (state[n].opened != run) {
+            q.push_back(n);
+          }
+        }
+      }
+    }
+    return opened;
+  };
+
+  BENCHMARK("neighbor scan") {
+    // Roughly what the agents do for each update.
+    int hidden = 0;
+    for (int x = 0; x < dims.x; x++) {
+      for (int y = 0; y < dims.y; y++) {
+        for (Pointi n : Neighbors({x, y}, dims, true)) {
+          hidden += (state[n].opened != run);
+        }
+      }
+    }
+    return hidden;
+  };
+}
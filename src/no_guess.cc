@@ -0,0 +1,238 @@
+#include "no_guess.h"
+
+#include <cassert>
+#include <vector>
+
+#include "absl/random/random.h"
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+NoGuessSolver::NoGuessSolver(
+    Array2D<uint8_t>& bombs, Pointi start, float bomb_percentage, uint64_t seed, int threads) :
+    dims_(bombs.dims()), start_(start), bomb_percentage_(bomb_percentage), bombs_(bombs),
+    number_(dims_), known_(dims_), pending_(dims_),
+    chunk_dims_((dims_.x + kChunkSize - 1) / kChunkSize, (dims_.y + kChunkSize - 1) / kChunkSize),
+    bitgen_(seed), pool_(threads), passes_(0), rerolls_(0) {
+  // Chunks must be big enough that reading a neighbor never reaches past the adjacent chunk.
+  static_assert(kChunkSize >= 2);
+  chunks_.resize(chunk_dims_.x * chunk_dims_.y);
+  for (int cy = 0; cy < chunk_dims_.y; cy++) {
+    for (int cx = 0; cx < chunk_dims_.x; cx++) {
+      Pointi tl(cx * kChunkSize, cy * kChunkSize);
+      chunks_[cy * chunk_dims_.x + cx].rect =
+          *Recti(tl, tl + kChunkSize).intersection(bombs_.rect());
+    }
+  }
+}
+
+bool NoGuessSolver::run(int max_passes) {
+  constexpr int max_rounds = 1000;  // Rounds of rerolls before giving up on a pass.
+
+  pool_.parallel_for(chunks_.size(), [this](int i) { count_numbers(chunks_[i].rect); });
+
+  for (passes_ = 1; passes_ <= max_passes; passes_++) {
+    known_.fill(UNKNOWN);
+    for (Chunk& c : chunks_) {
+      c.queue.clear();
+      c.done = false;
+    }
+    push(chunk(start_), {start_, REVEAL});
+    solve();
+
+    bool clean = true;
+    for (int round = 0; round < max_rounds && find_stuck(); round++) {
+      clean = false;
+      for (Chunk& c : chunks_) {
+        if (!c.stuck.empty()) {
+          // Only one per chunk, as nearby stuck cells are often part of the same problem.
+          reroll(c.stuck[absl::Uniform(bitgen_, 0u, c.stuck.size())]);
+        }
+      }
+      solve();
+    }
+    if (clean) {
+      return true;
+    }
+  }
+  passes_ = max_passes;
+  return false;
+}
+
+void NoGuessSolver::push(Chunk& c, Op op) {
+  if (c.rect.contains(op.p)) {
+    if (op.op == EXAMINE) {
+      // Looking at a cell once covers all the changes around it since it was queued.
+      if (pending_[op.p]) {
+        return;
+      }
+      pending_[op.p] = true;
+    }
+    c.queue.push_back(op);
+  } else {
+    c.outbox.push_back(op);
+  }
+}
+
+void NoGuessSolver::count_numbers(Recti r) {
+  for (int y = r.top(); y < r.bottom(); y++) {
+    for (int x = r.left(); x < r.right(); x++) {
+      int8_t b = 0;
+      for (Pointi n : Neighbors({x, y}, dims_, false)) {
+        b += bombs_[n];
+      }
+      number_(x, y) = b;
+    }
+  }
+}
+
+void NoGuessSolver::solve() {
+  std::vector<int> active;
+  active.reserve(chunks_.size());
+  bool busy = true;
+  while (busy) {
+    busy = false;
+    for (int color = 0; color < 4; color++) {
+      // Chunks of the same color are never adjacent, so can run concurrently.
+      active.clear();
+      for (int cy = color / 2; cy < chunk_dims_.y; cy += 2) {
+        for (int cx = color % 2; cx < chunk_dims_.x; cx += 2) {
+          if (!chunks_[cy * chunk_dims_.x + cx].queue.empty()) {
+            active.push_back(cy * chunk_dims_.x + cx);
+          }
+        }
+      }
+      if (active.empty()) {
+        continue;
+      }
+      busy = true;
+      pool_.parallel_for(active.size(), [this, &active](int i) { process(chunks_[active[i]]); });
+      for (int i : active) {
+        for (Op op : chunks_[i].outbox) {
+          push(chunk(op.p), op);
+        }
+        chunks_[i].outbox.clear();
+      }
+    }
+  }
+}
+
+void NoGuessSolver::process(Chunk& c) {
+  while (!c.queue.empty()) {
+    Op op = c.queue.back();
+    c.queue.pop_back();
+    if (op.op == EXAMINE) {
+      pending_[op.p] = false;
+      examine(c, op.p);
+      continue;
+    }
+
+    Known& k = known_[op.p];
+    if (k != UNKNOWN) {
+      continue;
+    }
+    if (op.op == REVEAL) {
+      assert(!bombs_[op.p]);  // Deductions are only made from true knowledge.
+      k = SAFE;
+      examine(c, op.p);
+    } else {
+      k = FLAGGED;
+    }
+    // The neighbors have one less hidden cell, which may be enough to decide the rest. Zeros
+    // revealed all their neighbors when they were revealed, so have nothing left to decide.
+    for (Pointi n : Neighbors(op.p, dims_, false)) {
+      if (known_[n] == SAFE && number_[n] > 0) {
+        push(c, {n, EXAMINE});
+      }
+    }
+  }
+}
+
+void NoGuessSolver::examine(Chunk& c, Pointi p) {
+  if (known_[p] != SAFE) {
+    return;
+  }
+  Neighbors neighbors(p, dims_, false);
+  int flagged = 0;
+  int unknown = 0;
+  for (Pointi n : neighbors) {
+    flagged += (known_[n] == FLAGGED);
+    unknown += (known_[n] == UNKNOWN);
+  }
+  if (unknown == 0) {
+    return;
+  }
+
+  OpType op;
+  if (number_[p] == flagged) {
+    op = REVEAL;
+  } else if (number_[p] == flagged + unknown) {
+    op = FLAG;
+  } else {
+    return;  // Still unknown.
+  }
+  for (Pointi n : neighbors) {
+    if (known_[n] == UNKNOWN) {
+      push(c, {n, op});
+    }
+  }
+}
+
+bool NoGuessSolver::find_stuck() {
+  pool_.parallel_for(chunks_.size(), [this](int i) {
+    Chunk& c = chunks_[i];
+    c.stuck.clear();
+    if (c.done) {
+      return;
+    }
+    bool unknown = false;
+    for (int y = c.rect.top(); y < c.rect.bottom(); y++) {
+      for (int x = c.rect.left(); x < c.rect.right(); x++) {
+        if (known_(x, y) == UNKNOWN) {
+          unknown = true;
+          for (Pointi n : Neighbors({x, y}, dims_, false)) {
+            if (known_[n] != UNKNOWN) {
+              c.stuck.push_back({x, y});
+              break;
+            }
+          }
+        }
+      }
+    }
+    c.done = !unknown;
+  });
+
+  for (const Chunk& c : chunks_) {
+    if (!c.stuck.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void NoGuessSolver::reroll(Pointi p) {
+  rerolls_ += 1;
+  Recti window = *Recti(p - kRerollRadius, p + kRerollRadius + 1).intersection(bombs_.rect());
+  for (int y = window.top(); y < window.bottom(); y++) {
+    for (int x = window.left(); x < window.right(); x++) {
+      // Revealed cells must stay safe, which also keeps the start a zero.
+      if (known_(x, y) != SAFE) {
+        known_(x, y) = UNKNOWN;
+        bombs_(x, y) = absl::Uniform(bitgen_, 0.0, 1.0) < bomb_percentage_;
+        chunk({x, y}).done = false;
+      }
+    }
+  }
+
+  // The numbers around the window changed, so they need to be looked at again.
+  Recti around = *Recti(window.tl - 1, window.br + 1).intersection(bombs_.rect());
+  count_numbers(around);
+  for (int y = around.top(); y < around.bottom(); y++) {
+    for (int x = around.left(); x < around.right(); x++) {
+      if (known_(x, y) == SAFE) {
+        push(chunk({x, y}), {{x, y}, EXAMINE});
+      }
+    }
+  }
+}
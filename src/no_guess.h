@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+#include "random.h"
+#include "thread.h"
+
+
+// Moves bombs around until the board can be solved from `start` without guessing.
+//
+// The solver only uses the single-cell deductions the agents use: if a cell's number matches its
+// marked neighbors the rest are safe, and if it matches its marked plus hidden neighbors the rest
+// are bombs. Whenever it gets stuck it re-rolls the bombs in a small window around a hidden cell
+// on the edge of what it knows, then carries on from where it was. Knowledge is never invalidated
+// by a re-roll (revealed cells are never given a bomb, re-rolled marks are forgotten), but it may
+// have been derived from numbers that have since changed, so each pass that needed a re-roll is
+// followed by a solve from scratch. The board is only reported solvable by a clean pass.
+//
+// The board is split into chunks that are solved in parallel in four phases, such that no two
+// chunks solved at the same time are adjacent. A chunk only writes its own cells, so cells on the
+// border can be read without locks, and work for other chunks is passed along between phases.
+class NoGuessSolver {
+ public:
+  NoGuessSolver(Array2D<uint8_t>& bombs, Pointi start, float bomb_percentage, uint64_t seed,
+                int threads = 0);
+
+  static constexpr int kDefaultPasses = 16;
+
+  // Returns whether a full solve without guessing succeeded within `max_passes`.
+  bool run(int max_passes = kDefaultPasses);
+
+  int passes() const { return passes_; }
+  int rerolls() const { return rerolls_; }
+
+ private:
+  enum Known : uint8_t { UNKNOWN, SAFE, FLAGGED };
+  enum OpType : uint8_t { REVEAL, FLAG, EXAMINE };
+  struct Op {
+    Pointi p;
+    OpType op;
+  };
+  struct Chunk {
+    Recti rect;
+    std::vector<Op> queue;
+    std::vector<Op> outbox;  // Ops for cells in other chunks, delivered between phases.
+    std::vector<Pointi> stuck;  // Hidden cells next to known ones after the last solve.
+    bool done = false;  // No hidden cells left in this pass.
+  };
+
+  static constexpr int kChunkSize = 64;
+  static constexpr int kRerollRadius = 1;
+
+  Chunk& chunk(Pointi p) { return chunks_[(p.y / kChunkSize) * chunk_dims_.x + p.x / kChunkSize]; }
+  void push(Chunk& c, Op op);
+  void count_numbers(Recti r);
+
+  void solve();
+  void process(Chunk& c);
+  void examine(Chunk& c, Pointi p);
+  bool find_stuck();
+  void reroll(Pointi p);
+
+  Pointi dims_;
+  Pointi start_;
+  float bomb_percentage_;
+  Array2D<uint8_t>& bombs_;
+  Array2D<int8_t> number_;
+  Array2D<Known> known_;
+  Array2D<uint8_t> pending_;  // Has an EXAMINE in its chunk's queue.
+  Pointi chunk_dims_;
+  std::vector<Chunk> chunks_;
+  Xoshiro256pp bitgen_;
+  ThreadPool pool_;
+  int passes_;
+  int rerolls_;
+};
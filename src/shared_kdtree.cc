@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "shared_kdtree.h"
+
+
+SharedKDTree::SharedKDTree() : root_(nullptr) {}
+
+SharedKDTree::SharedKDTree(const std::vector<Value>& values) : SharedKDTree() {
+  insert_many(values);
+}
+
+void SharedKDTree::clear() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  root_.store(nullptr);
+}
+
+bool SharedKDTree::insert(Value v) {
+  return insert_many(std::span(&v, 1));
+}
+
+bool SharedKDTree::remove(Pointi p) {
+  return remove_many(std::span(&p, 1));
+}
+
+int SharedKDTree::insert_many(std::span<const Value> values) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodePtr root = root_.load();
+  int inserted = 0;
+  for (const Value& v : values) {
+    // As in `KDTree`, a leaf deeper than this means some ancestor is unbalanced.
+    float max_depth = std::log((root ? root->size : 0) + 1) / std::log(1 / kAlpha);
+    bool too_deep = false;
+    NodePtr next = insert(root, v, 0, max_depth, too_deep);
+    if (next != root) {
+      root = std::move(next);
+      inserted += 1;
+    }
+  }
+  root_.store(std::move(root));
+  return inserted;
+}
+
+int SharedKDTree::remove_many(std::span<const Pointi> points) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodePtr root = root_.load();
+  int removed = 0;
+  for (Pointi p : points) {
+    NodePtr next = remove(root, p, 0);
+    if (next != root) {
+      root = std::move(next);
+      removed += 1;
+    }
+  }
+  root_.store(std::move(root));
+  return removed;
+}
+
+std::optional<SharedKDTree::Value> SharedKDTree::pop_closest(Pointi p) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodePtr root = root_.load();
+  if (!root || root->live == 0) {
+    return std::nullopt;
+  }
+  int best_dist = std::numeric_limits<int>::max();
+  const Node* best = nullptr;
+  find_closest(root.get(), p, 0, best_dist, best);
+  Value out = best->value;
+  root_.store(remove(root, out.p, 0));
+  return out;
+}
+
+auto SharedKDTree::make_node(const Value& value, bool removed, NodePtr left, NodePtr right)
+    -> NodePtr {
+  auto n = std::make_shared<Node>(
+      Node{value, removed, 1, !removed, value.p, value.p, {std::move(left), std::move(right)}});
+  for (const NodePtr& c : n->children) {
+    if (!c) {
+      continue;
+    }
+    n->size += c->size;
+    if (c->live > 0) {
+      if (n->live == 0) {
+        n->min = c->min;
+        n->max = c->max;
+      } else {
+        n->min = Pointi(std::min(n->min.x, c->min.x), std::min(n->min.y, c->min.y));
+        n->max = Pointi(std::max(n->max.x, c->max.x), std::max(n->max.y, c->max.y));
+      }
+      n->live += c->live;
+    }
+  }
+  return n;
+}
+
+auto SharedKDTree::insert(const NodePtr& node, Value v, int depth, float max_depth,
+                          bool& too_deep) -> NodePtr {
+  if (!node) {
+    too_deep = depth > max_depth;
+    return make_node(v, false, nullptr, nullptr);
+  }
+  if (node->value.p == v.p) {
+    if (!node->removed) {
+      return node;  // Value already exists
+    }
+    // Still in the right place, so bring it back.
+    return make_node(v, false, node->children[0], node->children[1]);
+  }
+
+  int side = !less(v.p, node->value.p, depth % 2);
+  NodePtr child = insert(node->children[side], v, depth + 1, max_depth, too_deep);
+  if (child == node->children[side]) {
+    return node;
+  }
+  int child_size = child->size;
+  NodePtr out = (side == 0 ? make_node(node->value, node->removed, std::move(child),
+                                       node->children[1])
+                           : make_node(node->value, node->removed, node->children[0],
+                                       std::move(child)));
+  // Rebuild the deepest unbalanced ancestor, as the scapegoat tree in `KDTree` does.
+  if (too_deep && child_size > kAlpha * out->size) {
+    too_deep = false;
+    return rebuild(out, depth);
+  }
+  return out;
+}
+
+auto SharedKDTree::remove(const NodePtr& node, Pointi p, int depth) -> NodePtr {
+  if (!node) {
+    return node;
+  }
+  if (node->value.p == p) {
+    if (node->removed) {
+      return node;
+    }
+    // Leaves can go, but inner nodes are left as tombstones.
+    if (!node->children[0] && !node->children[1]) {
+      return nullptr;
+    }
+    return make_node(node->value, true, node->children[0], node->children[1]);
+  }
+
+  int side = !less(p, node->value.p, depth % 2);
+  NodePtr child = remove(node->children[side], p, depth + 1);
+  if (child == node->children[side]) {
+    return node;
+  }
+  const NodePtr& other = node->children[!side];
+  if (node->removed && !child && !other) {
+    return nullptr;  // A tombstone that became a leaf.
+  }
+  NodePtr out = (side == 0 ? make_node(node->value, node->removed, std::move(child), other)
+                           : make_node(node->value, node->removed, other, std::move(child)));
+  int dead = out->size - out->live;
+  if (dead > kMinTombstones && dead > kMaxTombstones * out->size) {
+    return rebuild(out, depth);
+  }
+  return out;
+}
+
+auto SharedKDTree::find_node(const Node* node, Pointi p) -> const Node* {
+  for (int depth = 0; node; depth++) {
+    if (node->value.p == p) {
+      return node;
+    }
+    node = node->children[!less(p, node->value.p, depth % 2)].get();
+  }
+  return nullptr;
+}
+
+void SharedKDTree::find_closest(
+    const Node* node, Pointi p, int depth, int& best_dist, const Node*& best) {
+  if (!node || node->live == 0 || box_distance(p, *node) >= best_dist) {
+    return;
+  }
+  if (!node->removed) {
+    int dist = distance(p, node->value.p);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = node;
+    }
+  }
+  int first = !less(p, node->value.p, depth % 2);
+  find_closest(node->children[first].get(), p, depth + 1, best_dist, best);
+  find_closest(node->children[!first].get(), p, depth + 1, best_dist, best);
+}
+
+void SharedKDTree::find_in_rect(const Node* node, Recti r, std::vector<Value>& out) {
+  if (!node || node->live == 0 ||
+      node->max.x < r.left() || node->min.x >= r.right() ||
+      node->max.y < r.top() || node->min.y >= r.bottom()) {
+    return;
+  }
+  if (!node->removed && r.contains(node->value.p)) {
+    out.push_back(node->value);
+  }
+  for (const NodePtr& c : node->children) {
+    find_in_rect(c.get(), r, out);
+  }
+}
+
+void SharedKDTree::collect(const Node* node, std::vector<Value>& out) {
+  if (!node || node->live == 0) {
+    return;
+  }
+  if (!node->removed) {
+    out.push_back(node->value);
+  }
+  for (const NodePtr& c : node->children) {
+    collect(c.get(), out);
+  }
+}
+
+auto SharedKDTree::rebuild(const NodePtr& node, int depth) -> NodePtr {
+  std::vector<Value> values;
+  values.reserve(node->live);
+  collect(node.get(), values);
+  return build(values.begin(), values.end(), depth);
+}
+
+auto SharedKDTree::build(
+    std::vector<Value>::iterator start, std::vector<Value>::iterator end, int depth) -> NodePtr {
+  if (start == end) {
+    return nullptr;
+  }
+  int axis = depth % 2;
+  auto mid = start + (end - start) / 2;
+  std::nth_element(start, mid, end, [axis](const Value& a, const Value& b) {
+      return less(a.p, b.p, axis); });
+  NodePtr left = build(start, mid, depth + 1);
+  NodePtr right = build(mid + 1, end, depth + 1);
+  return make_node(*mid, false, std::move(left), std::move(right));
+}
+
+
+bool SharedKDTree::Snapshot::exists(Pointi p) const {
+  return bool(find(p));
+}
+
+std::optional<SharedKDTree::Value> SharedKDTree::Snapshot::find(Pointi p) const {
+  const Node* node = find_node(root_.get(), p);
+  return node && !node->removed ? std::optional(node->value) : std::nullopt;
+}
+
+SharedKDTree::Value SharedKDTree::Snapshot::find_closest(Pointi p) const {
+  assert(!empty());
+  int best_dist = std::numeric_limits<int>::max();
+  const Node* best = nullptr;
+  SharedKDTree::find_closest(root_.get(), p, 0, best_dist, best);
+  return best->value;
+}
+
+std::vector<SharedKDTree::Value> SharedKDTree::Snapshot::find_in_rect(Recti r) const {
+  std::vector<Value> out;
+  SharedKDTree::find_in_rect(root_.get(), r, out);
+  return out;
+}
+
+std::vector<SharedKDTree::Value> SharedKDTree::Snapshot::values() const {
+  std::vector<Value> out;
+  out.reserve(size());
+  collect(root_.get(), out);
+  return out;
+}
+
+
+void SharedKDTree::print_tree(std::ostream& stream) const {
+  print_tree(stream, snapshot().root_.get(), 0);
+}
+
+void SharedKDTree::print_tree(std::ostream& stream, const Node* node, int depth) {
+  if (!node) {
+    return;
+  }
+  stream << std::string(2 * depth, ' ') << node->value << (node->removed ? " removed" : "")
+         << std::endl;
+  for (const NodePtr& c : node->children) {
+    print_tree(stream, c.get(), depth + 1);
+  }
+}
+
+std::ostream& operator<<(std::ostream& stream, const SharedKDTree& t) {
+  t.print_tree(stream);
+  return stream;
+}
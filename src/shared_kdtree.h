@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "kdtree.h"
+#include "point.h"
+
+
+// A persistent KDTree that many threads can read while others write, without a global mutex.
+// Nodes are immutable and shared between versions: a write copies the path from the root to each
+// node it changes and publishes the new root atomically. Readers take a `Snapshot` of the latest
+// root and query it for as long as they like, and a version's nodes are freed by reference
+// counting once no snapshot or newer version uses them, so nothing is reclaimed under a reader.
+//
+// Writers are serialized with each other by a mutex, but never wait for readers. Balancing is the
+// same as `KDTree`: removed inner nodes stay as tombstones, and subtrees that get too unbalanced
+// or too full of tombstones are rebuilt, into new nodes as the old ones may still be in use.
+class SharedKDTree {
+ public:
+  typedef KDTree::Value Value;
+
+ private:
+  struct Node;
+  typedef std::shared_ptr<const Node> NodePtr;
+
+  struct Node {
+    Value value;
+    bool removed;
+    int size;  // Nodes in the subtree, including tombstones.
+    int live;  // Values in the subtree, not including tombstones.
+    Pointi min, max;  // Bounds of the live values, only valid if there are any.
+    NodePtr children[2];
+  };
+
+ public:
+  // An immutable version of the tree. It's cheap to copy, and keeps its nodes alive.
+  class Snapshot {
+   public:
+    Snapshot() = default;
+
+    bool empty() const { return size() == 0; }
+    int size() const { return root_ ? root_->live : 0; }
+
+    bool exists(Pointi p) const;
+    std::optional<Value> find(Pointi p) const;
+    Value find_closest(Pointi p) const;
+    std::vector<Value> find_in_rect(Recti r) const;
+    // All the values, in no particular order.
+    std::vector<Value> values() const;
+
+   private:
+    friend class SharedKDTree;
+    explicit Snapshot(NodePtr root) : root_(std::move(root)) {}
+
+    NodePtr root_;
+  };
+
+  SharedKDTree();
+  SharedKDTree(const std::vector<Value>& values);
+  SharedKDTree(const SharedKDTree&) = delete;
+  SharedKDTree& operator=(const SharedKDTree&) = delete;
+
+  // The latest version. Doesn't take the writers' mutex, so it never waits for a write.
+  Snapshot snapshot() const { return Snapshot(root_.load()); }
+  bool empty() const { return snapshot().empty(); }
+  int size() const { return snapshot().size(); }
+
+  bool insert(Value v);
+  bool remove(Pointi p);
+  // Applied in order and published once, so readers see all of a batch or none of it.
+  int insert_many(std::span<const Value> values);
+  int remove_many(std::span<const Pointi> points);
+  // Finds and removes the closest value in one write, so concurrent callers never get the same
+  // one. Empty if there are no values.
+  std::optional<Value> pop_closest(Pointi p);
+  void clear();
+
+  void print_tree(std::ostream& stream = std::cout) const;
+  void validate() const;  // Implemented and used in shared_kdtree_test.cc, not allowed elsewhere.
+
+ private:
+  // The same limits as `KDTree`.
+  static constexpr float kMaxTombstones = 0.25;
+  static constexpr int kMinTombstones = 16;
+  static constexpr float kAlpha = 0.6;
+
+  // Strict order along `axis`, breaking ties with the other one.
+  static bool less(Pointi a, Pointi b, int axis) {
+    return (a.coords[axis] < b.coords[axis] ||
+            (a.coords[axis] == b.coords[axis] && a.coords[!axis] < b.coords[!axis]));
+  }
+  static int distance(Pointi a, Pointi b) { return std::abs(a.x - b.x) + std::abs(a.y - b.y); }
+  // A lower bound on the distance from `p` to the live values under `n`.
+  static int box_distance(Pointi p, const Node& n) {
+    return distance(p, Pointi(std::clamp(p.x, n.min.x, n.max.x),
+                              std::clamp(p.y, n.min.y, n.max.y)));
+  }
+
+  // A new node with these children, and its counts and bounds set from them.
+  static NodePtr make_node(const Value& value, bool removed, NodePtr left, NodePtr right);
+  // Returns the new subtree, or `node` itself if nothing changed. `too_deep` is set when the new
+  // leaf is deeper than balancing allows, and cleared once an ancestor is rebuilt.
+  static NodePtr insert(const NodePtr& node, Value v, int depth, float max_depth,
+                        bool& too_deep);
+  static NodePtr remove(const NodePtr& node, Pointi p, int depth);
+  static const Node* find_node(const Node* node, Pointi p);
+  static void find_closest(
+      const Node* node, Pointi p, int depth, int& best_dist, const Node*& best);
+  static void find_in_rect(const Node* node, Recti r, std::vector<Value>& out);
+  static void collect(const Node* node, std::vector<Value>& out);
+  // Into new nodes, without the tombstones. `depth` sets the axes, to fit back into the tree.
+  static NodePtr rebuild(const NodePtr& node, int depth);
+  static NodePtr build(std::vector<Value>::iterator start, std::vector<Value>::iterator end,
+                       int depth);
+
+  static void print_tree(std::ostream& stream, const Node* node, int depth);
+  static void validate(const Node* node, int depth);
+
+  std::atomic<NodePtr> root_;
+  std::mutex write_mutex_;
+};
+
+std::ostream& operator<<(std::ostream& stream, const SharedKDTree& t);
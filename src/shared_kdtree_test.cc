@@ -0,0 +1,234 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "absl/algorithm/container.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_format.h"
+
+#include "catch2/catch_amalgamated.h"
+#include "kdtree.h"
+#include "point.h"
+#include "random.h"
+#include "shared_kdtree.h"
+
+
+void SharedKDTree::validate() const {
+  validate(snapshot().root_.get(), 0);
+}
+
+void SharedKDTree::validate(const Node* node, int depth) {
+  if (!node) {
+    return;
+  }
+  // The counts and bounds match the subtree, and the split puts each value on the right side.
+  int size = 1, live = !node->removed;
+  Pointi min = node->value.p, max = node->value.p;
+  for (int side = 0; side < 2; side++) {
+    const Node* c = node->children[side].get();
+    if (!c) {
+      continue;
+    }
+    validate(c, depth + 1);
+    size += c->size;
+    for (const Value& v : Snapshot(node->children[side]).values()) {
+      REQUIRE(less(v.p, node->value.p, depth % 2) == (side == 0));
+      if (live == 0) {
+        min = max = v.p;
+      }
+      min = Pointi(std::min(min.x, v.p.x), std::min(min.y, v.p.y));
+      max = Pointi(std::max(max.x, v.p.x), std::max(max.y, v.p.y));
+      live += 1;
+    }
+  }
+  REQUIRE(node->size == size);
+  REQUIRE(node->live == live);
+  REQUIRE((node->children[0] || node->children[1] || !node->removed));
+  if (live > 0) {
+    REQUIRE(node->min == min);
+    REQUIRE(node->max == max);
+  }
+}
+
+
+TEST_CASE("SharedKDTree", "[kdtree]") {
+  // Every operation matches `KDTree`, up to ties in distance, and snapshots don't change.
+  SharedKDTree shared;
+  KDTree tree;
+  Xoshiro256pp bitgen(Catch::getSeed());
+  auto gen_point = [&bitgen]() {
+    return Pointi(absl::Uniform(bitgen, 0, 30), absl::Uniform(bitgen, 0, 30));
+  };
+  auto dist = [](Pointi a, Pointi b) { return std::abs(a.x - b.x) + std::abs(a.y - b.y); };
+  auto by_point = [](std::vector<KDTree::Value> v) {
+    absl::c_sort(v, [](auto a, auto b) { return a.p < b.p; });
+    return v;
+  };
+
+  SharedKDTree::Snapshot old;
+  std::vector<KDTree::Value> old_values;
+  for (int i = 0; i < 5000; i++) {
+    Pointi p = gen_point();
+    CAPTURE(i, p);
+    int op = absl::Uniform(bitgen, 0, 10);
+    if (op < 5) {
+      REQUIRE(shared.insert({i, p}) == tree.insert({i, p}));
+    } else if (op < 7) {
+      REQUIRE(shared.remove(p) == tree.remove(p));
+    } else if (op < 9) {
+      REQUIRE(shared.snapshot().find(p) == tree.find(p));
+    } else if (!tree.empty()) {
+      REQUIRE(dist(p, shared.snapshot().find_closest(p).p) == dist(p, tree.find_closest(p).p));
+      std::optional<KDTree::Value> a = shared.pop_closest(p);
+      REQUIRE(a);
+      REQUIRE(tree.find(a->p) == a);
+      REQUIRE(tree.remove(a->p));
+    }
+    REQUIRE(shared.size() == tree.size());
+    if (i % 100 == 0) {
+      INFO(shared);
+      shared.validate();
+      std::vector<KDTree::Value> values(tree.begin(), tree.end());
+      REQUIRE(by_point(shared.snapshot().values()) == by_point(values));
+      Recti r(p, p + Pointi(absl::Uniform(bitgen, 0, 10), absl::Uniform(bitgen, 0, 10)));
+      REQUIRE(by_point(shared.snapshot().find_in_rect(r)) == by_point(tree.find_in_rect(r)));
+
+      REQUIRE(by_point(old.values()) == old_values);
+      old = shared.snapshot();
+      old_values = by_point(values);
+    }
+  }
+
+  SECTION("Bulk") {
+    std::vector<KDTree::Value> values;
+    std::vector<Pointi> points;
+    for (int i = 0; i < 200; i++) {
+      values.push_back({i, gen_point()});
+      points.push_back(gen_point());
+    }
+    REQUIRE(shared.insert_many(values) == tree.insert_many(values));
+    shared.validate();
+    REQUIRE(shared.remove_many(points) == tree.remove_many(points));
+    shared.validate();
+    std::vector<KDTree::Value> all(tree.begin(), tree.end());
+    REQUIRE(by_point(shared.snapshot().values()) == by_point(all));
+  }
+
+  SECTION("Clear") {
+    SharedKDTree::Snapshot before = shared.snapshot();
+    shared.clear();
+    REQUIRE(shared.empty());
+    REQUIRE(before.size() == tree.size());
+    REQUIRE_FALSE(shared.pop_closest({0, 0}));
+    REQUIRE(shared.insert({1, {2, 3}}));
+    REQUIRE(shared.snapshot().find({2, 3})->value == 1);
+  }
+}
+
+TEST_CASE("SharedKDTree concurrent", "[kdtree]") {
+  // Readers see consistent snapshots while writers change the tree, and concurrent pops each get
+  // a different value.
+  const int num_threads = 4;
+  const int num_points = 4000;
+  SharedKDTree shared;
+  std::vector<KDTree::Value> values;
+  for (int i = 0; i < num_points; i++) {
+    values.push_back({i, Pointi(i % 64, i / 64)});
+  }
+  shared.insert_many(values);
+
+  std::atomic<bool> done = false;
+  std::atomic<int> bad_snapshots = 0;
+  std::thread reader([&]() {
+    while (!done) {
+      SharedKDTree::Snapshot s = shared.snapshot();
+      if (int(s.values().size()) != s.size() ||
+          (!s.empty() && !s.exists(s.find_closest({32, 32}).p))) {
+        bad_snapshots += 1;
+      }
+    }
+  });
+
+  std::vector<std::vector<KDTree::Value>> popped(num_threads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      Xoshiro256pp bitgen(Catch::getSeed() + t);
+      while (auto v = shared.pop_closest(
+                 {absl::Uniform(bitgen, 0, 64), absl::Uniform(bitgen, 0, 64)})) {
+        popped[t].push_back(*v);
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  done = true;
+  reader.join();
+
+  REQUIRE(bad_snapshots == 0);
+  REQUIRE(shared.empty());
+  std::vector<KDTree::Value> all;
+  for (const auto& p : popped) {
+    all.insert(all.end(), p.begin(), p.end());
+  }
+  absl::c_sort(all, [](auto a, auto b) { return a.value < b.value; });
+  REQUIRE(all == values);
+}
+
+TEST_CASE("SharedKDTree Benchmark", "[kdtree]") {
+  // The same as the KDTree benchmarks, to compare them.
+  const int num_points = 10000;
+  const Pointi dims = {4000, 4000};
+
+  std::vector<SharedKDTree::Value> values;
+  values.reserve(num_points);
+  Xoshiro256pp bitgen(Catch::getSeed());
+
+  auto gen_point = [&bitgen, dims]() {
+    return Pointi(absl::Uniform(bitgen, 0, dims.x), absl::Uniform(bitgen, 0, dims.y));
+  };
+
+  {  // Generate `points`.
+    KDTree tree;
+    while (values.size() < num_points) {
+      KDTree::Value v(int(values.size()), gen_point());
+      if (tree.insert(v)) {
+        values.push_back(v);
+      }
+    }
+  }
+
+  BENCHMARK(absl::StrFormat("insert %d points", num_points)) {
+    SharedKDTree tree;
+    for (SharedKDTree::Value v : values) {
+      tree.insert(v);
+    }
+    return tree.size();
+  };
+
+  BENCHMARK_ADVANCED("snapshot + find_closest")(Catch::Benchmark::Chronometer meter) {
+    SharedKDTree tree(values);
+    meter.measure([&tree, &gen_point](int i) {
+      return tree.snapshot().find_closest(gen_point());
+    });
+  };
+
+  BENCHMARK_ADVANCED("insert + pop_closest")(Catch::Benchmark::Chronometer meter) {
+    SharedKDTree tree(values);
+    meter.measure([&tree, &gen_point](int i) {
+      tree.insert({i, gen_point()});
+      return tree.pop_closest(gen_point());
+    });
+  };
+
+  BENCHMARK_ADVANCED("insert + remove")(Catch::Benchmark::Chronometer meter) {
+    SharedKDTree tree(values);
+    meter.measure([&tree, &values](int i) {
+      Pointi p = values[i % values.size()].p;
+      tree.remove(p);
+      tree.insert({i, p});
+      return tree.size();
+    });
+  };
+}
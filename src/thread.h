@@ -1,8 +1,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
 #include <thread>
 #include <utility>
+#include <vector>
 
 
 template <class T>
@@ -34,3 +41,100 @@ class MutexProtected {
   std::mutex mutex;
   T v;
 };
+
+
+// A fixed set of worker threads that run a blocking `parallel_for`. The calling thread also does
+// work, so a pool of size 1 has no workers and just runs the loop inline.
+class ThreadPool {
+ public:
+  ThreadPool(int threads = 0) {
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers_.reserve(threads - 1);
+    for (int i = 1; i < threads; i++) {
+      workers_.emplace_back([this]() { worker(); });
+    }
+  }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const { return workers_.size() + 1; }
+
+  // Calls `f(i)` for each `i` in [0, n), returning once all calls are done. Not reentrant.
+  void parallel_for(int n, const std::function<void(int)>& f) {
+    if (n <= 0) {
+      return;
+    } else if (n == 1 || workers_.empty()) {
+      for (int i = 0; i < n; i++) {
+        f(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &f;
+      job_size_ = n;
+      next_ = 0;
+      active_ = workers_.size();
+      generation_ += 1;
+    }
+    work_cv_.notify_all();
+    run_job(f, n);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]() { return active_ == 0; });
+    job_ = nullptr;
+  }
+
+ private:
+  void run_job(const std::function<void(int)>& f, int n) {
+    for (int i = next_++; i < n; i = next_++) {
+      f(i);
+    }
+  }
+
+  void worker() {
+    uint64_t seen = 0;
+    while (true) {
+      const std::function<void(int)>* job;
+      int n;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+        job = job_;
+        n = job_size_;
+      }
+      run_job(*job, n);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_ -= 1;
+      }
+      done_cv_.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int)>* job_ = nullptr;
+  int job_size_ = 0;
+  std::atomic<int> next_ = 0;
+  int active_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+};
@@ -1,4 +1,5 @@
 
+#include <atomic>
 #include <string>
 #include <thread>
 #include <vector>
@@ -56,5 +57,21 @@ TEST_CASE("Thread", "[thread]") {
     }
     REQUIRE(*value.lock() == 100000);
   }
+}
 
-}
\ No newline at end of file
+TEST_CASE("ThreadPool", "[thread]") {
+  for (int threads : {1, 2, 4}) {
+    ThreadPool pool(threads);
+    REQUIRE(pool.size() == threads);
+
+    pool.parallel_for(0, [](int i) { FAIL("Called on an empty range"); });
+
+    std::vector<std::atomic<int>> counts(1000);
+    for (int round = 0; round < 10; round++) {
+      pool.parallel_for(counts.size(), [&counts](int i) { counts[i] += 1; });
+    }
+    for (auto& c : counts) {
+      REQUIRE(c == 10);
+    }
+  }
+}
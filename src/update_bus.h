@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+// A single-producer, multi-consumer ring buffer of updates, so each consumer of `Env::step` can
+// read the updates at its own pace instead of everything walking the same vector in lockstep.
+//
+// The producer never waits on consumers. A consumer that falls more than `capacity` updates
+// behind misses the oldest ones, and is told how many it missed so it can resynchronize, eg by
+// re-sending the whole view. Consumers may run on other threads than the producer, but each
+// `Subscriber` must only be used by one thread at a time.
+class UpdateBus {
+ public:
+  class Subscriber {
+   public:
+    Subscriber() : bus_(nullptr), next_(0) {}
+
+    // Calls `f(update)` for up to `max` updates that haven't been seen yet, oldest first, and
+    // returns how many were missed by falling too far behind.
+    template<class F>
+    uint64_t drain(F&& f, uint64_t max = UINT64_MAX) {
+      assert(bus_);
+      uint64_t missed = 0;
+      for (uint64_t read = 0; read < max; read++) {
+        uint64_t head = bus_->head_.load(std::memory_order_acquire);
+        if (next_ == head) {
+          break;
+        } else if (head - next_ > bus_->capacity()) {
+          missed += head - bus_->capacity() - next_;
+          next_ = head - bus_->capacity();
+        }
+        Update u;
+        if (bus_->read(next_, u)) {
+          f(u);
+          next_ += 1;
+        }
+        // Otherwise it was overwritten while reading, so loop to skip ahead.
+      }
+      return missed;
+    }
+
+    uint64_t next() const { return next_; }  // Sequence number of the next update to read.
+    uint64_t lag() const { return bus_->head() - next_; }
+
+   private:
+    Subscriber(const UpdateBus* bus, uint64_t next) : bus_(bus), next_(next) {}
+
+    const UpdateBus* bus_;
+    uint64_t next_;
+
+    friend UpdateBus;
+  };
+
+  // `capacity` is rounded up to a power of two.
+  UpdateBus(uint64_t capacity) : head_(0) {
+    uint64_t c = 1;
+    while (c < capacity) {
+      c *= 2;
+    }
+    slots_ = std::vector<Slot>(c);
+    mask_ = c - 1;
+  }
+  UpdateBus(const UpdateBus&) = delete;
+  UpdateBus& operator=(const UpdateBus&) = delete;
+
+  uint64_t capacity() const { return mask_ + 1; }
+  uint64_t head() const { return head_.load(std::memory_order_acquire); }
+
+  // Subscribers only see updates published after they subscribe.
+  Subscriber subscribe() const { return Subscriber(this, head()); }
+
+  // Only to be called from the producer thread.
+  void publish(const Update& u) {
+    uint64_t seq = head_.load(std::memory_order_relaxed);
+    write(seq, u);
+    head_.store(seq + 1, std::memory_order_release);
+  }
+  void publish(const std::vector<Update>& updates) {
+    uint64_t seq = head_.load(std::memory_order_relaxed);
+    for (const Update& u : updates) {
+      write(seq++, u);
+    }
+    head_.store(seq, std::memory_order_release);
+  }
+
+ private:
+  // A seqlock per slot. The contents are atomics, so a torn read is detected instead of being a
+  // data race, and the update is packed into two words to keep those cheap.
+  struct Slot {
+    std::atomic<uint64_t> seq = UINT64_MAX;
+    std::atomic<uint64_t> point;
+    std::atomic<uint64_t> state_user;
+  };
+  static constexpr uint64_t kWriting = UINT64_MAX;
+
+  void write(uint64_t seq, const Update& u) {
+    Slot& s = slots_[seq & mask_];
+    s.seq.store(kWriting, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.point.store((uint64_t(uint32_t(u.point.x)) << 32) | uint32_t(u.point.y),
+                  std::memory_order_relaxed);
+    s.state_user.store((uint64_t(uint8_t(u.state)) << 32) | uint32_t(u.user),
+                       std::memory_order_relaxed);
+    s.seq.store(seq, std::memory_order_release);
+  }
+
+  bool read(uint64_t seq, Update& u) const {
+    const Slot& s = slots_[seq & mask_];
+    if (s.seq.load(std::memory_order_acquire) != seq) {
+      return false;
+    }
+    uint64_t point = s.point.load(std::memory_order_relaxed);
+    uint64_t state_user = s.state_user.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    u.point = Pointi(int32_t(point >> 32), int32_t(point));
+    u.state = CellState(int8_t(state_user >> 32));
+    u.user = int32_t(state_user);
+    return true;
+  }
+
+  std::vector<Slot> slots_;
+  uint64_t mask_;
+  std::atomic<uint64_t> head_;
+};
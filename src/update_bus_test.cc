@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch_amalgamated.h"
+#include "minesweeper.h"
+#include "point.h"
+#include "update_bus.h"
+
+
+namespace {
+Update make_update(int i) {
+  return {CellState(i % 9), Pointi(i, -i), i};
+}
+}  // namespace
+
+TEST_CASE("UpdateBus", "[update_bus]") {
+  UpdateBus bus(6);
+  REQUIRE(bus.capacity() == 8);
+  REQUIRE(bus.head() == 0);
+
+  UpdateBus::Subscriber early = bus.subscribe();
+  bus.publish(make_update(0));
+  UpdateBus::Subscriber late = bus.subscribe();
+  bus.publish({make_update(1), make_update(2), make_update(3)});
+  REQUIRE(bus.head() == 4);
+  REQUIRE(early.lag() == 4);
+  REQUIRE(late.lag() == 3);
+
+  std::vector<int> seen;
+  auto record = [&seen](Update u) {
+    REQUIRE(u.state == CellState(u.user % 9));
+    REQUIRE(u.point == Pointi(u.user, -u.user));
+    seen.push_back(u.user);
+  };
+
+  // Each subscriber reads at its own pace.
+  REQUIRE(early.drain(record, 2) == 0);
+  REQUIRE(seen == std::vector{0, 1});
+  seen.clear();
+  REQUIRE(late.drain(record) == 0);
+  REQUIRE(seen == std::vector{1, 2, 3});
+  seen.clear();
+  REQUIRE(late.drain(record) == 0);
+  REQUIRE(seen.empty());
+  REQUIRE(late.lag() == 0);
+
+  // Falling more than the capacity behind loses the oldest updates.
+  for (int i = 4; i < 14; i++) {
+    bus.publish(make_update(i));
+  }
+  REQUIRE(early.lag() == 12);
+  REQUIRE(early.drain(record) == 4);
+  REQUIRE(seen == std::vector{6, 7, 8, 9, 10, 11, 12, 13});
+  REQUIRE(early.next() == 14);
+  seen.clear();
+  REQUIRE(late.drain(record) == 2);
+  REQUIRE(seen == std::vector{6, 7, 8, 9, 10, 11, 12, 13});
+}
+
+TEST_CASE("UpdateBus threads", "[update_bus]") {
+  // Consumers on other threads see updates in order, and every one is either seen or reported
+  // missed, no matter how far behind they fall.
+  const int count = 200000;
+  UpdateBus bus(1024);
+  std::vector<UpdateBus::Subscriber> subscribers = {bus.subscribe(), bus.subscribe()};
+  std::vector<int64_t> seen(subscribers.size(), 0), missed(subscribers.size(), 0);
+  std::vector<char> ordered(subscribers.size(), true);  // Not vector<bool>, which shares words.
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < int(subscribers.size()); t++) {
+    threads.emplace_back([&, t]() {
+      int last = -1;
+      while (seen[t] + missed[t] < count) {
+        missed[t] += subscribers[t].drain([&](Update u) {
+          ordered[t] = ordered[t] && u.user > last && u.point == Pointi(u.user, -u.user);
+          last = u.user;
+          seen[t] += 1;
+        }, t == 0 ? 1 : 100);  // One slow, one fast.
+      }
+    });
+  }
+  std::vector<Update> batch;
+  for (int i = 0; i < count; i++) {
+    batch.push_back(make_update(i));
+    if (batch.size() == 10) {
+      bus.publish(batch);
+      batch.clear();
+    }
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  for (int t = 0; t < int(subscribers.size()); t++) {
+    CAPTURE(t);
+    REQUIRE(ordered[t]);
+    REQUIRE(seen[t] > 0);
+    REQUIRE(seen[t] + missed[t] == count);
+  }
+}
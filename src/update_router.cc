@@ -0,0 +1,73 @@
+#include "update_router.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+UpdateRouter::UpdateRouter(Pointi dims, int region_size) :
+    dims_(dims), region_size_(region_size),
+    regions_((dims.x + region_size - 1) / region_size, (dims.y + region_size - 1) / region_size),
+    region_subscribers_(regions_.x * regions_.y) {}
+
+int UpdateRouter::subscribe(Recti area) {
+  areas_.push_back(area);
+  routed_.emplace_back();
+  add(areas_.size() - 1);
+  return areas_.size() - 1;
+}
+
+void UpdateRouter::move(int subscriber, Recti area) {
+  remove(subscriber);
+  areas_[subscriber] = area;
+  add(subscriber);
+}
+
+void UpdateRouter::route(const std::vector<Update>& updates) {
+  for (auto& r : routed_) {
+    r.clear();
+  }
+  for (const Update& u : updates) {
+    if (u.point.x < 0 || u.point.y < 0 || u.point.x >= dims_.x || u.point.y >= dims_.y) {
+      continue;
+    }
+    int region = u.point.y / region_size_ * regions_.x + u.point.x / region_size_;
+    for (int s : region_subscribers_[region]) {
+      if (areas_[s].contains(u.point)) {
+        routed_[s].push_back(u);
+      }
+    }
+  }
+}
+
+Recti UpdateRouter::regions(Recti area) const {
+  std::optional<Recti> clipped = area.intersection(Recti({0, 0}, dims_));
+  if (!clipped) {
+    return Recti();
+  }
+  return Recti({clipped->left() / region_size_, clipped->top() / region_size_},
+               {(clipped->right() - 1) / region_size_ + 1,
+                (clipped->bottom() - 1) / region_size_ + 1});
+}
+
+void UpdateRouter::add(int subscriber) {
+  Recti r = regions(areas_[subscriber]);
+  for (int y = r.top(); y < r.bottom(); y++) {
+    for (int x = r.left(); x < r.right(); x++) {
+      region_subscribers_[y * regions_.x + x].push_back(subscriber);
+    }
+  }
+}
+
+void UpdateRouter::remove(int subscriber) {
+  Recti r = regions(areas_[subscriber]);
+  for (int y = r.top(); y < r.bottom(); y++) {
+    for (int x = r.left(); x < r.right(); x++) {
+      std::vector<int>& subs = region_subscribers_[y * regions_.x + x];
+      subs.erase(std::find(subs.begin(), subs.end(), subscriber));
+    }
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "minesweeper.h"
+#include "point.h"
+
+
+// Splits each step's updates among subscribers by where they are, so an agent that only works in
+// part of the board only walks the updates there, instead of every agent walking all of them.
+//
+// Each subscriber has an area of the board, and gets the updates inside it, in the order they were
+// routed. The board is divided into square regions that each list the subscribers overlapping
+// them, so routing an update only checks the few subscribers near it. Areas may overlap, and
+// whoever consumes the updates should include any margin it needs, eg for updates next to its
+// area that change what it can do inside it.
+class UpdateRouter {
+ public:
+  UpdateRouter(Pointi dims, int region_size = 64);
+
+  // Returns the id of the new subscriber, which are handed out from 0.
+  int subscribe(Recti area);
+  // Changes the area of a subscriber, taking effect from the next `route`.
+  void move(int subscriber, Recti area);
+  int subscribers() const { return areas_.size(); }
+  Recti area(int subscriber) const { return areas_[subscriber]; }
+
+  // Replaces the updates each subscriber has with its share of `updates`.
+  void route(const std::vector<Update>& updates);
+  const std::vector<Update>& updates(int subscriber) const { return routed_[subscriber]; }
+
+ private:
+  // The regions overlapping `area`, clipped to the board.
+  Recti regions(Recti area) const;
+  void add(int subscriber);
+  void remove(int subscriber);
+
+  Pointi dims_;
+  int region_size_;
+  Pointi regions_;  // Number of regions along each axis.
+  std::vector<std::vector<int>> region_subscribers_;  // Row major.
+  std::vector<Recti> areas_;
+  std::vector<std::vector<Update>> routed_;
+};
@@ -0,0 +1,72 @@
+#include <memory>
+#include <vector>
+
+#include "catch2/catch_amalgamated.h"
+#include "agent_last.h"
+#include "agent_round.h"
+#include "env.h"
+#include "minesweeper.h"
+#include "point.h"
+#include "update_router.h"
+
+
+TEST_CASE("UpdateRouter", "[update_router]") {
+  UpdateRouter router({100, 50}, 16);
+  int left = router.subscribe(Recti({-2, -2}, {52, 52}));
+  int right = router.subscribe(Recti({48, -2}, {102, 52}));
+  int corner = router.subscribe(Recti({90, 40}, {95, 45}));
+  REQUIRE(router.subscribers() == 3);
+
+  auto points = [&router](int s) {
+    std::vector<Pointi> out;
+    for (const Update& u : router.updates(s)) {
+      out.push_back(u.point);
+    }
+    return out;
+  };
+
+  std::vector<Update> updates = {
+      {ZERO, {0, 0}, 1}, {ONE, {50, 10}, 1}, {TWO, {99, 49}, 2}, {MARKED, {92, 44}, 2},
+      {ZERO, {49, 0}, 1}, {ZERO, {200, 10}, 1}};  // The last is off the board.
+  router.route(updates);
+  // In their original order, and in both areas where they overlap.
+  REQUIRE(points(left) == std::vector<Pointi>{{0, 0}, {50, 10}, {49, 0}});
+  REQUIRE(points(right) == std::vector<Pointi>{{50, 10}, {99, 49}, {92, 44}, {49, 0}});
+  REQUIRE(points(corner) == std::vector<Pointi>{{92, 44}});
+
+  // Each route replaces the last.
+  router.move(corner, Recti({0, 0}, {10, 10}));
+  REQUIRE(router.area(corner) == Recti({0, 0}, {10, 10}));
+  router.route({{ONE, {92, 44}, 1}, {ONE, {5, 5}, 1}});
+  REQUIRE(points(left) == std::vector<Pointi>{{5, 5}});
+  REQUIRE(points(right) == std::vector<Pointi>{{92, 44}});
+  REQUIRE(points(corner) == std::vector<Pointi>{{5, 5}});
+
+  router.route({});
+  REQUIRE(router.updates(left).empty());
+}
+
+TEST_CASE("UpdateRouter with agents", "[update_router]") {
+  // Agents in stripes only see their stripe and the 2 cells each side that can change what they
+  // can do in it, which is enough to get as far as a single agent that sees everything.
+  Pointi dims(120, 60);
+  UpdateRouter router(dims, 16);
+  int stripes = 5;
+  auto make_agents = [&router, dims, stripes](Env& env) {
+    std::vector<std::unique_ptr<Agent>> agents;
+    for (int s = 0; s < stripes; s++) {
+      agents.push_back(std::make_unique<AgentLast>(env.state(), s + 1));
+      router.subscribe(Recti({dims.x * s / stripes - 2, -2},
+                             {dims.x * (s + 1) / stripes + 2, dims.y + 2}));
+    }
+    return agents;
+  };
+  auto make_agent = [](Env& env) {
+    std::vector<std::unique_ptr<Agent>> agents;
+    agents.push_back(std::make_unique<AgentLast>(env.state(), 1));
+    return agents;
+  };
+
+  REQUIRE(AgentRound::play_to_end(dims, make_agents, 0, &router) ==
+          AgentRound::play_to_end(dims, make_agent));
+}